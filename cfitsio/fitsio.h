@@ -172,8 +172,12 @@ SERVICES PROVIDED HEREUNDER."
 #include "longnam.h"
 #endif
  
+#ifndef NIOBUF
 #define NIOBUF  40  /* number of IO buffers to create (default = 40) */
           /* !! Significantly increasing NIOBUF may degrade performance !! */
+          /* Programs must be compiled with the same value as the library, */
+          /* since it determines the layout of the FITSfile structure.     */
+#endif
 
 #define IOBUFLEN 2880    /* size in bytes of each IO buffer (DONT CHANGE!) */
 
@@ -32,6 +32,27 @@ extern int Fitsio_Pthread_Status;
 #define FFUNLOCK
 #endif
 
+/*
+  The byte swapping and data conversion routines can use SSSE3 and AVX2
+  kernels, selected at run time according to the CPU: this requires the
+  "target" function attribute and __builtin_cpu_supports(), available
+  since GCC 4.9 and clang 3.9.  Setting the CFITSIO_NO_SIMD environment
+  variable disables them.
+*/
+#if defined(__clang__)
+#if __clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 9)
+#define HAVE_CPU_DISPATCH
+#endif
+#elif __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define HAVE_CPU_DISPATCH
+#endif
+#if defined(HAVE_CPU_DISPATCH) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_DISPATCH
+#define FF_CPU_SSSE3 1
+#define FF_CPU_AVX2  2
+int ffcpufeatures(void);
+#endif
+
 /*
   If REPLACE_LINKS is defined, then whenever CFITSIO fails to open
   a file with write access because it is a soft link to a file that
@@ -46,7 +67,13 @@ extern int Fitsio_Pthread_Status;
 
 #define USE_LARGE_VALUE -99  /* flag used when writing images */
 
-#define DBUFFSIZE 28800 /* size of data buffer in bytes */
+#ifndef DBUFFSIZE
+/* size of data buffer in bytes, raised from 28800 (10 FITS blocks):   */
+/* large pixel reads are converted in chunks of this size, and bigger  */
+/* chunks make whole image reads faster while still fitting in the CPU */
+/* cache.  Some buffers of this size are allocated on the stack.       */
+#define DBUFFSIZE 115200
+#endif
 
 #define NMAXFILES  300   /* maximum number of FITS files that can be opened */
         /* CFITSIO will allocate (NMAXFILES * 80) bytes of memory */
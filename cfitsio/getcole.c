@@ -1058,6 +1058,121 @@ int fffi1r4(unsigned char *input, /* I - array of values to be converted     */
     return(*status);
 }
 /*--------------------------------------------------------------------------*/
+#ifdef HAVE_SIMD_DISPATCH
+#include <immintrin.h>
+
+/*
+  AVX2 versions of the most used conversions, for the case where no null
+  checking is required.  The scaling is computed in double precision with
+  separate multiply and add instructions, exactly like the C code, so that
+  the results are identical.
+*/
+__attribute__((target("avx2")))
+static inline __m256 ffscale8_avx2(__m256d lo, __m256d hi,
+                                   __m256d vscale, __m256d vzero)
+{
+    __m128 flo, fhi;
+
+    flo = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(lo, vscale), vzero));
+    fhi = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(hi, vscale), vzero));
+    return(_mm256_insertf128_ps(_mm256_castps128_ps256(flo), fhi, 1));
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void fffi2r4_avx2(short *input, long ntodo, double scale, double zero,
+                         float *output)
+{
+    long ii;
+    __m256i v;
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256d vzero = _mm256_set1_pd(zero);
+
+    if (scale == 1. && zero == 0.)
+    {
+        for (ii = 0; ii + 8 <= ntodo; ii += 8)
+        {
+            v = _mm256_cvtepi16_epi32(
+                    _mm_loadu_si128((__m128i *) &input[ii]));
+            _mm256_storeu_ps(&output[ii], _mm256_cvtepi32_ps(v));
+        }
+        for (; ii < ntodo; ii++)
+            output[ii] = (float) input[ii];
+    }
+    else
+    {
+        for (ii = 0; ii + 8 <= ntodo; ii += 8)
+        {
+            v = _mm256_cvtepi16_epi32(
+                    _mm_loadu_si128((__m128i *) &input[ii]));
+            _mm256_storeu_ps(&output[ii], ffscale8_avx2(
+                    _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)),
+                    _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)),
+                    vscale, vzero));
+        }
+        for (; ii < ntodo; ii++)
+            output[ii] = (float) (input[ii] * scale + zero);
+    }
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void fffi4r4_avx2(INT32BIT *input, long ntodo, double scale,
+                         double zero, float *output)
+{
+    long ii;
+    __m256i v;
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256d vzero = _mm256_set1_pd(zero);
+
+    if (scale == 1. && zero == 0.)
+    {
+        for (ii = 0; ii + 8 <= ntodo; ii += 8)
+        {
+            v = _mm256_loadu_si256((__m256i *) &input[ii]);
+            _mm256_storeu_ps(&output[ii], _mm256_cvtepi32_ps(v));
+        }
+        for (; ii < ntodo; ii++)
+            output[ii] = (float) input[ii];
+    }
+    else
+    {
+        for (ii = 0; ii + 8 <= ntodo; ii += 8)
+        {
+            v = _mm256_loadu_si256((__m256i *) &input[ii]);
+            _mm256_storeu_ps(&output[ii], ffscale8_avx2(
+                    _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)),
+                    _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)),
+                    vscale, vzero));
+        }
+        for (; ii < ntodo; ii++)
+            output[ii] = (float) (input[ii] * scale + zero);
+    }
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void fffr4r4_avx2(float *input, long ntodo, double scale, double zero,
+                         float *output)
+/*
+  input and output can be the same array
+*/
+{
+    long ii;
+    __m256 v;
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256d vzero = _mm256_set1_pd(zero);
+
+    for (ii = 0; ii + 8 <= ntodo; ii += 8)
+    {
+        v = _mm256_loadu_ps(&input[ii]);
+        _mm256_storeu_ps(&output[ii], ffscale8_avx2(
+                _mm256_cvtps_pd(_mm256_castps256_ps128(v)),
+                _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)),
+                vscale, vzero));
+    }
+    for (; ii < ntodo; ii++)
+        output[ii] = (float) (input[ii] * scale + zero);
+}
+/*--------------------------------------------------------------------------*/
+#endif
 int fffi2r4(short *input,         /* I - array of values to be converted     */
             long ntodo,           /* I - number of elements in the array     */
             double scale,         /* I - FITS TSCALn or BSCALE value         */
@@ -1089,6 +1204,13 @@ int fffi2r4(short *input,         /* I - array of values to be converted     */
 
     if (nullcheck == 0)     /* no null checking required */
     {
+#ifdef HAVE_SIMD_DISPATCH
+        if (ffcpufeatures() & FF_CPU_AVX2)
+        {
+            fffi2r4_avx2(input, ntodo, scale, zero, output);
+            return(*status);
+        }
+#endif
         if (scale == 1. && zero == 0.)      /* no scaling */
         {       
             for (ii = 0; ii < ntodo; ii++)
@@ -1173,6 +1295,13 @@ int fffi4r4(INT32BIT *input,      /* I - array of values to be converted     */
 
     if (nullcheck == 0)     /* no null checking required */
     {
+#ifdef HAVE_SIMD_DISPATCH
+        if (ffcpufeatures() & FF_CPU_AVX2)
+        {
+            fffi4r4_avx2(input, ntodo, scale, zero, output);
+            return(*status);
+        }
+#endif
         if (scale == 1. && zero == 0.)      /* no scaling */
         {       
             for (ii = 0; ii < ntodo; ii++)
@@ -1347,6 +1476,13 @@ int fffr4r4(float *input,         /* I - array of values to be converted     */
         }
         else             /* must scale the data */
         {
+#ifdef HAVE_SIMD_DISPATCH
+            if (ffcpufeatures() & FF_CPU_AVX2)
+            {
+                fffr4r4_avx2(input, ntodo, scale, zero, output);
+                return(*status);
+            }
+#endif
             for (ii = 0; ii < ntodo; ii++)
             {
                 output[ii] = (float) (input[ii] * scale + zero);
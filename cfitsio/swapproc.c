@@ -69,11 +69,7 @@ static void ffswap2_slow(short *svalues, long nvals)
 }
 /*--------------------------------------------------------------------------*/
 #if __SSE2__
-void ffswap2(short *svalues,  /* IO - pointer to shorts to be swapped    */
-             long nvals)     /* I  - number of shorts to be swapped     */
-/*
-  swap the bytes in the input short integers: ( 0 1 -> 1 0 )
-*/
+static void ffswap2_sse2(short *svalues, long nvals)
 {
     if ((long)svalues % 2 != 0) { /* should not happen */
         ffswap2_slow(svalues, nvals);
@@ -89,15 +85,6 @@ void ffswap2(short *svalues,  /* IO - pointer to shorts to be swapped    */
     }
     ffswap2_slow(&svalues[ii], nvals - ii);
 }
-#else
-void ffswap2(short *svalues,  /* IO - pointer to shorts to be swapped    */
-             long nvals)     /* I  - number of shorts to be swapped     */
-/*
-  swap the bytes in the input 4-byte integer: ( 0 1 2 3 -> 3 2 1 0 )
-*/
-{
-    ffswap2_slow(svalues, nvals);
-}
 #endif
 /*--------------------------------------------------------------------------*/
 static void ffswap4_slow(INT32BIT *ivalues, long nvals)
@@ -135,11 +122,7 @@ static void ffswap4_slow(INT32BIT *ivalues, long nvals)
 }
 /*--------------------------------------------------------------------------*/
 #ifdef __SSSE3__
-void ffswap4(INT32BIT *ivalues,  /* IO - pointer to INT*4 to be swapped    */
-                 long nvals)     /* I  - number of floats to be swapped     */
-/*
-  swap the bytes in the input 4-byte integer: ( 0 1 2 3 -> 3 2 1 0 )
-*/
+static void ffswap4_ssse3(INT32BIT *ivalues, long nvals)
 {
     if ((long)ivalues % 4 != 0) { /* should not happen */
         ffswap4_slow(ivalues, nvals);
@@ -158,15 +141,6 @@ void ffswap4(INT32BIT *ivalues,  /* IO - pointer to INT*4 to be swapped    */
     }
     ffswap4_slow(&ivalues[ii], nvals - ii);
 }
-#else
-void ffswap4(INT32BIT *ivalues,  /* IO - pointer to INT*4 to be swapped    */
-                 long nvals)     /* I  - number of floats to be swapped     */
-/*
-  swap the bytes in the input 4-byte integer: ( 0 1 2 3 -> 3 2 1 0 )
-*/
-{
-    ffswap4_slow(ivalues, nvals);
-}
 #endif
 /*--------------------------------------------------------------------------*/
 static void ffswap8_slow(double *dvalues, long nvals)
@@ -214,11 +188,7 @@ static void ffswap8_slow(double *dvalues, long nvals)
 }
 /*--------------------------------------------------------------------------*/
 #ifdef __SSSE3__
-void ffswap8(double *dvalues,  /* IO - pointer to doubles to be swapped     */
-             long nvals)       /* I  - number of doubles to be swapped      */
-/*
-  swap the bytes in the input doubles: ( 01234567  -> 76543210 )
-*/
+static void ffswap8_ssse3(double *dvalues, long nvals)
 {
     if ((long)dvalues % 8 != 0) { /* should not happen on amd64 */
         ffswap8_slow(dvalues, nvals);
@@ -235,13 +205,199 @@ void ffswap8(double *dvalues,  /* IO - pointer to doubles to be swapped     */
     }
     ffswap8_slow(&dvalues[ii], nvals - ii);
 }
+#endif
+/*--------------------------------------------------------------------------*/
+#ifdef HAVE_SIMD_DISPATCH
+#include <immintrin.h>
+
+static int ffcpu_features = 0;
+#ifdef _REENTRANT
+static pthread_once_t ffcpu_once = PTHREAD_ONCE_INIT;
 #else
+static int ffcpu_done = 0;
+#endif
+
+static void ffcpuinit(void)
+/*
+  detect the SIMD instruction sets supported by the CPU
+*/
+{
+    if (getenv("CFITSIO_NO_SIMD"))
+        return;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        ffcpu_features |= FF_CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        ffcpu_features |= FF_CPU_AVX2;
+}
+
+int ffcpufeatures(void)
+/*
+  return the FF_CPU_* flags of the SIMD instruction sets which can be used;
+  the CPU is only inspected by the first call.
+*/
+{
+#ifdef _REENTRANT
+    pthread_once(&ffcpu_once, ffcpuinit);
+#else
+    if (!ffcpu_done)
+    {
+        ffcpuinit();
+        ffcpu_done = 1;
+    }
+#endif
+    return(ffcpu_features);
+}
+/*--------------------------------------------------------------------------*/
+/*  The following kernels use unaligned loads and stores, which cost the    */
+/*  same as aligned ones on the CPUs supporting these instructions.         */
+/*--------------------------------------------------------------------------*/
+#ifndef __SSSE3__
+__attribute__((target("ssse3")))
+static void ffswap4_ssse3_rt(INT32BIT *ivalues, long nvals)
+{
+    long ii;
+    const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                      4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (ii = 0; ii + 4 <= nvals; ii += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *) &ivalues[ii]);
+        _mm_storeu_si128((__m128i *) &ivalues[ii], _mm_shuffle_epi8(v, mask));
+    }
+    ffswap4_slow(&ivalues[ii], nvals - ii);
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("ssse3")))
+static void ffswap8_ssse3_rt(double *dvalues, long nvals)
+{
+    long ii;
+    const __m128i mask = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                      0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (ii = 0; ii + 2 <= nvals; ii += 2) {
+        __m128i v = _mm_loadu_si128((__m128i *) &dvalues[ii]);
+        _mm_storeu_si128((__m128i *) &dvalues[ii], _mm_shuffle_epi8(v, mask));
+    }
+    ffswap8_slow(&dvalues[ii], nvals - ii);
+}
+#endif
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void ffswap2_avx2(short *svalues, long nvals)
+{
+    long ii;
+
+    for (ii = 0; ii + 16 <= nvals; ii += 16) {
+        __m256i v = _mm256_loadu_si256((__m256i *) &svalues[ii]);
+        v = _mm256_or_si256(_mm256_srli_epi16(v, 8), _mm256_slli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *) &svalues[ii], v);
+    }
+    ffswap2_slow(&svalues[ii], nvals - ii);
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void ffswap4_avx2(INT32BIT *ivalues, long nvals)
+{
+    long ii;
+    const __m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                         4, 5, 6, 7, 0, 1, 2, 3,
+                                         12, 13, 14, 15, 8, 9, 10, 11,
+                                         4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (ii = 0; ii + 8 <= nvals; ii += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i *) &ivalues[ii]);
+        _mm256_storeu_si256((__m256i *) &ivalues[ii],
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    ffswap4_slow(&ivalues[ii], nvals - ii);
+}
+/*--------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void ffswap8_avx2(double *dvalues, long nvals)
+{
+    long ii;
+    const __m256i mask = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (ii = 0; ii + 4 <= nvals; ii += 4) {
+        __m256i v = _mm256_loadu_si256((__m256i *) &dvalues[ii]);
+        _mm256_storeu_si256((__m256i *) &dvalues[ii],
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    ffswap8_slow(&dvalues[ii], nvals - ii);
+}
+#endif
+/*--------------------------------------------------------------------------*/
+void ffswap2(short *svalues,  /* IO - pointer to shorts to be swapped    */
+             long nvals)     /* I  - number of shorts to be swapped     */
+/*
+  swap the bytes in the input short integers: ( 0 1 -> 1 0 )
+*/
+{
+#ifdef HAVE_SIMD_DISPATCH
+    if (ffcpufeatures() & FF_CPU_AVX2) {
+        ffswap2_avx2(svalues, nvals);
+        return;
+    }
+#endif
+#if __SSE2__
+    ffswap2_sse2(svalues, nvals);
+#else
+    ffswap2_slow(svalues, nvals);
+#endif
+}
+/*--------------------------------------------------------------------------*/
+void ffswap4(INT32BIT *ivalues,  /* IO - pointer to INT*4 to be swapped    */
+                 long nvals)     /* I  - number of floats to be swapped     */
+/*
+  swap the bytes in the input 4-byte integer: ( 0 1 2 3 -> 3 2 1 0 )
+*/
+{
+#ifdef HAVE_SIMD_DISPATCH
+    int features = ffcpufeatures();
+
+    if (features & FF_CPU_AVX2) {
+        ffswap4_avx2(ivalues, nvals);
+        return;
+    }
+#endif
+#if defined(__SSSE3__)
+    ffswap4_ssse3(ivalues, nvals);
+#elif defined(HAVE_SIMD_DISPATCH)
+    if (features & FF_CPU_SSSE3)
+        ffswap4_ssse3_rt(ivalues, nvals);
+    else
+        ffswap4_slow(ivalues, nvals);
+#else
+    ffswap4_slow(ivalues, nvals);
+#endif
+}
+/*--------------------------------------------------------------------------*/
 void ffswap8(double *dvalues,  /* IO - pointer to doubles to be swapped     */
              long nvals)       /* I  - number of doubles to be swapped      */
 /*
   swap the bytes in the input doubles: ( 01234567  -> 76543210 )
 */
 {
+#ifdef HAVE_SIMD_DISPATCH
+    int features = ffcpufeatures();
+
+    if (features & FF_CPU_AVX2) {
+        ffswap8_avx2(dvalues, nvals);
+        return;
+    }
+#endif
+#if defined(__SSSE3__)
+    ffswap8_ssse3(dvalues, nvals);
+#elif defined(HAVE_SIMD_DISPATCH)
+    if (features & FF_CPU_SSSE3)
+        ffswap8_ssse3_rt(dvalues, nvals);
+    else
+        ffswap8_slow(dvalues, nvals);
+#else
     ffswap8_slow(dvalues, nvals);
-}
 #endif
+}
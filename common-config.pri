@@ -33,3 +33,15 @@ isEmpty(LIBDIR) {
     message("====")
     message("==== library install path set to `$${INSTALL_LIBDIR}'")
 }
+
+# Build with `qmake CONFIG+=tracing' to compile in the timers and counters
+# of the hot paths (see libabc/src/trace.h)
+CONFIG(tracing) {
+    DEFINES += ABC_TRACING
+}
+
+# The number of I/O buffers of cfitsio can be tuned by building it with
+# CFLAGS=-DNIOBUF=<n>; pass the same value here with `qmake CFITSIO_NIOBUF=<n>'
+!isEmpty(CFITSIO_NIOBUF) {
+    DEFINES += NIOBUF=$${CFITSIO_NIOBUF}
+}
@@ -4,9 +4,11 @@ TEMPLATE = subdirs
 
 headers.files = \
     ABC/CalibrationSet \
+    ABC/FileHash \
     ABC/ImageSet \
     ABC/Image \
     ABC/Site \
+    ABC/Trace \
     ABC/UploadItem
 
 headers.path = $${INSTALL_PREFIX}/include/ABC/
@@ -1,5 +1,5 @@
 TEMPLATE = subdirs
-SUBDIRS = src include tests
+SUBDIRS = src include tests tests/benchmarks tests/dataset-generator
 CONFIG += ordered
 
 !CONFIG(disable_python) {
@@ -2,8 +2,15 @@
 
 import unittest
 import datetime
+import threading
+import time
 import PyABC
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
 class ABCTest(unittest.TestCase):
     def test_load(self):
         image = PyABC.Image.fromFile('../tests/1_32i.fit')
@@ -18,5 +25,112 @@ class ABCTest(unittest.TestCase):
         self.assertEqual(image.observationDate(),
                 datetime.datetime(2012, 9, 16, 21, 2, 19))
 
+    @unittest.skipIf(numpy is None, 'numpy not available')
+    def test_buffer(self):
+        image = PyABC.Image.fromFile('../tests/1_32i.fit')
+        size = image.size()
+        array = numpy.asarray(image)
+        self.assertEqual(array.shape, (size.height(), size.width()))
+        self.assertEqual(array.dtype, numpy.float32)
+
+        # The array shares the pixels with the image
+        array[0, 0] = 1234.0
+        self.assertEqual(numpy.asarray(image)[0, 0], 1234.0)
+
+        # Rows are views too
+        row = numpy.asarray(image)[1]
+        self.assertEqual(row.shape, (size.width(),))
+
+        # The array survives the image
+        del image
+        self.assertEqual(array[0, 0], 1234.0)
+
+    @unittest.skipIf(numpy is None, 'numpy not available')
+    def test_bufferReload(self):
+        image = PyABC.Image.fromFile('../tests/1_32i.fit')
+        array = numpy.asarray(image)
+        expected = array.copy()
+
+        # Reloading gives new pixels to the image, but not to the array
+        self.assertTrue(image.load('../tests/32i/0.fit'))
+        numpy.testing.assert_array_equal(array, expected)
+        array[0, 0] = 1234.0
+        self.assertNotEqual(numpy.asarray(image)[0, 0], 1234.0)
+
+        # Once the old arrays are gone, the new pixels are not copied
+        del array
+        newArray = numpy.asarray(image)
+        newArray[0, 0] = 4321.0
+        self.assertEqual(numpy.asarray(image)[0, 0], 4321.0)
+
+    @unittest.skipIf(numpy is None, 'numpy not available')
+    def test_fromArray(self):
+        array = numpy.arange(12, dtype=numpy.float32).reshape(3, 4)
+        image = PyABC.Image.fromArray(array)
+        self.assertTrue(image.isValid())
+        self.assertEqual(image.size().width(), 4)
+        self.assertEqual(image.size().height(), 3)
+
+        # No copy is made
+        array[2, 3] = 100.0
+        self.assertEqual(numpy.asarray(image)[2, 3], 100.0)
+
+        # The image keeps the array alive
+        del array
+        self.assertEqual(numpy.asarray(image)[0, 1], 1.0)
+
+        self.assertRaises(TypeError, PyABC.Image.fromArray,
+                          numpy.zeros((3, 4), dtype=numpy.float64))
+        self.assertRaises(TypeError, PyABC.Image.fromArray,
+                          numpy.zeros(12, dtype=numpy.float32))
+
+    def test_addFiles(self):
+        fileNames = ['../tests/32i/%d.fit' % i for i in range(8)]
+        images = PyABC.ImageSet()
+        self.assertEqual(images.addFiles(fileNames + ['missing.fit']), 8)
+        self.assertEqual(images.count(), 8)
+
+        dark = PyABC.Image.fromFile(fileNames[0])
+        images.calibrate(dark, PyABC.Image())
+        self.assertTrue(images.average().isValid())
+
+    def test_threads(self):
+        fileNames = ['../tests/UIT.fits'] * 8
+        rounds = 4
+
+        def stack():
+            images = PyABC.ImageSet()
+            for fileName in fileNames:
+                images.addImage(PyABC.Image.fromFile(fileName))
+            images.sigmaClip(2.0)
+
+        start = time.time()
+        for i in range(rounds):
+            stack()
+        serialTime = time.time() - start
+
+        # The GIL is released during the C++ calls, so the threads can run
+        # them in parallel
+        threads = [threading.Thread(target=stack) for i in range(rounds)]
+        start = time.time()
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        parallelTime = time.time() - start
+
+        print('\nStacking %d sets: %.3fs serially, %.3fs in %d threads '
+              '(speedup %.2f)' % (rounds, serialTime, parallelTime, rounds,
+                                  serialTime / max(parallelTime, 1e-6)))
+
+        # The batch call uses the C++ thread pool instead
+        start = time.time()
+        for i in range(rounds):
+            images = PyABC.ImageSet()
+            images.addFiles(fileNames)
+            images.sigmaClip(2.0)
+        print('Stacking %d sets with addFiles(): %.3fs' %
+              (rounds, time.time() - start))
+
 if __name__ == '__main__':
     unittest.main()
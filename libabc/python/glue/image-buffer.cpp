@@ -0,0 +1,165 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* PEP 3118 buffers for ABC::Image, so that NumPy can use the pixels
+ * without copying them. */
+
+#define PIXEL_FORMAT \
+    (sizeof(ABC::PixelValue) == sizeof(float) ? "f" : "d")
+
+/* The buffer holds a copy of the image, which keeps the pixels alive: if
+ * the image is reloaded or modified while the buffer exists, the image
+ * detaches and gets new pixels, while the buffer keeps the old ones. */
+struct SbkABCImageBuffer
+{
+    ABC::Image image;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+/* Number of buffers of each Python image; protected by the GIL */
+static QHash<PyObject *, int> SbkABCImage_exports;
+
+static int SbkABCImage_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    view->obj = NULL;
+    if (!Shiboken::Object::isValid(self)) return -1;
+
+    ABC::Image *cppSelf = %CONVERTTOCPP[ABC::Image *](self);
+    if (!cppSelf->isValid()) {
+        PyErr_SetString(PyExc_BufferError, "The image is not valid");
+        return -1;
+    }
+
+    /* If the image is shared only with its other buffers, they must all
+     * see the same pixels: don't detach. Otherwise, this detaches the
+     * pixels from any C++ copy of the image, so that writing to the buffer
+     * only affects this image. */
+    ABC::PixelValue *pixels = 0;
+    if (SbkABCImage_exports.value(self) > 0) {
+        pixels = const_cast<ABC::PixelValue *>(cppSelf->constPixels());
+    }
+    if (pixels == 0) pixels = cppSelf->pixels();
+    if (pixels == 0) {
+        PyErr_SetString(PyExc_BufferError, "Cannot load the pixels");
+        return -1;
+    }
+
+    SbkABCImageBuffer *buffer = new SbkABCImageBuffer;
+    buffer->image = *cppSelf;
+    SbkABCImage_exports[self]++;
+    QSize size = cppSelf->size();
+    buffer->shape[0] = size.height();
+    buffer->shape[1] = size.width();
+    buffer->strides[0] = size.width() * sizeof(ABC::PixelValue);
+    buffer->strides[1] = sizeof(ABC::PixelValue);
+
+    view->buf = pixels;
+    view->obj = self;
+    Py_INCREF(self);
+    view->len = buffer->shape[0] * buffer->strides[0];
+    view->readonly = 0;
+    view->itemsize = sizeof(ABC::PixelValue);
+    view->format = (flags & PyBUF_FORMAT) ?
+        const_cast<char *>(PIXEL_FORMAT) : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? buffer->shape : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ?
+        buffer->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = buffer;
+    return 0;
+}
+
+static void SbkABCImage_releasebuffer(PyObject *self, Py_buffer *view)
+{
+    if (--SbkABCImage_exports[self] == 0) SbkABCImage_exports.remove(self);
+    /* This might release the pixels, if the image doesn't use them anymore */
+    delete static_cast<SbkABCImageBuffer *>(view->internal);
+    view->internal = NULL;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyBufferProcs SbkABCImageBufferProcs = {
+    SbkABCImage_getbuffer,
+    SbkABCImage_releasebuffer,
+};
+#else
+static PyBufferProcs SbkABCImageBufferProcs = {
+    0, 0, 0, 0,
+    SbkABCImage_getbuffer,
+    SbkABCImage_releasebuffer,
+};
+#endif
+
+/* Images created from arrays keep a buffer of the array, which is
+ * released together with the pixels */
+static void SbkABCImage_releaseArray(ABC::PixelValue *pixels, void *userData)
+{
+    Q_UNUSED(pixels);
+    Py_buffer *view = static_cast<Py_buffer *>(userData);
+
+    /* The last image might be destroyed by a thread not holding the GIL */
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyBuffer_Release(view);
+    PyGILState_Release(state);
+    delete view;
+}
+
+static bool SbkABCImage_isPixelFormat(const char *format)
+{
+    if (format == NULL) return false;
+    /* Native byte order only */
+    if (*format == '@' || *format == '=') format++;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    else if (*format == '<') format++;
+#else
+    else if (*format == '>' || *format == '!') format++;
+#endif
+    return strcmp(format, PIXEL_FORMAT) == 0;
+}
+
+static PyObject *SbkABCImage_fromArray(PyObject *array)
+{
+    Py_buffer *view = new Py_buffer;
+    if (PyObject_GetBuffer(array, view, PyBUF_C_CONTIGUOUS |
+                           PyBUF_FORMAT | PyBUF_WRITABLE) != 0) {
+        delete view;
+        return NULL;
+    }
+
+    if (view->ndim != 2 || view->itemsize != sizeof(ABC::PixelValue) ||
+        !SbkABCImage_isPixelFormat(view->format)) {
+        PyErr_Format(PyExc_TypeError,
+                     "Expected a 2-dimensional array of type '%s'",
+                     PIXEL_FORMAT);
+        PyBuffer_Release(view);
+        delete view;
+        return NULL;
+    }
+
+    ABC::Image *image = new ABC::Image(
+        ABC::Image::fromPixels(static_cast<ABC::PixelValue *>(view->buf),
+                               QSize(view->shape[1], view->shape[0]),
+                               SbkABCImage_releaseArray, view));
+    PyObject *result = %CONVERTTOPYTHON[ABC::Image *](image);
+    Shiboken::Object::getOwnership(result);
+    return result;
+}
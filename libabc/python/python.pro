@@ -22,7 +22,7 @@ QTROOT_INC=$$[QT_INSTALL_HEADERS]
 QTCORE_INC=$${QTROOT_INC}/QtCore
 
 system(shiboken --enable-pyside-extensions \
-    --typesystem-paths=/usr/share/PySide/typesystems \
+    --typesystem-paths=.:/usr/share/PySide/typesystems \
     --include-paths=../src:$${QTCORE_INC}:$${QTROOT_INC}:/usr/include \
     --output-directory=. \
     global.h typesystem_abc.xml)
@@ -34,6 +34,10 @@ SOURCES += \
     PyABC/abc_image_wrapper.cpp \
     PyABC/abc_imageset_wrapper.cpp
 
+# Injected into the wrappers by shiboken
+OTHER_FILES += \
+    glue/image-buffer.cpp
+
 target.path = $${PYTHON_LIBDIR}
 INSTALLS += target
 
@@ -0,0 +1,290 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "debug.h"
+#include "file-hash.h"
+#include "trace.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QtConcurrentMap>
+#include <QtEndian>
+#include <string.h>
+
+/* Large files are mapped in memory; smaller ones are read in chunks */
+#define MIN_MAPPED_SIZE     (1024 * 1024)
+#define READ_BUFFER_SIZE    (1024 * 1024)
+/* QCryptographicHash::addData() takes an int */
+#define MAX_CHUNK_SIZE      (64 * 1024 * 1024)
+
+using namespace ABC;
+
+namespace ABC {
+
+/* XXH64, as specified at https://github.com/Cyan4973/xxHash */
+class XxHash64
+{
+public:
+    XxHash64(quint64 seed = 0);
+
+    void addData(const uchar *data, qint64 length);
+    quint64 result() const;
+
+private:
+    static quint64 rotl(quint64 x, int r) { return (x << r) | (x >> (64 - r)); }
+    static quint64 round(quint64 acc, quint64 input);
+    static quint64 mergeRound(quint64 acc, quint64 value);
+    static quint64 read64(const uchar *p) {
+        return qFromLittleEndian<quint64>(p);
+    }
+    static quint32 read32(const uchar *p) {
+        return qFromLittleEndian<quint32>(p);
+    }
+
+private:
+    quint64 seed;
+    quint64 v[4];
+    quint64 totalLength;
+    uchar buffer[32];
+    int bufferSize;
+};
+
+class Hasher
+{
+public:
+    Hasher(FileHash::Algorithm algorithm):
+        algorithm(algorithm),
+        md5(QCryptographicHash::Md5)
+    {
+    }
+
+    void addData(const uchar *data, qint64 length);
+    QByteArray result() const;
+
+private:
+    FileHash::Algorithm algorithm;
+    QCryptographicHash md5;
+    XxHash64 xxHash;
+};
+
+struct HashFile
+{
+    typedef QByteArray result_type;
+
+    HashFile(FileHash::Algorithm algorithm): algorithm(algorithm) {}
+
+    QByteArray operator()(const QString &filePath) const {
+        return FileHash::hash(filePath, algorithm);
+    }
+
+    FileHash::Algorithm algorithm;
+};
+
+} // namespace
+
+static const quint64 prime1 = Q_UINT64_C(11400714785074694791);
+static const quint64 prime2 = Q_UINT64_C(14029467366897019727);
+static const quint64 prime3 = Q_UINT64_C(1609587929392839161);
+static const quint64 prime4 = Q_UINT64_C(9650029242287828579);
+static const quint64 prime5 = Q_UINT64_C(2870177450012600261);
+
+XxHash64::XxHash64(quint64 seed):
+    seed(seed),
+    totalLength(0),
+    bufferSize(0)
+{
+    v[0] = seed + prime1 + prime2;
+    v[1] = seed + prime2;
+    v[2] = seed;
+    v[3] = seed - prime1;
+}
+
+quint64 XxHash64::round(quint64 acc, quint64 input)
+{
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+quint64 XxHash64::mergeRound(quint64 acc, quint64 value)
+{
+    acc ^= round(0, value);
+    return acc * prime1 + prime4;
+}
+
+void XxHash64::addData(const uchar *data, qint64 length)
+{
+    totalLength += length;
+
+    /* Complete the stripe left over from the previous call */
+    if (bufferSize > 0) {
+        int needed = qMin<qint64>(32 - bufferSize, length);
+        memcpy(buffer + bufferSize, data, needed);
+        bufferSize += needed;
+        data += needed;
+        length -= needed;
+        if (bufferSize < 32) return;
+
+        for (int i = 0; i < 4; i++) {
+            v[i] = round(v[i], read64(buffer + i * 8));
+        }
+        bufferSize = 0;
+    }
+
+    const uchar *end = data + length;
+    quint64 v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+    while (end - data >= 32) {
+        v1 = round(v1, read64(data));
+        v2 = round(v2, read64(data + 8));
+        v3 = round(v3, read64(data + 16));
+        v4 = round(v4, read64(data + 24));
+        data += 32;
+    }
+    v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+
+    if (data < end) {
+        bufferSize = end - data;
+        memcpy(buffer, data, bufferSize);
+    }
+}
+
+quint64 XxHash64::result() const
+{
+    quint64 h;
+
+    if (totalLength >= 32) {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = mergeRound(h, v[i]);
+        }
+    } else {
+        h = seed + prime5;
+    }
+
+    h += totalLength;
+
+    const uchar *p = buffer;
+    const uchar *end = buffer + bufferSize;
+    while (end - p >= 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= quint64(read32(p)) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * prime5;
+        h = rotl(h, 11) * prime1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+void Hasher::addData(const uchar *data, qint64 length)
+{
+    if (algorithm == FileHash::XxHash64) {
+        xxHash.addData(data, length);
+        return;
+    }
+
+    while (length > 0) {
+        int chunk = qMin<qint64>(length, MAX_CHUNK_SIZE);
+        md5.addData(reinterpret_cast<const char *>(data), chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+QByteArray Hasher::result() const
+{
+    if (algorithm == FileHash::XxHash64) {
+        /* Big endian, like the reference implementation prints it */
+        uchar digest[8];
+        qToBigEndian(xxHash.result(), digest);
+        return QByteArray(reinterpret_cast<const char *>(digest),
+                          sizeof(digest)).toHex();
+    }
+
+    return md5.result().toHex();
+}
+
+QByteArray FileHash::hash(const QString &filePath, Algorithm algorithm)
+{
+    ABC_TRACE_SCOPE("FileHash::hash");
+
+    QFile file(filePath);
+    if (Q_UNLIKELY(!file.open(QIODevice::ReadOnly))) {
+        DEBUG() << "Cannot open" << filePath;
+        return QByteArray();
+    }
+
+    Hasher hasher(algorithm);
+
+    qint64 size = file.size();
+    ABC_TRACE_COUNT("bytes hashed", size);
+    if (size >= MIN_MAPPED_SIZE) {
+        uchar *data = file.map(0, size);
+        if (data != 0) {
+            hasher.addData(data, size);
+            file.unmap(data);
+            return hasher.result();
+        }
+    }
+
+    /* Don't load the whole file in memory */
+    QByteArray buffer;
+    buffer.resize(READ_BUFFER_SIZE);
+    qint64 length;
+    while ((length = file.read(buffer.data(), buffer.size())) > 0) {
+        hasher.addData(reinterpret_cast<const uchar *>(buffer.constData()),
+                       length);
+    }
+    if (Q_UNLIKELY(length < 0)) {
+        qWarning() << "Error reading" << filePath << file.errorString();
+        return QByteArray();
+    }
+
+    return hasher.result();
+}
+
+QByteArray FileHash::hashData(const QByteArray &data, Algorithm algorithm)
+{
+    Hasher hasher(algorithm);
+    hasher.addData(reinterpret_cast<const uchar *>(data.constData()),
+                   data.size());
+    return hasher.result();
+}
+
+QList<QByteArray> FileHash::hashFiles(const QStringList &filePaths,
+                                      Algorithm algorithm)
+{
+    HashFile hashFile(algorithm);
+    return QtConcurrent::blockingMapped<QList<QByteArray> >(filePaths,
+                                                            hashFile);
+}
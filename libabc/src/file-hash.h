@@ -0,0 +1,54 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ABC_FILE_HASH_H
+#define ABC_FILE_HASH_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+namespace ABC {
+
+class FileHash
+{
+public:
+    enum Algorithm {
+        /* The hash used by the server to identify files */
+        Md5 = 0,
+        /* Not cryptographic, but many times faster: good enough to tell
+         * whether a local file has changed */
+        XxHash64,
+    };
+
+    /* The hashes are returned as lowercase hexadecimal strings; if the
+     * file cannot be read, the returned hash is empty. */
+    static QByteArray hash(const QString &filePath, Algorithm algorithm);
+    static QByteArray hashData(const QByteArray &data, Algorithm algorithm);
+
+    /* Hashes several files concurrently */
+    static QList<QByteArray> hashFiles(const QStringList &filePaths,
+                                       Algorithm algorithm);
+};
+
+}; // namespace
+
+#endif /* ABC_FILE_HASH_H */
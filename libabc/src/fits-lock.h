@@ -0,0 +1,40 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ABC_FITS_LOCK_H
+#define ABC_FITS_LOCK_H
+
+class QMutex;
+class QString;
+
+namespace ABC {
+
+/* Returns the lock to be held around the cfitsio calls on the given file.
+ *
+ * A reentrant cfitsio can work on different files from different threads,
+ * but when a file is opened more than once it shares the I/O buffers among
+ * the handles, so the accesses to the same file must still be serialized.
+ * If cfitsio is not reentrant, the same lock is returned for all files.
+ * The locks are recursive. */
+QMutex *fitsMutex(const QString &fileName);
+
+}; // namespace
+
+#endif /* ABC_FITS_LOCK_H */
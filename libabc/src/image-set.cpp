@@ -20,8 +20,10 @@
 
 #include "debug.h"
 #include "image-set.h"
+#include "trace.h"
 
 #include <QTransform>
+#include <QtConcurrentMap>
 #include <math.h>
 
 using namespace ABC;
@@ -43,6 +45,23 @@ public:
     QRect boundingRect;
 };
 
+struct CalibrateImage
+{
+    CalibrateImage(const Image &dark, const Image &flat):
+        dark(dark),
+        flat(flat)
+    {
+    }
+
+    void operator()(Image &image) const {
+        if (dark.isValid()) image -= dark;
+        if (flat.isValid()) image.divide(flat);
+    }
+
+    Image dark;
+    Image flat;
+};
+
 }; // namespace
 
 ImageSetPrivate::ImageSetPrivate(const ImageSetPrivate &other):
@@ -196,11 +215,25 @@ bool ImageSet::addImage(const Image &image, const QTransform &transform)
     return true;
 }
 
+int ImageSet::addFiles(const QStringList &fileNames)
+{
+    int count = 0;
+    foreach (const Image &image, Image::fromFiles(fileNames)) {
+        if (image.isValid() && addImage(image)) count++;
+    }
+    return count;
+}
+
 bool ImageSet::isEmpty() const
 {
     return d->images.isEmpty();
 }
 
+int ImageSet::count() const
+{
+    return d->images.count();
+}
+
 QRect ImageSet::boundingRect() const
 {
     return d->boundingRect;
@@ -208,6 +241,8 @@ QRect ImageSet::boundingRect() const
 
 Image ImageSet::average() const
 {
+    ABC_TRACE_SCOPE("ImageSet::average");
+
     if (!d->transformations.isEmpty()) {
         qWarning() << "Average not implemented for transformed images";
         return Image();
@@ -218,6 +253,8 @@ Image ImageSet::average() const
 
 Image ImageSet::sigmaClip(float sigmaFactor) const
 {
+    ABC_TRACE_SCOPE("ImageSet::sigmaClip");
+
     if (!d->transformations.isEmpty()) {
         qWarning() << "Sigma clip not implemented for transformed images";
         return Image();
@@ -244,3 +281,13 @@ void ImageSet::divide(const Image &divisor)
         i->divide(divisor);
     }
 }
+
+void ImageSet::calibrate(const Image &dark, const Image &flat)
+{
+    ABC_TRACE_SCOPE("ImageSet::calibrate");
+
+    /* The master frames are only read, so they can be shared by the
+     * threads; each image detaches from its other copies in its own thread
+     */
+    QtConcurrent::blockingMap(d->images, CalibrateImage(dark, flat));
+}
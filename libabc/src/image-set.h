@@ -39,8 +39,12 @@ public:
 
     bool addImage(const Image &image);
     bool addImage(const Image &image, const QTransform &transform);
+    /* Loads the files concurrently, and adds those which are valid and of
+     * the right size; returns the number of images added. */
+    int addFiles(const QStringList &fileNames);
 
     bool isEmpty() const;
+    int count() const;
     QRect boundingRect() const;
 
     Image average() const;
@@ -51,6 +55,10 @@ public:
 
     void divide(const Image &divisor);
 
+    /* Subtracts the dark frame and divides by the flat field every image
+     * of the set, concurrently; either of them can be left invalid. */
+    void calibrate(const Image &dark, const Image &flat);
+
 private:
     QSharedDataPointer<ImageSetPrivate> d;
 };
@@ -19,10 +19,18 @@
  */
 
 #include "debug.h"
+#include "fits-lock.h"
 #include "image.h"
+#include "trace.h"
 
 #include <QDateTime>
+#include <QDir>
+#include <QFile>
 #include <QFileInfo>
+#include <QMutex>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrentMap>
 #include <fitsio.h>
 #include <libraw.h>
 #include <math.h>
@@ -32,6 +40,14 @@ using namespace ABC;
 #define PIXEL_VALUE_FITS_TYPE \
     (sizeof(PixelValue) == sizeof(float) ? TFLOAT : TDOUBLE)
 #define FITS_RECORD_LENGTH 81
+/* Number of locks among which the FITS files are distributed */
+#define FITS_FILE_LOCKS 16
+/* Compressed images which can be split in fewer bands of tiles than this
+ * are decompressed serially */
+#define MIN_TILE_BANDS 2
+/* Each band costs an open of the file and a parse of its header, about
+ * 0.1 ms; a band of this many pixels takes 2-3 ms to decompress */
+#define MIN_BAND_PIXELS (256 * 1024)
 
 namespace ABC {
 
@@ -60,12 +76,15 @@ public:
     bool loadPixelsFits();
     bool loadLineFits(int l) const;
     void closeFits();
+    void readPixelsFits(int *status);
+    bool readCompressedFits();
 
     bool loadRaw();
     void closeRaw();
 
     void autoDetectType();
     long resize(const QSize &newSize);
+    void releasePixels();
 
     long totalPixels() const { return size.width() * size.height(); }
 
@@ -96,6 +115,9 @@ public:
     QSize size;
     mutable PixelValue *lineBuffer;
     PixelValue *pixels;
+    /* Set if the pixels are not owned by us */
+    Image::ReleaseFunction release;
+    void *releaseData;
 
     /* temporary parameters */
     float meanEps;
@@ -118,8 +140,98 @@ static const ImageBackend backends[] = {
     { 0, 0, 0, 0 }
 };
 
+struct LoadImage
+{
+    typedef Image result_type;
+
+    Image operator()(const QString &fileName) const {
+        return Image::fromFile(fileName);
+    }
+};
+
+/* A band of whole rows of tiles of a compressed image */
+struct TileBand
+{
+    long firstRow;
+    long lastRow;
+    int status;
+};
+
+struct DecompressTiles
+{
+    DecompressTiles(uchar *data, qint64 dataSize, int hdu, long width,
+                    PixelValue *pixels):
+        data(data),
+        dataSize(dataSize),
+        hdu(hdu),
+        width(width),
+        pixels(pixels)
+    {
+    }
+
+    void operator()(TileBand &band) const {
+        /* Every thread opens the file from memory: cfitsio would share the
+         * buffers of a file opened twice by name, and keeps the address of
+         * these variables until the file is closed */
+        void *buffer = data;
+        size_t bufferSize = dataSize;
+        fitsfile *ff = 0;
+        band.status = 0;
+        fits_open_memfile(&ff, "tiles", READONLY, &buffer, &bufferSize, 0,
+                          NULL, &band.status);
+        if (Q_UNLIKELY(band.status != 0)) return;
+
+        long firstPixels[2], lastPixels[2], increments[2];
+        firstPixels[0] = 1;
+        firstPixels[1] = band.firstRow + 1;
+        lastPixels[0] = width;
+        lastPixels[1] = band.lastRow;
+        increments[0] = increments[1] = 1;
+        fits_movabs_hdu(ff, hdu, NULL, &band.status);
+        fits_read_subset(ff, PIXEL_VALUE_FITS_TYPE, firstPixels, lastPixels,
+                         increments, NULL, pixels + band.firstRow * width,
+                         NULL, &band.status);
+        int status = 0;
+        fits_close_file(ff, &status);
+    }
+
+    uchar *data;
+    qint64 dataSize;
+    int hdu;
+    long width;
+    PixelValue *pixels;
+};
+
+struct FitsLocks
+{
+    FitsLocks() {
+        for (int i = 0; i < FITS_FILE_LOCKS; i++) {
+            locks[i] = new QMutex(QMutex::Recursive);
+        }
+    }
+    ~FitsLocks() {
+        for (int i = 0; i < FITS_FILE_LOCKS; i++) {
+            delete locks[i];
+        }
+    }
+
+    QMutex *locks[FITS_FILE_LOCKS];
+};
+
 } // namespace
 
+Q_GLOBAL_STATIC(FitsLocks, fitsLocks)
+
+QMutex *ABC::fitsMutex(const QString &fileName)
+{
+    static const bool isReentrant = fits_is_reentrant();
+    if (!isReentrant) return fitsLocks()->locks[0];
+
+    /* cfitsio recognizes an already open file by its absolute path */
+    QString path = QDir::cleanPath(QFileInfo(fileName).absoluteFilePath());
+    return fitsLocks()->locks[qHash(path) % FITS_FILE_LOCKS];
+}
+
 ImageData::ImageData():
     ff(0),
     raw(0),
@@ -129,6 +241,8 @@ ImageData::ImageData():
     exposure(-1),
     lineBuffer(0),
     pixels(0),
+    release(0),
+    releaseData(0),
     meanEps(0.2),
     standardDeviationEps(0.2)
 {
@@ -150,6 +264,8 @@ ImageData::ImageData(const ImageData &other):
     observationDate(other.observationDate),
     lineBuffer(0),
     pixels(0),
+    release(0),
+    releaseData(0),
     meanEps(other.meanEps),
     standardDeviationEps(other.standardDeviationEps)
 {
@@ -162,8 +278,7 @@ ImageData::~ImageData()
     if (backend != 0) {
         (this->*(backend->close))();
     }
-    delete pixels;
-    pixels = 0;
+    releasePixels();
     delete lineBuffer;
     lineBuffer = 0;
 }
@@ -195,7 +310,7 @@ bool ImageData::ensureFitsOpen() const
     if (ff == 0) {
         int status = 0;
         fits_open_image(&ff, fileName.toUtf8().constData(),
-                        READWRITE, &status);
+                        READONLY, &status);
         if (status != 0) return false;
     }
 
@@ -204,10 +319,12 @@ bool ImageData::ensureFitsOpen() const
 
 bool ImageData::loadFits()
 {
+    QMutexLocker locker(fitsMutex(fileName));
     int status = 0;
 
     if (ff != 0) {
         fits_close_file(ff, &status);
+        ff = 0;
         status = 0;
     }
 
@@ -218,6 +335,7 @@ bool ImageData::loadFits()
     if (numAxes != 2) {
         qWarning() << "Only 2D FITS images are supported";
         fits_close_file(ff, &status);
+        ff = 0;
         return false;
     }
 
@@ -225,18 +343,17 @@ bool ImageData::loadFits()
     fits_get_img_size(ff, 2, axes, &status);
     if (status != 0) {
         fits_close_file(ff, &status);
+        ff = 0;
         return false;
     }
 
-    long numPixels = resize(QSize(axes[0], axes[1]));
-    long firstPixels[2];
-    firstPixels[0] = firstPixels[1] = 1;
-    fits_read_pix(ff, PIXEL_VALUE_FITS_TYPE, firstPixels, numPixels,
-                  NULL, pixels, NULL, &status);
+    resize(QSize(axes[0], axes[1]));
+    readPixelsFits(&status);
     if (status != 0) {
         delete pixels;
         pixels = 0;
         fits_close_file(ff, &status);
+        ff = 0;
         return false;
     }
 
@@ -316,19 +433,90 @@ bool ImageData::loadFits()
         status = 0;
     }
 
+    /* All the data is in memory now; closing the file ensures that its
+     * handle is not used again, possibly from another thread */
+    fits_close_file(ff, &status);
+    ff = 0;
     return true;
 }
 
 void ImageData::closeFits()
 {
     if (ff != 0) {
+        QMutexLocker locker(fitsMutex(fileName));
         int status = 0;
         fits_close_file(ff, &status);
+        ff = 0;
+    }
+}
+
+void ImageData::readPixelsFits(int *status)
+{
+    if (readCompressedFits()) return;
+
+    long firstPixels[2];
+    firstPixels[0] = firstPixels[1] = 1;
+    fits_read_pix(ff, PIXEL_VALUE_FITS_TYPE, firstPixels, totalPixels(),
+                  NULL, pixels, NULL, status);
+}
+
+/* cfitsio decompresses the tiles one at a time: split them in bands, and
+ * decompress these concurrently. Returns false if the image must be read
+ * serially. */
+bool ImageData::readCompressedFits()
+{
+    /* Without locking, cfitsio cannot be used by several threads */
+    if (!fits_is_reentrant()) return false;
+
+    int status = 0;
+    if (!fits_is_compressed_image(ff, &status)) return false;
+
+    /* The tiles are whole rows, unless ZTILE2 says otherwise */
+    long tileHeight = 1;
+    fits_read_key(ff, TLONG, "ZTILE2", &tileHeight, NULL, &status);
+    if (status != 0 || tileHeight < 1) {
+        tileHeight = 1;
+        status = 0;
+    }
+    long tileRows = (size.height() + tileHeight - 1) / tileHeight;
+    long tilePixels = tileHeight * size.width();
+    long bandTiles = qMax((MIN_BAND_PIXELS + tilePixels - 1) / tilePixels, 1L);
+    int numBands = qMin<long>(tileRows / bandTiles,
+                              QThreadPool::globalInstance()->maxThreadCount());
+    if (numBands < MIN_TILE_BANDS) return false;
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    uchar *data = file.map(0, file.size());
+    if (data == 0) return false;
+
+    ABC_TRACE_SCOPE("Image::readCompressedFits");
+    int hdu = 1;
+    fits_get_hdu_num(ff, &hdu);
+
+    QVector<TileBand> bands(numBands);
+    for (int i = 0; i < numBands; i++) {
+        bands[i].firstRow = tileRows * i / numBands * tileHeight;
+        bands[i].lastRow = qMin<long>(tileRows * (i + 1) / numBands *
+                                      tileHeight, size.height());
+    }
+    QtConcurrent::blockingMap(bands,
+                              DecompressTiles(data, file.size(), hdu,
+                                              size.width(), pixels));
+    file.unmap(data);
+
+    foreach (const TileBand &band, bands) {
+        if (Q_UNLIKELY(band.status != 0)) {
+            DEBUG() << "Tile decompression failed:" << band.status;
+            return false;
+        }
     }
+    return true;
 }
 
 bool ImageData::loadLineFits(int l) const
 {
+    QMutexLocker locker(fitsMutex(fileName));
     if (!ensureFitsOpen()) return 0;
 
     int status = 0;
@@ -439,11 +627,23 @@ long ImageData::resize(const QSize &newSize)
     if (size == newSize) return numPixels;
 
     size = newSize;
-    delete pixels;
+    releasePixels();
     pixels = new PixelValue[numPixels];
     return numPixels;
 }
 
+void ImageData::releasePixels()
+{
+    if (release != 0) {
+        release(pixels, releaseData);
+        release = 0;
+        releaseData = 0;
+    } else {
+        delete pixels;
+    }
+    pixels = 0;
+}
+
 void ImageData::closeRaw()
 {
     if (raw != 0) {
@@ -454,16 +654,13 @@ void ImageData::closeRaw()
 
 bool ImageData::loadPixelsFits()
 {
+    QMutexLocker locker(fitsMutex(fileName));
     if (!ensureFitsOpen()) return false;
 
-    long numPixels = totalPixels();
-    pixels = new PixelValue[numPixels];
+    pixels = new PixelValue[totalPixels()];
 
-    long firstPixels[2];
-    firstPixels[0] = firstPixels[1] = 1;
     int status = 0;
-    fits_read_pix(ff, PIXEL_VALUE_FITS_TYPE, firstPixels, numPixels,
-                  NULL, pixels, NULL, &status);
+    readPixelsFits(&status);
     if (status != 0) {
         delete pixels;
         pixels = 0;
@@ -543,6 +740,8 @@ Image Image::fromFile(const QString &fileName, const QString &label)
 
 bool Image::load(const QString &fileName, const QString &label)
 {
+    ABC_TRACE_SCOPE("Image::load");
+
     d->fileName = fileName;
 
     bool ok = false;
@@ -570,6 +769,49 @@ bool Image::load(const QString &fileName, const QString &label)
     return ok;
 }
 
+Image Image::fromPixels(PixelValue *pixels, const QSize &size,
+                        ReleaseFunction release, void *userData)
+{
+    Image image;
+    image.d->size = size;
+    image.d->pixels = pixels;
+    image.d->release = release;
+    image.d->releaseData = userData;
+    return image;
+}
+
+QList<Image> Image::fromFiles(const QStringList &fileNames)
+{
+    ABC_TRACE_SCOPE("Image::fromFiles");
+    return QtConcurrent::blockingMapped<QList<Image> >(fileNames,
+                                                       LoadImage());
+}
+
+ImageType Image::probeType(const QString &fileName)
+{
+    ImageType type = UnknownType;
+
+    QMutexLocker locker(fitsMutex(fileName));
+    fitsfile *ff = 0;
+    int status = 0;
+    fits_open_image(&ff, fileName.toUtf8().constData(), READONLY, &status);
+    if (status == 0) {
+        char headerRecord[FITS_RECORD_LENGTH];
+        fits_read_key(ff, TSTRING, "IMAGETYP", headerRecord, NULL, &status);
+        if (status == 0) {
+            type = typeFromString(QString::fromLatin1(headerRecord));
+        }
+        status = 0;
+        fits_close_file(ff, &status);
+    }
+    locker.unlock();
+
+    if (type == UnknownType) {
+        type = typeFromString(QFileInfo(fileName).baseName());
+    }
+    return type;
+}
+
 ImageType Image::type() const
 {
     return d->type;
@@ -22,9 +22,11 @@
 #define ABC_IMAGE_H
 
 #include <QImage>
+#include <QList>
 #include <QSize>
 #include <QSharedDataPointer>
 #include <QString>
+#include <QStringList>
 
 #define INVALID_TEMPERATURE (-300)
 
@@ -50,6 +52,8 @@ class ImageData;
 class Image
 {
 public:
+    typedef void (*ReleaseFunction)(PixelValue *pixels, void *userData);
+
     Image();
     Image(const Image &other);
     virtual ~Image();
@@ -59,6 +63,22 @@ public:
 
     bool load(const QString &fileName, const QString &label = QString());
 
+    /* Loads the files concurrently; the returned images are in the same
+     * order as the file names, and the ones which failed to load are not
+     * valid. */
+    static QList<Image> fromFiles(const QStringList &fileNames);
+
+    /* Wraps the given pixels without copying them; "release" is called
+     * once no image uses them anymore. As with any other image, modifying
+     * a copy detaches it: the copy then gets its own pixels. */
+    static Image fromPixels(PixelValue *pixels, const QSize &size,
+                            ReleaseFunction release, void *userData);
+
+    /* Reads the image type from the FITS header, without loading the
+     * image; if the header doesn't tell, the type is guessed from the file
+     * name. */
+    static ImageType probeType(const QString &fileName);
+
     ImageType type() const;
     bool isValid() const;
     QSize size() const;
@@ -23,6 +23,7 @@
 
 #include <QFile>
 #include <QFileInfo>
+#include <QHash>
 #include <QHttpMultiPart>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
@@ -38,6 +39,16 @@
 static const QLatin1String API_URL(API_BASE_URL);
 static const QLatin1String AUTH_URL(API_BASE_URL "/api-auth-token/");
 static const QLatin1String UPLOAD_URL(API_BASE_URL "/rawdata/rawimages/");
+/* Deduplication: the server is sent a comma-separated list of file hashes
+ * in the "hashes" form field, and replies with the known ones in a JSON
+ * object like {"known": [...], "register": true}. Unless "register" is
+ * true, the server cannot register files without their contents. Known
+ * files are registered by posting their fields, without the file part, to
+ * REGISTER_URL. */
+static const QLatin1String CHECK_HASHES_URL(API_BASE_URL
+                                            "/rawdata/rawimages/check-hashes/");
+static const QLatin1String REGISTER_URL(API_BASE_URL
+                                        "/rawdata/rawimages/register/");
 
 using namespace ABC;
 
@@ -59,9 +70,14 @@ class SitePrivate: public QObject
 
     QNetworkReply *uploadFile(const QString &filePath,
                               const QList<QHttpPart> &extraParts);
+    QNetworkReply *uploadData(QIODevice *device, const QString &fileName,
+                              const QList<QHttpPart> &extraParts);
+    QNetworkReply *postParts(const QUrl &url, QHttpMultiPart *multiPart);
+    void checkHashes(const QList<QByteArray> &hashes);
 
 private Q_SLOTS:
     void onAuthenticateReply();
+    void onCheckHashesReply();
     void onNetworkError(QNetworkReply::NetworkError error);
     void onSslErrors(QList<QSslError> errors);
 
@@ -71,6 +87,9 @@ private:
     QByteArray accessToken;
     bool isAuthenticating;
     QNetworkAccessManager *nam;
+    QHash<QNetworkReply *, QList<QByteArray> > pendingHashChecks;
+    bool hashCheckSupported;
+    bool registrationConfirmed;
 
     Site::ErrorCode lastError;
     QString lastErrorMessage;
@@ -84,6 +103,8 @@ SitePrivate::SitePrivate(Site *q):
     QObject(q),
     isAuthenticating(false),
     nam(0),
+    hashCheckSupported(true),
+    registrationConfirmed(false),
     lastError(Site::NoError),
     q_ptr(q)
 {
@@ -208,22 +229,29 @@ void SitePrivate::onSslErrors(QList<QSslError> errors)
 QNetworkReply *SitePrivate::uploadFile(const QString &filePath,
                                        const QList<QHttpPart> &extraParts)
 {
-    ensureHasNetworkAccessManager();
+    QFile *file = new QFile(filePath);
+    file->open(QIODevice::ReadOnly);
 
+    QFileInfo info(filePath);
+    return uploadData(file, info.fileName(), extraParts);
+}
+
+QNetworkReply *SitePrivate::uploadData(QIODevice *device,
+                                       const QString &fileName,
+                                       const QList<QHttpPart> &extraParts)
+{
     QHttpMultiPart *multiPart =
         new QHttpMultiPart(QHttpMultiPart::FormDataType);
-    QFile *file = new QFile(filePath, multiPart);
-    file->open(QIODevice::ReadOnly);
+    device->setParent(multiPart);
 
     QHttpPart upload;
     QByteArray contentDisposition =
         "form-data; name=\"file\"; filename =\"";
-    QFileInfo info(filePath);
-    contentDisposition += info.fileName().replace('"', '_').toUtf8();
+    contentDisposition += QString(fileName).replace('"', '_').toUtf8();
     contentDisposition += '"';
     upload.setHeader(QNetworkRequest::ContentDispositionHeader,
                      contentDisposition);
-    upload.setBodyDevice(file);
+    upload.setBodyDevice(device);
 
     multiPart->append(upload);
 
@@ -231,8 +259,15 @@ QNetworkReply *SitePrivate::uploadFile(const QString &filePath,
         multiPart->append(part);
     }
 
-    QUrl uploadUrl(UPLOAD_URL);
-    QNetworkRequest request(uploadUrl);
+    return postParts(QUrl(UPLOAD_URL), multiPart);
+}
+
+QNetworkReply *SitePrivate::postParts(const QUrl &url,
+                                      QHttpMultiPart *multiPart)
+{
+    ensureHasNetworkAccessManager();
+
+    QNetworkRequest request(url);
     request.setRawHeader("Authorization", "Token " + accessToken);
     QNetworkReply *reply = nam->post(request, multiPart);
     multiPart->setParent(reply);
@@ -240,6 +275,69 @@ QNetworkReply *SitePrivate::uploadFile(const QString &filePath,
     return reply;
 }
 
+void SitePrivate::checkHashes(const QList<QByteArray> &hashes)
+{
+    ensureHasNetworkAccessManager();
+
+    QUrl checkUrl(CHECK_HASHES_URL);
+    QNetworkRequest request(checkUrl);
+    request.setRawHeader("Authorization", "Token " + accessToken);
+    request.setRawHeader("Content-Type",
+                         "application/x-www-form-urlencoded");
+    QUrl data;
+    QByteArray joinedHashes;
+    foreach (const QByteArray &hash, hashes) {
+        if (!joinedHashes.isEmpty()) joinedHashes += ',';
+        joinedHashes += hash;
+    }
+    data.addQueryItem("hashes", QString::fromLatin1(joinedHashes));
+
+    QNetworkReply *reply = nam->post(request, data.encodedQuery());
+    pendingHashChecks.insert(reply, hashes);
+    connect(reply, SIGNAL(finished()),
+            this, SLOT(onCheckHashesReply()));
+}
+
+void SitePrivate::onCheckHashesReply()
+{
+    Q_Q(Site);
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    Q_ASSERT(reply != 0);
+    reply->deleteLater();
+
+    QList<QByteArray> hashes = pendingHashChecks.take(reply);
+    QList<QByteArray> knownHashes;
+
+    /* A failed check is not an error: the files will just be uploaded in
+     * full. */
+    uint statusCode =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
+    if (statusCode == 404 || statusCode == 405 || statusCode == 501) {
+        /* The server doesn't implement the check: don't ask again */
+        DEBUG() << "Hash check not supported:" << statusCode;
+        hashCheckSupported = false;
+    } else if (reply->error() != QNetworkReply::NoError || statusCode != 200) {
+        DEBUG() << "Hash check failed:" << statusCode << reply->errorString();
+    } else {
+        QVariantMap response = Site::parseJson(reply->readAll());
+        if (response.value("register").toBool()) {
+            registrationConfirmed = true;
+            foreach (const QVariant &hash, response["known"].toList()) {
+                knownHashes.append(hash.toByteArray());
+            }
+        } else {
+            /* Knowing the hashes is useless if the files cannot be
+             * registered without their contents */
+            DEBUG() << "File registration not supported";
+            hashCheckSupported = false;
+            registrationConfirmed = false;
+        }
+    }
+
+    Q_EMIT q->hashesChecked(hashes, knownHashes);
+}
+
 Site::Site(QObject *parent):
     QObject(parent),
     d_ptr(new SitePrivate(this))
@@ -291,6 +389,55 @@ QNetworkReply *Site::uploadFile(const QString &filePath,
     return d->uploadFile(filePath, extraParts);
 }
 
+/* Upload the contents of an already opened device; the Site takes
+ * ownership of it. */
+QNetworkReply *Site::uploadData(QIODevice *device, const QString &fileName,
+                                const QList<QHttpPart> &extraParts)
+{
+    Q_D(Site);
+    return d->uploadData(device, fileName, extraParts);
+}
+
+/* Register a file whose contents are already known to the server (see
+ * checkHashes()): no file body is sent, only the given parts. It must only
+ * be called if canRegisterFiles() is true. */
+QNetworkReply *Site::registerFile(const QList<QHttpPart> &parts)
+{
+    Q_D(Site);
+    Q_ASSERT(d->registrationConfirmed);
+
+    QHttpMultiPart *multiPart =
+        new QHttpMultiPart(QHttpMultiPart::FormDataType);
+    foreach (const QHttpPart &part, parts) {
+        multiPart->append(part);
+    }
+    return d->postParts(QUrl(REGISTER_URL), multiPart);
+}
+
+/* Becomes true once a reply to checkHashes() has confirmed that the server
+ * can register files without their contents */
+bool Site::canRegisterFiles() const
+{
+    Q_D(const Site);
+    return d->registrationConfirmed;
+}
+
+/* Returns false once the server has replied that it doesn't implement the
+ * hash check */
+bool Site::canCheckHashes() const
+{
+    Q_D(const Site);
+    return d->hashCheckSupported;
+}
+
+/* Ask the server which of the given file hashes it already has; the answer
+ * is delivered by the hashesChecked() signal. */
+void Site::checkHashes(const QList<QByteArray> &hashes)
+{
+    Q_D(Site);
+    d->checkHashes(hashes);
+}
+
 void Site::authenticate()
 {
     Q_D(Site);
@@ -28,6 +28,7 @@
 #include <QVariantMap>
 
 class QHttpPart;
+class QIODevice;
 class QNetworkAccessManager;
 class QNetworkReply;
 
@@ -66,6 +67,13 @@ public:
 
     QNetworkReply *uploadFile(const QString &filePath,
                               const QList<QHttpPart> &extraParts);
+    QNetworkReply *uploadData(QIODevice *device, const QString &fileName,
+                              const QList<QHttpPart> &extraParts);
+    QNetworkReply *registerFile(const QList<QHttpPart> &parts);
+    bool canRegisterFiles() const;
+
+    bool canCheckHashes() const;
+    void checkHashes(const QList<QByteArray> &hashes);
 
     static QVariantMap parseJson(const QByteArray &data);
 
@@ -76,6 +84,8 @@ Q_SIGNALS:
     void authenticationStarted();
     void authenticationFinished();
     void error(Site::ErrorCode);
+    void hashesChecked(const QList<QByteArray> &hashes,
+                       const QList<QByteArray> &knownHashes);
 
 private:
     SitePrivate *d_ptr;
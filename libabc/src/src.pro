@@ -12,26 +12,34 @@ PKGCONFIG += \
     QJson \
     libraw
 
-LIBS += -L$${TOP_BUILD_DIR}/cfitsio -lcfitsio
+LIBS += -L$${TOP_BUILD_DIR}/cfitsio -lcfitsio -lpthread
 INCLUDEPATH += $${TOP_SRC_DIR}/cfitsio
 
 SOURCES += \
     calibration-set.cpp \
     configuration.cpp \
+    file-hash.cpp \
     image-set.cpp \
     image.cpp \
     site.cpp \
+    trace.cpp \
     upload-item.cpp
 
 HEADERS += \
+    file-hash.h \
+    fits-lock.h \
     site.h \
+    trace.h \
     upload-item.h
 
 headers.files = \
     calibration-set.h \
+    file-hash.h \
+    fits-lock.h \
     image-set.h \
     image.h \
     site.h \
+    trace.h \
     upload-item.h
 
 headers.path = $${INSTALL_PREFIX}/include/ABC/
@@ -0,0 +1,245 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "debug.h"
+#include "trace.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTextStream>
+#include <QThread>
+#include <QVector>
+
+/* Stop recording past this many events (about 40 MB) */
+#define MAX_EVENTS  1000000
+/* The duration of counter events */
+#define COUNTER     (-1)
+
+using namespace ABC;
+
+namespace ABC {
+
+struct TraceEvent
+{
+    const char *name;
+    qint64 start;
+    qint64 duration;
+    /* The id of asynchronous events, or the value of counters */
+    qint64 value;
+    Qt::HANDLE thread;
+};
+
+struct TimerMetric
+{
+    TimerMetric(): count(0), total(0), max(0) {}
+    qint64 count;
+    qint64 total;
+    qint64 max;
+};
+
+class TraceData
+{
+public:
+    TraceData(): recording(false) { timer.start(); }
+
+    void addEvent(const char *name, qint64 start, qint64 duration,
+                  qint64 value);
+
+    QMutex mutex;
+    QElapsedTimer timer;
+    bool recording;
+    QVector<TraceEvent> events;
+    QHash<const char *, TimerMetric> timers;
+    QHash<const char *, qint64> counters;
+};
+
+} // namespace
+
+Q_GLOBAL_STATIC(TraceData, traceData)
+
+void TraceData::addEvent(const char *name, qint64 start, qint64 duration,
+                         qint64 value)
+{
+    if (!recording) return;
+
+    if (events.count() >= MAX_EVENTS) {
+        qWarning() << "Too many trace events; recording stopped";
+        recording = false;
+        return;
+    }
+
+    TraceEvent event;
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    event.value = value;
+    event.thread = QThread::currentThreadId();
+    events.append(event);
+}
+
+qint64 Trace::now()
+{
+    return traceData()->timer.nsecsElapsed() / 1000;
+}
+
+void Trace::addEvent(const char *name, qint64 start, qint64 duration,
+                     quintptr id)
+{
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+
+    TimerMetric &metric = d->timers[name];
+    metric.count++;
+    metric.total += duration;
+    if (duration > metric.max) metric.max = duration;
+
+    d->addEvent(name, start, duration, qint64(id));
+}
+
+void Trace::addCount(const char *name, qint64 delta)
+{
+    qint64 start = now();
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+
+    qint64 &value = d->counters[name];
+    value += delta;
+
+    d->addEvent(name, start, COUNTER, value);
+}
+
+void Trace::setRecording(bool recording)
+{
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+    d->recording = recording;
+}
+
+bool Trace::isRecording()
+{
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+    return d->recording;
+}
+
+static QByteArray jsonString(const char *text)
+{
+    QByteArray result(text);
+    result.replace('\\', "\\\\");
+    result.replace('"', "\\\"");
+    return '"' + result + '"';
+}
+
+bool Trace::writeChromeTrace(const QString &filePath)
+{
+    TraceData *d = traceData();
+    QVector<TraceEvent> events;
+    {
+        QMutexLocker locker(&d->mutex);
+        events = d->events;
+    }
+
+    QFile file(filePath);
+    if (Q_UNLIKELY(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))) {
+        qWarning() << "Cannot write trace" << filePath <<
+            file.errorString();
+        return false;
+    }
+
+    /* Thread handles are not readable; number the threads instead */
+    QHash<Qt::HANDLE, int> threadIds;
+
+    QTextStream out(&file);
+    out << "{\"traceEvents\":[";
+    for (int i = 0; i < events.count(); i++) {
+        const TraceEvent &event = events[i];
+        int tid = threadIds.value(event.thread, 0);
+        if (tid == 0) {
+            tid = threadIds.count() + 1;
+            threadIds.insert(event.thread, tid);
+        }
+
+        QByteArray name = jsonString(event.name);
+        if (i > 0) out << ",";
+        out << "\n{\"name\":" << name << ",\"pid\":1,\"tid\":" << tid;
+        if (event.duration == COUNTER) {
+            out << ",\"ph\":\"C\",\"ts\":" << event.start <<
+                ",\"args\":{\"value\":" << event.value << "}}";
+        } else if (event.value != 0) {
+            /* Asynchronous events are a begin and end pair */
+            out << ",\"cat\":\"async\",\"ph\":\"b\",\"id\":" << event.value <<
+                ",\"ts\":" << event.start << "},";
+            out << "\n{\"name\":" << name << ",\"pid\":1,\"tid\":" << tid <<
+                ",\"cat\":\"async\",\"ph\":\"e\",\"id\":" << event.value <<
+                ",\"ts\":" << event.start + event.duration << "}";
+        } else {
+            out << ",\"ph\":\"X\",\"ts\":" << event.start <<
+                ",\"dur\":" << event.duration << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    out.flush();
+
+    if (Q_UNLIKELY(file.error() != QFile::NoError)) {
+        qWarning() << "Error writing trace" << filePath << file.errorString();
+        return false;
+    }
+
+    DEBUG() << "Wrote" << events.count() << "events to" << filePath;
+    return true;
+}
+
+QVariantMap Trace::metrics()
+{
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+
+    /* The same name might come from different string literals */
+    QVariantMap result;
+    QHash<const char *, TimerMetric>::const_iterator t;
+    for (t = d->timers.constBegin(); t != d->timers.constEnd(); t++) {
+        QString name = QString::fromLatin1(t.key());
+        QVariantMap metric = result.value(name).toMap();
+        metric["count"] = metric.value("count").toLongLong() + t->count;
+        metric["total"] = metric.value("total").toLongLong() + t->total;
+        metric["max"] = qMax(metric.value("max").toLongLong(), t->max);
+        result.insert(name, metric);
+    }
+
+    QHash<const char *, qint64>::const_iterator c;
+    for (c = d->counters.constBegin(); c != d->counters.constEnd(); c++) {
+        QString name = QString::fromLatin1(c.key());
+        result.insert(name, result.value(name).toLongLong() + c.value());
+    }
+
+    return result;
+}
+
+void Trace::clear()
+{
+    TraceData *d = traceData();
+    QMutexLocker locker(&d->mutex);
+    d->events.clear();
+    d->timers.clear();
+    d->counters.clear();
+}
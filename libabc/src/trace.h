@@ -0,0 +1,85 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ABC_TRACE_H
+#define ABC_TRACE_H
+
+#include <QString>
+#include <QVariantMap>
+
+namespace ABC {
+
+/* Timers and counters for the hot paths. The event names must be string
+ * literals: only their pointers are stored.
+ *
+ * Timed events always update the metrics; they are also kept for the
+ * Chrome trace (chrome://tracing) only while recording. */
+class Trace
+{
+public:
+    /* Microseconds since the first call */
+    static qint64 now();
+
+    /* Events with an id are asynchronous: they can overlap other events
+     * of the same thread, like network transfers do */
+    static void addEvent(const char *name, qint64 start, qint64 duration,
+                         quintptr id = 0);
+    static void addCount(const char *name, qint64 delta);
+
+    static void setRecording(bool recording);
+    static bool isRecording();
+    static bool writeChromeTrace(const QString &filePath);
+
+    /* For each timer, a map with the "count", "total" and "max" durations
+     * in microseconds; for each counter, its value */
+    static QVariantMap metrics();
+
+    static void clear();
+};
+
+class TraceScope
+{
+public:
+    TraceScope(const char *name): name(name), start(Trace::now()) {}
+    ~TraceScope() { Trace::addEvent(name, start, Trace::now() - start); }
+
+private:
+    const char *name;
+    qint64 start;
+};
+
+}; // namespace
+
+/* Build with CONFIG+=tracing to compile these in */
+#ifdef ABC_TRACING
+#define ABC_TRACE_SCOPE(name) ABC::TraceScope abcTraceScope(name)
+#define ABC_TRACE_COUNT(name, delta) ABC::Trace::addCount(name, delta)
+#define ABC_TRACE_START(start) start = ABC::Trace::now()
+#define ABC_TRACE_ASYNC_END(name, start, id) \
+    ABC::Trace::addEvent(name, start, ABC::Trace::now() - start, \
+                         quintptr(id))
+#else
+#define ABC_TRACE_SCOPE(name)
+#define ABC_TRACE_COUNT(name, delta)
+#define ABC_TRACE_START(start)
+#define ABC_TRACE_ASYNC_END(name, start, id)
+#endif
+
+#endif /* ABC_TRACE_H */
@@ -19,19 +19,61 @@
  */
 
 #include "debug.h"
+#include "file-hash.h"
+#include "fits-lock.h"
 #include "site.h"
+#include "trace.h"
 #include "upload-item.h"
 
-#include <QCryptographicHash>
+#include <QAtomicInt>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QFutureWatcher>
 #include <QHttpMultiPart>
+#include <QMutex>
 #include <QNetworkReply>
+#include <QSharedPointer>
+#include <QTemporaryFile>
+#include <QtConcurrentRun>
+#include <fitsio.h>
+
+#define COMPRESSED_FILE_SUFFIX ".fz"
+#define COMPRESSED_FILE_TEMPLATE "abc-upload-XXXXXX" COMPRESSED_FILE_SUFFIX
 
 using namespace ABC;
 
 namespace ABC {
 
+struct PreparedFile {
+    /* Of the compressed copy; empty if the original file is uploaded */
+    QString compressedPath;
+    /* Of the bytes to upload; empty if the file could not be read */
+    QByteArray hash;
+};
+
+/* Shared by the item and the thread preparing its file: if the item is
+ * deleted before the thread is done, the thread deletes the compressed
+ * copy. */
+struct PreparationJob {
+    enum State {
+        Running = 0,
+        Done,
+        Cancelled,
+    };
+    PreparationJob(): state(Running) {}
+    QAtomicInt state;
+    PreparedFile file;
+};
+
+/* A temporary file, which is deleted once the upload is done with it */
+class CompressedUpload: public QFile
+{
+public:
+    CompressedUpload(const QString &filePath): QFile(filePath) {}
+    ~CompressedUpload() { remove(); }
+};
+
 class UploadItemPrivate: public QObject
 {
     Q_OBJECT
@@ -40,13 +82,18 @@ class UploadItemPrivate: public QObject
     UploadItemPrivate(const QString &filePath,
                       const QString &fileName,
                       UploadItem *q);
+    ~UploadItemPrivate();
     void startUpload(Site *site);
+    void sendFile(Site *site);
 
     bool checkReply(QNetworkReply *reply);
+    bool willCompress() const;
     void computeHash();
+    void prepare();
     void updateProgress(int value);
 
 private Q_SLOTS:
+    void onPreparationFinished();
     void onUploadProgress(qint64 bytesSent, qint64 bytesTotal);
     void onFinished();
 
@@ -54,10 +101,23 @@ private:
     QString filePath;
     QString fileName;
     QDir baseDir;
+    /* Of the bytes to upload: the compressed copy, if there is one */
     QByteArray fileHash;
+    QString compressedPath;
+    bool prepared;
+    mutable ImageType imageType;
+    mutable bool imageTypeKnown;
+    bool contentKnown;
+    bool compressionEnabled;
+    QFutureWatcher<void> *preparationWatcher;
+    QSharedPointer<PreparationJob> preparationJob;
+    Site *pendingSite;
     int progress;
+    qint64 bytesSent;
+    qint64 bytesTotal;
     Site::ErrorCode lastError;
     QString lastErrorMessage;
+    qint64 uploadStart;
     mutable UploadItem *q_ptr;
 };
 
@@ -68,27 +128,216 @@ UploadItemPrivate::UploadItemPrivate(const QString &filePath,
                                      UploadItem *q):
     filePath(filePath),
     fileName(fileName),
+    prepared(false),
+    imageType(UnknownType),
+    imageTypeKnown(false),
+    contentKnown(false),
+    compressionEnabled(false),
+    preparationWatcher(0),
+    pendingSite(0),
     progress(0),
+    bytesSent(0),
+    bytesTotal(0),
     lastError(Site::NoError),
+    uploadStart(0),
     q_ptr(q)
 {
 }
 
+UploadItemPrivate::~UploadItemPrivate()
+{
+    /* Don't wait for a preparation still running: the worker thread will
+     * find out that the item is gone */
+    if (preparationJob &&
+        !preparationJob->state.testAndSetOrdered(PreparationJob::Running,
+                                                 PreparationJob::Cancelled)) {
+        compressedPath = preparationJob->file.compressedPath;
+    }
+
+    /* Don't leave behind a compressed file which was never uploaded */
+    if (!compressedPath.isEmpty()) QFile::remove(compressedPath);
+}
+
+static bool isFitsFile(const QString &filePath)
+{
+    QString suffix = QFileInfo(filePath).suffix().toLower();
+    return suffix == "fit" || suffix == "fits" || suffix == "fts";
+}
+
+/* Compress an integer FITS image with the lossless Rice algorithm, as fpack
+ * would do, and hash the result as it will be uploaded; no file is returned
+ * if the image cannot be losslessly compressed.
+ * The compressed image is written to a temporary file, because it cannot be
+ * streamed to the server while it's being produced: the table indexing the
+ * tiles precedes them, so it's only complete once all the tiles have been
+ * compressed, and the request needs the length and the hash of the file
+ * before its body is sent. A file, rather than a buffer, keeps the memory
+ * use low with large images. */
+static PreparedFile compressFits(const QString &filePath)
+{
+    ABC_TRACE_SCOPE("compressFits");
+    PreparedFile compressed;
+    QMutexLocker locker(fitsMutex(filePath));
+
+    int status = 0;
+    fitsfile *in = 0;
+    fits_open_image(&in, QFile::encodeName(filePath).constData(),
+                    READONLY, &status);
+    if (status != 0) return compressed;
+
+    int bitpix = 0;
+    int numAxes = 0;
+    int numHdus = 0;
+    fits_get_img_type(in, &bitpix, &status);
+    fits_get_img_dim(in, &numAxes, &status);
+    fits_get_num_hdus(in, &numHdus, &status);
+    if (status != 0 || bitpix < 0 || numAxes == 0 || numHdus != 1 ||
+        fits_is_compressed_image(in, &status)) {
+        status = 0;
+        fits_close_file(in, &status);
+        return compressed;
+    }
+
+    /* Just reserve a name: cfitsio creates the file */
+    QTemporaryFile tmpFile(QDir::temp().filePath(COMPRESSED_FILE_TEMPLATE));
+    tmpFile.setAutoRemove(false);
+    if (!tmpFile.open()) {
+        fits_close_file(in, &status);
+        return compressed;
+    }
+    QString compressedPath = tmpFile.fileName();
+    tmpFile.close();
+
+    /* The leading '!' tells cfitsio to overwrite the file */
+    fitsfile *out = 0;
+    fits_create_file(&out,
+                     QFile::encodeName("!" + compressedPath).constData(),
+                     &status);
+
+    /* The compressed image is stored in an extension, after an empty
+     * primary HDU */
+    long noAxes[1] = { 0 };
+    fits_create_img(out, BYTE_IMG, 0, noAxes, &status);
+    fits_set_compression_type(out, RICE_1, &status);
+    fits_img_compress(in, out, &status);
+
+    int closeStatus = 0;
+    if (out != 0) fits_close_file(out, &closeStatus);
+    fits_close_file(in, &closeStatus);
+    locker.unlock();
+
+    if (status == 0 && closeStatus == 0) {
+        compressed.compressedPath = compressedPath;
+        compressed.hash = FileHash::hash(compressedPath, FileHash::Md5);
+    } else {
+        qWarning() << "Compression of" << filePath << "failed:" << status;
+        QFile::remove(compressedPath);
+    }
+    return compressed;
+}
+
+/* Compress the file, if requested, and hash the bytes to upload */
+static PreparedFile prepareFile(const QString &filePath, bool compress)
+{
+    PreparedFile prepared;
+    if (compress) prepared = compressFits(filePath);
+    /* If the original file is uploaded, that's the hash to send */
+    if (prepared.compressedPath.isEmpty()) {
+        prepared.hash = FileHash::hash(filePath, FileHash::Md5);
+    }
+    return prepared;
+}
+
+/* Runs in the thread pool */
+static void runPreparation(const QString &filePath, bool compress,
+                           QSharedPointer<PreparationJob> job)
+{
+    job->file = prepareFile(filePath, compress);
+
+    if (!job->state.testAndSetOrdered(PreparationJob::Running,
+                                      PreparationJob::Done)) {
+        /* The item is gone: no one will upload the file */
+        if (!job->file.compressedPath.isEmpty()) {
+            QFile::remove(job->file.compressedPath);
+        }
+    }
+}
+
+bool UploadItemPrivate::willCompress() const
+{
+    return compressionEnabled && isFitsFile(filePath);
+}
+
+/* Blocks until the file is ready to be uploaded: it's meant to be run in
+ * the thread pool. */
 void UploadItemPrivate::computeHash()
 {
-    QCryptographicHash hash(QCryptographicHash::Md5);
-    QFile file(filePath);
-    file.open(QIODevice::ReadOnly);
-    hash.addData(file.readAll());
-    fileHash = hash.result().toHex();
+    ABC_TRACE_SCOPE("UploadItem::computeHash");
+    if (prepared) return;
+
+    PreparedFile file = prepareFile(filePath, willCompress());
+    compressedPath = file.compressedPath;
+    fileHash = file.hash;
+    prepared = true;
+}
+
+/* Start compressing and hashing the file in a worker thread, so that it
+ * will be ready when the upload starts. */
+void UploadItemPrivate::prepare()
+{
+    if (contentKnown || prepared || preparationWatcher != 0) return;
+
+    preparationJob = QSharedPointer<PreparationJob>(new PreparationJob);
+    preparationWatcher = new QFutureWatcher<void>(this);
+    QObject::connect(preparationWatcher, SIGNAL(finished()),
+                     this, SLOT(onPreparationFinished()));
+    preparationWatcher->setFuture(QtConcurrent::run(runPreparation,
+                                                    filePath,
+                                                    willCompress(),
+                                                    preparationJob));
+}
+
+void UploadItemPrivate::onPreparationFinished()
+{
+    compressedPath = preparationJob->file.compressedPath;
+    fileHash = preparationJob->file.hash;
+    prepared = true;
+    preparationJob.clear();
+    preparationWatcher->deleteLater();
+    preparationWatcher = 0;
+
+    if (pendingSite == 0) return;
+
+    Site *site = pendingSite;
+    pendingSite = 0;
+    sendFile(site);
 }
 
 void UploadItemPrivate::startUpload(Site *site)
 {
-    computeHash();
+    bytesSent = 0;
+    bytesTotal = 0;
+
+    /* Registering the file needs only the hash, which has been checked
+     * already */
+    if (contentKnown && !site->canRegisterFiles()) contentKnown = false;
+    if (!contentKnown) {
+        prepare();
+        if (preparationWatcher != 0) {
+            /* The upload will start once the file is ready */
+            pendingSite = site;
+            return;
+        }
+    }
+
+    sendFile(site);
+}
 
+void UploadItemPrivate::sendFile(Site *site)
+{
     QList<QHttpPart> parts;
 
+    /* The hash of the bytes being uploaded */
     QHttpPart hashPart;
     hashPart.setHeader(QNetworkRequest::ContentDispositionHeader,
                        QByteArray("form-data; name=\"file_hash\""));
@@ -101,7 +350,31 @@ void UploadItemPrivate::startUpload(Site *site)
     pathPart.setBody(fileName.toUtf8());
     parts.append(pathPart);
 
-    QNetworkReply *reply = site->uploadFile(filePath, parts);
+    ABC_TRACE_START(uploadStart);
+
+    /* If the server already has a file with the same contents, we just
+     * need to tell it about the new path */
+    QNetworkReply *reply;
+    if (contentKnown) {
+        reply = site->registerFile(parts);
+    } else if (!compressedPath.isEmpty()) {
+        /* The file is streamed from the disk, and deleted afterwards; a
+         * retry will compress it again */
+        CompressedUpload *file = new CompressedUpload(compressedPath);
+        compressedPath.clear();
+        prepared = false;
+        file->open(QIODevice::ReadOnly);
+        ABC_TRACE_COUNT("bytes uploaded", file->size());
+        DEBUG() << "Uploading compressed" << fileName << ":" <<
+            file->size() << "bytes";
+        reply = site->uploadData(file,
+                                 QFileInfo(filePath).fileName() +
+                                 COMPRESSED_FILE_SUFFIX,
+                                 parts);
+    } else {
+        ABC_TRACE_COUNT("bytes uploaded", QFileInfo(filePath).size());
+        reply = site->uploadFile(filePath, parts);
+    }
     Q_ASSERT(reply != 0);
 
     QObject::connect(reply, SIGNAL(uploadProgress(qint64, qint64)),
@@ -152,6 +425,12 @@ bool UploadItemPrivate::checkReply(QNetworkReply *reply)
 void UploadItemPrivate::onUploadProgress(qint64 bytesSent,
                                          qint64 bytesTotal)
 {
+    Q_Q(UploadItem);
+
+    this->bytesSent = bytesSent;
+    this->bytesTotal = bytesTotal;
+    Q_EMIT q->bytesSentChanged(bytesSent, bytesTotal);
+
     int progress = (bytesTotal > 0) ? bytesSent * 100 / bytesTotal : 0;
     /* Let's keep 100% for confirmed uploads only */
     if (progress >= 100) progress = 99;
@@ -163,7 +442,16 @@ void UploadItemPrivate::onFinished()
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     Q_ASSERT(reply != 0);
 
-    updateProgress(checkReply(reply) ? 100 : -1);
+    ABC_TRACE_ASYNC_END(contentKnown ? "Site::registerFile" : "Site::upload",
+                        uploadStart, this);
+    bool ok = checkReply(reply);
+    if (!ok && contentKnown) {
+        /* The server might have lost the file in the meantime; the next
+         * attempt will upload the file contents. */
+        contentKnown = false;
+        lastError = Site::NetworkError;
+    }
+    updateProgress(ok ? 100 : -1);
 
     reply->deleteLater();
 }
@@ -215,6 +503,96 @@ int UploadItem::progress() const
     return d->progress;
 }
 
+qint64 UploadItem::bytesSent() const
+{
+    Q_D(const UploadItem);
+    return d->bytesSent;
+}
+
+qint64 UploadItem::bytesTotal() const
+{
+    Q_D(const UploadItem);
+    return d->bytesTotal;
+}
+
+ImageType UploadItem::imageType() const
+{
+    Q_D(const UploadItem);
+
+    if (!d->imageTypeKnown) {
+        d->imageType = Image::probeType(d->filePath);
+        d->imageTypeKnown = true;
+    }
+    return d->imageType;
+}
+
+void UploadItem::setImageType(ImageType type)
+{
+    Q_D(UploadItem);
+    d->imageType = type;
+    d->imageTypeKnown = true;
+}
+
+bool UploadItem::isImageTypeKnown() const
+{
+    Q_D(const UploadItem);
+    return d->imageTypeKnown;
+}
+
+ImageType UploadItem::probeImageType() const
+{
+    Q_D(const UploadItem);
+    return Image::probeType(d->filePath);
+}
+
+void UploadItem::computeHash()
+{
+    Q_D(UploadItem);
+    d->computeHash();
+}
+
+/* When enabled, integer FITS files are losslessly compressed before being
+ * uploaded. */
+void UploadItem::setCompressionEnabled(bool enabled)
+{
+    Q_D(UploadItem);
+    d->compressionEnabled = enabled;
+}
+
+bool UploadItem::compressionEnabled() const
+{
+    Q_D(const UploadItem);
+    return d->compressionEnabled;
+}
+
+/* Start the preparation of the file (compression and hashing) in the
+ * background, ahead of the actual upload. */
+void UploadItem::prepare()
+{
+    Q_D(UploadItem);
+    d->prepare();
+}
+
+void UploadItem::setContentKnown(bool known)
+{
+    Q_D(UploadItem);
+    d->contentKnown = known;
+
+    /* The compressed copy won't be uploaded, unless registering the file
+     * fails; then it will be compressed again */
+    if (known && !d->compressedPath.isEmpty()) {
+        QFile::remove(d->compressedPath);
+        d->compressedPath.clear();
+        d->prepared = false;
+    }
+}
+
+bool UploadItem::isContentKnown() const
+{
+    Q_D(const UploadItem);
+    return d->contentKnown;
+}
+
 Site::ErrorCode UploadItem::lastError() const
 {
     Q_D(const UploadItem);
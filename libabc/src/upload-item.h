@@ -21,6 +21,7 @@
 #ifndef ABC_UPLOAD_ITEM_H
 #define ABC_UPLOAD_ITEM_H
 
+#include "image.h"
 #include "site.h"
 
 #include <QByteArray>
@@ -47,6 +48,30 @@ public:
     QString fileName() const;
     QByteArray fileHash() const;
     int progress() const;
+    /* Of the current upload: the total is the size of the request, which
+     * is smaller than the file if this is compressed */
+    qint64 bytesSent() const;
+    qint64 bytesTotal() const;
+    /* Probed from the file, the first time it's called, unless it was
+     * already set */
+    ImageType imageType() const;
+    void setImageType(ImageType type);
+    bool isImageTypeKnown() const;
+    /* Reads the type from the file without storing it, so it can be called
+     * from any thread */
+    ImageType probeImageType() const;
+
+    /* Prepares the file for the upload (compressing it, if enabled) and
+     * computes the hash of the bytes to send; since it blocks, it's meant
+     * to be run in the thread pool. */
+    void computeHash();
+
+    void setContentKnown(bool known);
+    bool isContentKnown() const;
+
+    void setCompressionEnabled(bool enabled);
+    bool compressionEnabled() const;
+    void prepare();
 
     Site::ErrorCode lastError() const;
     QString lastErrorMessage() const;
@@ -57,6 +82,7 @@ public Q_SLOTS:
 
 Q_SIGNALS:
     void progressChanged(int progress);
+    void bytesSentChanged(qint64 bytesSent, qint64 bytesTotal);
 
 private:
     UploadItemPrivate *d_ptr;
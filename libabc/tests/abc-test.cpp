@@ -21,13 +21,29 @@
 #include "abc-test.h"
 
 #include "configuration.h"
+#include "file-hash.h"
+#include "frame-generator.h"
 #include "image-set.h"
 #include "image.h"
+#include "site.h"
+#include "trace.h"
 
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QRect>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrentMap>
+#include <fitsio.h>
 
 #define UTF8(s) QString::fromUtf8(s)
+#define HASH_BENCHMARK_SIZE (64 * 1024 * 1024)
+#define STRESS_THREADS      16
+#define STRESS_JOBS         256
+/* Large enough to be decompressed in several bands */
+#define COMPRESSED_SIZE     QSize(1280, 960)
 
 using namespace ABC;
 
@@ -37,6 +53,7 @@ void AbcTest::initTestCase()
 
 void AbcTest::cleanupTestCase()
 {
+    QFile::remove(QDir::temp().filePath("abc-hash-benchmark"));
 }
 
 void AbcTest::loadFits()
@@ -153,6 +170,195 @@ void AbcTest::imageOperations()
     QCOMPARE(ab + bc - b, sum);
 }
 
+static void countRelease(PixelValue *pixels, void *userData)
+{
+    Q_UNUSED(pixels);
+    (*static_cast<int *>(userData))++;
+}
+
+void AbcTest::imageFromPixels()
+{
+    PixelValue buffer[6] = { 1, 2, 3, 4, 5, 6 };
+    int releaseCount = 0;
+
+    {
+        Image image = Image::fromPixels(buffer, QSize(3, 2),
+                                        countRelease, &releaseCount);
+        QVERIFY(image.isValid());
+        QCOMPARE(image.size(), QSize(3, 2));
+        /* No copies are made */
+        QVERIFY(image.pixels() == buffer);
+        QCOMPARE(image.constLine(1)[0], PixelValue(4));
+
+        /* A copy shares the pixels until it's modified */
+        Image copy = image;
+        QVERIFY(copy.constPixels() == buffer);
+        copy.pixels()[0] = 10;
+        QVERIFY(copy.constPixels() != buffer);
+        QCOMPARE(buffer[0], PixelValue(1));
+
+        Image sum = image + copy;
+        QCOMPARE(sum.constPixels()[0], PixelValue(11));
+        QCOMPARE(releaseCount, 0);
+    }
+
+    QCOMPARE(releaseCount, 1);
+}
+
+void AbcTest::imageSetBatch()
+{
+    QStringList fileNames;
+    for (int i = 0; i < 8; i++) {
+        fileNames.append(QString("32i/%1.fit").arg(i));
+    }
+
+    /* Same order as the file names, and missing files are not valid */
+    QList<Image> images =
+        Image::fromFiles(fileNames + QStringList("missing.fit"));
+    QCOMPARE(images.count(), 9);
+    QVERIFY(!images.last().isValid());
+    for (int i = 0; i < 8; i++) {
+        QCOMPARE(images[i], Image::fromFile(fileNames[i]));
+    }
+
+    ImageSet set;
+    QCOMPARE(set.addFiles(fileNames + QStringList("missing.fit")), 8);
+    QCOMPARE(set.count(), 8);
+
+    ImageSet expected;
+    Image dark = images[0];
+    Image flat = images[1];
+    for (int i = 0; i < 8; i++) {
+        Image image = images[i] - dark;
+        image.divide(flat);
+        expected.addImage(image);
+    }
+
+    set.calibrate(dark, flat);
+    QCOMPARE(set.average(), expected.average());
+    /* The sources are not modified */
+    QCOMPARE(images[2], Image::fromFile(fileNames[2]));
+}
+
+namespace {
+
+/* Loads a set of frames, starting from a different one in each job, and
+ * stacks them */
+struct StackFrames
+{
+    typedef Image result_type;
+
+    StackFrames(const QStringList &fileNames): fileNames(fileNames) {}
+
+    Image operator()(int job) const {
+        ImageSet set;
+        int count = fileNames.count();
+        for (int i = 0; i < count; i++) {
+            QString fileName = fileNames[(job + i) % count];
+            /* Mix header reads with full loads */
+            Image::probeType(fileName);
+            set.addImage(Image::fromFile(fileName));
+        }
+        return set.average();
+    }
+
+    QStringList fileNames;
+};
+
+} // namespace
+
+void AbcTest::concurrentLoad()
+{
+    /* Relative and absolute paths to the same files: cfitsio shares the
+     * handles of files opened more than once */
+    QStringList fileNames;
+    for (int i = 0; i < 8; i++) {
+        fileNames.append(QString("32i/%1.fit").arg(i));
+    }
+    fileNames.append(QDir::current().absoluteFilePath("32i/0.fit"));
+    fileNames.append(QDir::current().absoluteFilePath("32i/./1.fit"));
+
+    ImageSet serial;
+    foreach (const QString &fileName, fileNames) {
+        QVERIFY(serial.addImage(Image::fromFile(fileName)));
+    }
+    Image expected = serial.average();
+    QVERIFY(expected.isValid());
+
+    QList<int> jobs;
+    for (int i = 0; i < STRESS_JOBS; i++) jobs.append(i);
+
+    int maxThreads = QThreadPool::globalInstance()->maxThreadCount();
+    QThreadPool::globalInstance()->setMaxThreadCount(STRESS_THREADS);
+    QList<Image> results =
+        QtConcurrent::blockingMapped<QList<Image> >(jobs,
+                                                    StackFrames(fileNames));
+    QThreadPool::globalInstance()->setMaxThreadCount(maxThreads);
+
+    QCOMPARE(results.count(), STRESS_JOBS);
+    foreach (const Image &result, results) {
+        QCOMPARE(result, expected);
+    }
+
+    /* The same files through the batch API */
+    QStringList manyFiles;
+    for (int i = 0; i < STRESS_JOBS / 8; i++) manyFiles += fileNames;
+    ImageSet batch;
+    QCOMPARE(batch.addFiles(manyFiles), manyFiles.count());
+    QCOMPARE(batch.average(), expected);
+}
+
+void AbcTest::loadCompressedFits_data()
+{
+    QTest::addColumn<int>("bitpix");
+    QTest::addColumn<int>("compression");
+
+    QTest::newRow("16 rice") << 16 << int(RICE_1);
+    QTest::newRow("16 gzip") << 16 << int(GZIP_1);
+    QTest::newRow("16 hcompress") << 16 << int(HCOMPRESS_1);
+    QTest::newRow("32 rice") << 32 << int(RICE_1);
+    /* Quantized, hence lossy */
+    QTest::newRow("-32 rice") << -32 << int(RICE_1);
+}
+
+void AbcTest::loadCompressedFits()
+{
+    QFETCH(int, bitpix);
+    QFETCH(int, compression);
+
+    QString fileName = QDir::temp().filePath("abc-test-compressed.fz");
+    FrameGenerator generator;
+    generator.setSize(COMPRESSED_SIZE);
+    generator.setBitpix(bitpix);
+    generator.setCompression(compression);
+    QVERIFY(generator.write(fileName));
+
+    /* What cfitsio reads, one tile after the other */
+    QVector<PixelValue> pixels(COMPRESSED_SIZE.width() *
+                               COMPRESSED_SIZE.height());
+    fitsfile *ff = 0;
+    int status = 0;
+    fits_open_image(&ff, QFile::encodeName(fileName).constData(), READONLY,
+                    &status);
+    long firstPixels[2];
+    firstPixels[0] = firstPixels[1] = 1;
+    fits_read_pix(ff, TFLOAT, firstPixels, pixels.count(), NULL,
+                  pixels.data(), NULL, &status);
+    fits_close_file(ff, &status);
+    QCOMPARE(status, 0);
+    Image expected = Image::fromPixels(pixels.data(), COMPRESSED_SIZE, 0, 0);
+
+    /* Use several threads even on a single core */
+    int maxThreads = QThreadPool::globalInstance()->maxThreadCount();
+    QThreadPool::globalInstance()->setMaxThreadCount(STRESS_THREADS);
+    Image image = Image::fromFile(fileName);
+    QThreadPool::globalInstance()->setMaxThreadCount(maxThreads);
+    QFile::remove(fileName);
+
+    QVERIFY(image.isValid());
+    QCOMPARE(image, expected);
+}
+
 void AbcTest::configuration()
 {
     Configuration *conf = Configuration::instance();
@@ -165,4 +371,149 @@ void AbcTest::configuration()
     QCOMPARE(conf->calibrationMaxTemperatureDiff(), 1.0f);
 }
 
+void AbcTest::fileHash_data()
+{
+    QTest::addColumn<int>("algorithm");
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<QByteArray>("expectedHash");
+
+    QTest::newRow("md5 empty") << int(FileHash::Md5) << QByteArray() <<
+        QByteArray("d41d8cd98f00b204e9800998ecf8427e");
+    QTest::newRow("md5 abc") << int(FileHash::Md5) << QByteArray("abc") <<
+        QByteArray("900150983cd24fb0d6963f7d28e17f72");
+    QTest::newRow("xxh64 empty") << int(FileHash::XxHash64) << QByteArray() <<
+        QByteArray("ef46db3751d8e999");
+    QTest::newRow("xxh64 abc") << int(FileHash::XxHash64) <<
+        QByteArray("abc") << QByteArray("44bc2cf5ad770999");
+    QTest::newRow("xxh64 long") << int(FileHash::XxHash64) <<
+        QByteArray("Nobody inspects the spammish repetition") <<
+        QByteArray("fbcea83c8a378bf1");
+}
+
+void AbcTest::fileHash()
+{
+    QFETCH(int, algorithm);
+    QFETCH(QByteArray, data);
+    QFETCH(QByteArray, expectedHash);
+
+    FileHash::Algorithm alg = FileHash::Algorithm(algorithm);
+    QCOMPARE(FileHash::hashData(data, alg), expectedHash);
+
+    /* Write the data in a small file and in a big one (which gets mapped
+     * in memory), and hash them both */
+    QString smallFile = QDir::temp().filePath("abc-hash-small");
+    QString bigFile = QDir::temp().filePath("abc-hash-big");
+    QFile file(smallFile);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    file.write(data);
+    file.close();
+
+    QByteArray bigData(3 * 1024 * 1024 + 7, 'x');
+    bigData.append(data);
+    file.setFileName(bigFile);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    file.write(bigData);
+    file.close();
+
+    QCOMPARE(FileHash::hash(smallFile, alg), expectedHash);
+    QCOMPARE(FileHash::hash(bigFile, alg), FileHash::hashData(bigData, alg));
+
+    QList<QByteArray> hashes =
+        FileHash::hashFiles(QStringList() << smallFile << bigFile <<
+                            "/nonexistent", alg);
+    QCOMPARE(hashes.count(), 3);
+    QCOMPARE(hashes[0], expectedHash);
+    QCOMPARE(hashes[1], FileHash::hashData(bigData, alg));
+    QVERIFY(hashes[2].isEmpty());
+
+    QFile::remove(smallFile);
+    QFile::remove(bigFile);
+}
+
+void AbcTest::fileHashBenchmark_data()
+{
+    QTest::addColumn<int>("algorithm");
+
+    QTest::newRow("md5") << int(FileHash::Md5);
+    QTest::newRow("xxh64") << int(FileHash::XxHash64);
+}
+
+void AbcTest::fileHashBenchmark()
+{
+    QFETCH(int, algorithm);
+
+    QString fileName = QDir::temp().filePath("abc-hash-benchmark");
+    QFile file(fileName);
+    if (file.size() != HASH_BENCHMARK_SIZE) {
+        QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        QByteArray block(1024 * 1024, 0);
+        for (int i = 0; i < block.size(); i++) block[i] = char(i * 7);
+        for (int i = 0; i < HASH_BENCHMARK_SIZE / block.size(); i++) {
+            file.write(block);
+        }
+        file.close();
+    }
+
+    /* Warm up the page cache, so that we measure the hashing speed */
+    FileHash::hash(fileName, FileHash::Algorithm(algorithm));
+
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray hash = FileHash::hash(fileName,
+                                     FileHash::Algorithm(algorithm));
+    qint64 elapsed = qMax<qint64>(timer.elapsed(), 1);
+    QVERIFY(!hash.isEmpty());
+
+    qreal bytesPerSecond = HASH_BENCHMARK_SIZE * 1000.0 / elapsed;
+    qDebug() << "Hashing speed:" << bytesPerSecond / 1e9 << "GB/s";
+    QTest::setBenchmarkResult(bytesPerSecond, QTest::BytesPerSecond);
+}
+
+void AbcTest::trace()
+{
+    Trace::clear();
+    Trace::setRecording(true);
+    Trace::addEvent("test timer", 10, 5);
+    Trace::addEvent("test timer", 20, 15);
+    Trace::addEvent("test upload", 30, 100, 0x1234);
+    Trace::addCount("test counter", 3);
+    Trace::addCount("test counter", 4);
+    Trace::setRecording(false);
+    /* This only goes in the metrics */
+    Trace::addEvent("test upload", 200, 50, 0x1234);
+
+    QVariantMap metrics = Trace::metrics();
+    QVariantMap timer = metrics["test timer"].toMap();
+    QCOMPARE(timer["count"].toLongLong(), Q_INT64_C(2));
+    QCOMPARE(timer["total"].toLongLong(), Q_INT64_C(20));
+    QCOMPARE(timer["max"].toLongLong(), Q_INT64_C(15));
+    QCOMPARE(metrics["test upload"].toMap()["count"].toLongLong(),
+             Q_INT64_C(2));
+    QCOMPARE(metrics["test counter"].toLongLong(), Q_INT64_C(7));
+
+    QString fileName = QDir::temp().filePath("abc-trace.json");
+    QVERIFY(Trace::writeChromeTrace(fileName));
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QVariantMap json = Site::parseJson(file.readAll());
+    file.close();
+    QFile::remove(fileName);
+
+    /* The asynchronous event is written as a begin and end pair */
+    QVariantList events = json["traceEvents"].toList();
+    QCOMPARE(events.count(), 6);
+    QStringList phases;
+    foreach (const QVariant &event, events) {
+        phases.append(event.toMap()["ph"].toString());
+    }
+    QCOMPARE(phases, QStringList() << "X" << "X" << "b" << "e" << "C" << "C");
+    QVariantMap end = events[3].toMap();
+    QCOMPARE(end["name"].toString(), QString("test upload"));
+    QCOMPARE(end["ts"].toLongLong(), Q_INT64_C(130));
+    QCOMPARE(events[5].toMap()["args"].toMap()["value"].toInt(), 7);
+
+    Trace::clear();
+    QVERIFY(Trace::metrics().isEmpty());
+}
+
 QTEST_MAIN(AbcTest)
@@ -38,8 +38,20 @@ private Q_SLOTS:
     void imageSetAverage();
     void imageSetBounds();
     void imageOperations();
+    void imageFromPixels();
+    void imageSetBatch();
+    void concurrentLoad();
+    void loadCompressedFits_data();
+    void loadCompressedFits();
 
     void configuration();
+
+    void fileHash_data();
+    void fileHash();
+    void fileHashBenchmark_data();
+    void fileHashBenchmark();
+
+    void trace();
 };
 
 }; // namespace
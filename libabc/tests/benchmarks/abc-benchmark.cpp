@@ -0,0 +1,214 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "abc-benchmark.h"
+
+#include "frame-generator.h"
+#include "image-set.h"
+
+#include <QDebug>
+#include <QImage>
+#include <QStringList>
+
+/* Large enough to show the cost of reading and converting the pixels */
+#define LOAD_FRAME_SIZE     QSize(2048, 1536)
+/* Tile compressed like fpack does it */
+#define COMPRESSED_FRAME    "light_i16.fz"
+/* The frames used for the arithmetic and the stacking: the sets reuse the
+ * same frames, to limit the memory usage */
+#define STACK_FRAME_SIZE    QSize(1024, 768)
+#define STACK_FRAMES        8
+#define SIGMA_FACTOR        2.0f
+
+using namespace ABC;
+
+static QString loadFrameName(int bitpix)
+{
+    /* The type is read from the file name: this avoids the detection from
+     * the pixel statistics, which is not what we want to measure */
+    return QString("light_%1%2.fit").arg(bitpix < 0 ? "f" : "i").
+        arg(qAbs(bitpix));
+}
+
+void AbcBenchmark::initTestCase()
+{
+    dataDir = QDir::temp();
+    dataDir.mkdir("abc-benchmark");
+    QVERIFY(dataDir.cd("abc-benchmark"));
+
+    FrameGenerator generator;
+    generator.setSize(LOAD_FRAME_SIZE);
+    QList<int> bitpixes;
+    bitpixes << 16 << 32 << -32 << -64;
+    foreach (int bitpix, bitpixes) {
+        generator.setBitpix(bitpix);
+        QVERIFY(generator.write(dataDir.filePath(loadFrameName(bitpix))));
+    }
+    generator.setBitpix(16);
+    generator.setCompression(RICE_1);
+    QVERIFY(generator.write(dataDir.filePath(COMPRESSED_FRAME)));
+    generator.setCompression(0);
+
+    generator.setSize(STACK_FRAME_SIZE);
+    generator.setBitpix(-32);
+    for (int i = 0; i < STACK_FRAMES; i++) {
+        QString filePath = dataDir.filePath(QString("light_s%1.fit").arg(i));
+        generator.setSeed(i + 1);
+        QVERIFY(generator.write(filePath));
+        Image frame = Image::fromFile(filePath);
+        QVERIFY(frame.isValid());
+        frames.append(frame);
+    }
+
+    /* A normalized flat field */
+    QString flatPath = dataDir.filePath("flat.fit");
+    generator.setLevel(1.0);
+    generator.setNoise(0.01);
+    QVERIFY(generator.write(flatPath));
+    flat = Image::fromFile(flatPath);
+    QVERIFY(flat.isValid());
+}
+
+void AbcBenchmark::cleanupTestCase()
+{
+    frames.clear();
+    flat = Image();
+
+    foreach (const QString &fileName, dataDir.entryList(QDir::Files)) {
+        dataDir.remove(fileName);
+    }
+    QDir::temp().rmdir("abc-benchmark");
+}
+
+void AbcBenchmark::loadFits_data()
+{
+    QTest::addColumn<QString>("filePath");
+
+    QTest::newRow("16") << dataDir.filePath(loadFrameName(16));
+    QTest::newRow("32") << dataDir.filePath(loadFrameName(32));
+    QTest::newRow("-32") << dataDir.filePath(loadFrameName(-32));
+    QTest::newRow("-64") << dataDir.filePath(loadFrameName(-64));
+    QTest::newRow("16 rice") << dataDir.filePath(COMPRESSED_FRAME);
+}
+
+void AbcBenchmark::loadFits()
+{
+    QFETCH(QString, filePath);
+
+    QBENCHMARK {
+        Image image;
+        QVERIFY(image.load(filePath));
+    }
+}
+
+void AbcBenchmark::add()
+{
+    const Image &a = frames[0];
+    const Image &b = frames[1];
+
+    QBENCHMARK {
+        Image sum = a + b;
+    }
+}
+
+void AbcBenchmark::subtract()
+{
+    const Image &a = frames[0];
+    const Image &b = frames[1];
+
+    QBENCHMARK {
+        Image difference = a - b;
+    }
+}
+
+void AbcBenchmark::subtractInPlace()
+{
+    /* Detach before measuring */
+    Image a = frames[0] + frames[1];
+    const Image &b = frames[1];
+
+    QBENCHMARK {
+        a -= b;
+    }
+}
+
+void AbcBenchmark::divide()
+{
+    /* Dividing by a normalized flat leaves the values in the same range,
+     * so they can be divided again */
+    Image a = frames[0] + frames[1];
+
+    QBENCHMARK {
+        a.divide(flat);
+    }
+}
+
+void AbcBenchmark::toQImage()
+{
+    const Image &a = frames[0];
+
+    QBENCHMARK {
+        QImage image = a.toQImage();
+    }
+}
+
+void AbcBenchmark::average_data()
+{
+    QTest::addColumn<int>("numFrames");
+
+    QTest::newRow("8") << 8;
+    QTest::newRow("32") << 32;
+    QTest::newRow("128") << 128;
+}
+
+void AbcBenchmark::average()
+{
+    QFETCH(int, numFrames);
+
+    ImageSet images;
+    for (int i = 0; i < numFrames; i++) {
+        QVERIFY(images.addImage(frames[i % frames.count()]));
+    }
+
+    QBENCHMARK {
+        Image result = images.average();
+    }
+}
+
+void AbcBenchmark::sigmaClip_data()
+{
+    average_data();
+}
+
+void AbcBenchmark::sigmaClip()
+{
+    QFETCH(int, numFrames);
+
+    ImageSet images;
+    for (int i = 0; i < numFrames; i++) {
+        QVERIFY(images.addImage(frames[i % frames.count()]));
+    }
+
+    QBENCHMARK {
+        Image result = images.sigmaClip(SIGMA_FACTOR);
+    }
+}
+
+QTEST_MAIN(AbcBenchmark)
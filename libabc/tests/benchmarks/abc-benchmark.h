@@ -0,0 +1,62 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ABC_BENCHMARK_H
+#define ABC_BENCHMARK_H
+
+#include "image.h"
+
+#include <QDir>
+#include <QList>
+#include <QTest>
+
+namespace ABC {
+
+class AbcBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void loadFits_data();
+    void loadFits();
+
+    void add();
+    void subtract();
+    void subtractInPlace();
+    void divide();
+    void toQImage();
+
+    void average_data();
+    void average();
+    void sigmaClip_data();
+    void sigmaClip();
+
+private:
+    QDir dataDir;
+    QList<Image> frames;
+    Image flat;
+};
+
+}; // namespace
+
+#endif /* ABC_BENCHMARK_H */
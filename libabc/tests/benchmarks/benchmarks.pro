@@ -0,0 +1,36 @@
+include(../../../common-config.pri)
+
+TARGET = abc-benchmark
+
+QT += \
+    network \
+    testlib
+
+SRC = ../../src
+
+INCLUDEPATH += \
+    .. \
+    $${SRC} \
+    $${TOP_SRC_DIR}/cfitsio
+
+QMAKE_LIBDIR += \
+    $${SRC}/$${OBJECTS_DIR}
+QMAKE_RPATHDIR = $${QMAKE_LIBDIR}
+
+LIBS += \
+    -labc \
+    -L$${TOP_BUILD_DIR}/cfitsio -lcfitsio -lpthread
+
+SOURCES += \
+    ../frame-generator.cpp \
+    abc-benchmark.cpp
+
+HEADERS += \
+    ../frame-generator.h \
+    abc-benchmark.h
+
+# The results are written in QTestLib's XML format, to be compared across
+# releases
+benchmark.commands = ./abc-benchmark -xml -o abc-benchmark.xml
+benchmark.depends = abc-benchmark
+QMAKE_EXTRA_TARGETS += benchmark
@@ -0,0 +1,20 @@
+include(../../../common-config.pri)
+
+TARGET = abc-dataset-generator
+
+SRC = ../../src
+
+INCLUDEPATH += \
+    .. \
+    $${SRC} \
+    $${TOP_SRC_DIR}/cfitsio
+
+LIBS += \
+    -L$${TOP_BUILD_DIR}/cfitsio -lcfitsio -lpthread
+
+SOURCES += \
+    ../frame-generator.cpp \
+    main.cpp
+
+HEADERS += \
+    ../frame-generator.h
@@ -0,0 +1,310 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generates a synthetic observing session: the light frames, and the
+ * calibration frames laid out as CalibrationSet expects them:
+ *
+ *   OUTPUT/CalibrationFiles/<camera>/T####/{Offsets,Darks,DarkFlats,Flats}
+ *   OUTPUT/Lights/<object>/
+ *
+ * The same options always give the same files. */
+
+#include "frame-generator.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QStringList>
+#include <QTextStream>
+#include <math.h>
+
+using namespace ABC;
+
+namespace {
+
+struct Options
+{
+    Options():
+        camera("ABC Synthetic"),
+        object("M 42"),
+        size(1024, 768),
+        bitpix(16),
+        compression(0),
+        temperature(-10),
+        exposure(300),
+        flatExposure(2),
+        offsets(20),
+        darks(20),
+        darkFlats(20),
+        flats(20),
+        lights(50),
+        noise(10),
+        hotPixels(200),
+        stars(300),
+        dither(8),
+        seed(1)
+    {
+    }
+
+    QString outputDir;
+    QString camera;
+    QString object;
+    QSize size;
+    int bitpix;
+    int compression;
+    float temperature;
+    double exposure;
+    double flatExposure;
+    int offsets;
+    int darks;
+    int darkFlats;
+    int flats;
+    int lights;
+    double noise;
+    int hotPixels;
+    int stars;
+    int dither;
+    quint32 seed;
+};
+
+} // namespace
+
+static void printUsage()
+{
+    QTextStream err(stderr);
+    err << "Usage: abc-dataset-generator [options] OUTPUT_DIR\n"
+        "\n"
+        "  --camera NAME          camera model (\"ABC Synthetic\")\n"
+        "  --object NAME          object name (\"M 42\")\n"
+        "  --size WxH             frame size (1024x768)\n"
+        "  --bitpix N             16, 32, -32 or -64 (16)\n"
+        "  --compress ALGORITHM   none, rice, gzip or hcompress (none)\n"
+        "  --temperature C        sensor temperature (-10)\n"
+        "  --exposure S           exposure of lights and darks (300)\n"
+        "  --flat-exposure S      exposure of flats and dark flats (2)\n"
+        "  --offsets N            number of offset frames (20)\n"
+        "  --darks N              number of dark frames (20)\n"
+        "  --dark-flats N         number of dark flat frames (20)\n"
+        "  --flats N              number of flat frames (20)\n"
+        "  --lights N             number of light frames (50)\n"
+        "  --noise SIGMA          read noise, in ADU (10)\n"
+        "  --hot-pixels N         number of hot pixels (200)\n"
+        "  --stars N              number of stars (300)\n"
+        "  --dither PIXELS        maximum shift between lights (8)\n"
+        "  --seed N               seed of the whole session (1)\n";
+}
+
+static bool parseCompression(const QString &name, int *compression)
+{
+    if (name == "none") {
+        *compression = 0;
+    } else if (name == "rice") {
+        *compression = RICE_1;
+    } else if (name == "gzip") {
+        *compression = GZIP_1;
+    } else if (name == "hcompress") {
+        *compression = HCOMPRESS_1;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseArguments(const QStringList &args, Options &options)
+{
+    for (int i = 1; i < args.count(); i++) {
+        const QString &arg = args[i];
+        if (!arg.startsWith("--")) {
+            if (!options.outputDir.isEmpty()) return false;
+            options.outputDir = arg;
+            continue;
+        }
+
+        if (i + 1 >= args.count()) return false;
+        QString value = args[++i];
+        bool ok = true;
+        if (arg == "--camera") {
+            options.camera = value;
+        } else if (arg == "--object") {
+            options.object = value;
+        } else if (arg == "--size") {
+            QStringList parts = value.split('x');
+            if (parts.count() != 2) return false;
+            bool okHeight;
+            options.size = QSize(parts[0].toInt(&ok),
+                                 parts[1].toInt(&okHeight));
+            ok = ok && okHeight && !options.size.isEmpty();
+        } else if (arg == "--bitpix") {
+            options.bitpix = value.toInt(&ok);
+        } else if (arg == "--compress") {
+            ok = parseCompression(value, &options.compression);
+        } else if (arg == "--temperature") {
+            options.temperature = value.toFloat(&ok);
+        } else if (arg == "--exposure") {
+            options.exposure = value.toDouble(&ok);
+        } else if (arg == "--flat-exposure") {
+            options.flatExposure = value.toDouble(&ok);
+        } else if (arg == "--offsets") {
+            options.offsets = value.toInt(&ok);
+        } else if (arg == "--darks") {
+            options.darks = value.toInt(&ok);
+        } else if (arg == "--dark-flats") {
+            options.darkFlats = value.toInt(&ok);
+        } else if (arg == "--flats") {
+            options.flats = value.toInt(&ok);
+        } else if (arg == "--lights") {
+            options.lights = value.toInt(&ok);
+        } else if (arg == "--noise") {
+            options.noise = value.toDouble(&ok);
+        } else if (arg == "--hot-pixels") {
+            options.hotPixels = value.toInt(&ok);
+        } else if (arg == "--stars") {
+            options.stars = value.toInt(&ok);
+        } else if (arg == "--dither") {
+            options.dither = value.toInt(&ok);
+            ok = ok && options.dither >= 0;
+        } else if (arg == "--seed") {
+            options.seed = value.toUInt(&ok);
+        } else {
+            return false;
+        }
+        if (!ok) return false;
+    }
+
+    return !options.outputDir.isEmpty();
+}
+
+/* Same as in CalibrationSet */
+static QString stringToFileName(const QString &text)
+{
+    QString result;
+    int length = text.size();
+    result.reserve(length);
+    for (int i = 0; i < length; i++) {
+        QChar ch = text.at(i);
+        if (ch.isLetterOrNumber() || ch == ' ' || ch == '_' || ch == '-') {
+            result.append(ch);
+        }
+    }
+    return result;
+}
+
+/* The frames are shifted by up to "dither" pixels */
+static bool writeFrames(FrameGenerator &generator, const QDir &baseDir,
+                        const QString &subDir, const QString &prefix,
+                        int count, int dither, quint32 *frameSeed)
+{
+    if (count <= 0) return true;
+
+    QString path = baseDir.filePath(subDir);
+    if (!QDir().mkpath(path)) {
+        qWarning() << "Cannot create" << path;
+        return false;
+    }
+
+    QDir dir(path);
+    QDateTime date = generator.observationDate();
+    int ditherRange = 2 * dither + 1;
+    for (int i = 0; i < count; i++) {
+        generator.setSeed((*frameSeed)++);
+        /* Spread the shifts over the whole dithering range */
+        generator.setOffset(QPoint((i * 7) % ditherRange - dither,
+                                   (i * 13) % ditherRange - dither));
+        QString fileName = QString::fromLatin1("%1_%2.fit").
+            arg(prefix).arg(i + 1, 4, 10, QLatin1Char('0'));
+        if (!generator.write(dir.filePath(fileName))) return false;
+        /* Leave a few seconds between the exposures, for the download */
+        date = date.addMSecs(qint64((generator.exposure() + 5) * 1000));
+        generator.setObservationDate(date);
+    }
+
+    QTextStream(stdout) << count << " frames in " << path << '\n';
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    Options options;
+    if (!parseArguments(app.arguments(), options)) {
+        printUsage();
+        return 1;
+    }
+
+    FrameGenerator generator;
+    generator.setSize(options.size);
+    generator.setBitpix(options.bitpix);
+    generator.setCompression(options.compression);
+    generator.setTemperature(options.temperature);
+    generator.setCamera(options.camera);
+    generator.setNoise(options.noise);
+    generator.setHotPixels(options.hotPixels);
+    generator.setStars(options.stars);
+    generator.setSessionSeed(options.seed);
+    generator.setObservationDate(QDateTime(QDate(2013, 1, 15),
+                                           QTime(21, 0), Qt::UTC));
+
+    /* Every frame gets its own noise; the seeds of different sessions
+     * don't overlap unless they have more than 65536 frames */
+    quint32 frameSeed = options.seed * 65536;
+
+    /* T####, where #### is the temperature, in K, multiplied by 10 */
+    int temperature = qRound((options.temperature + 273.15) * 10);
+    QDir calibrationDir(options.outputDir);
+    QString calibrationPath =
+        QString::fromLatin1("CalibrationFiles/%1/T%2").
+        arg(stringToFileName(options.camera)).
+        arg(temperature, 4, 10, QLatin1Char('0'));
+    if (!calibrationDir.mkpath(calibrationPath) ||
+        !calibrationDir.cd(calibrationPath)) {
+        qWarning() << "Cannot create" << calibrationPath;
+        return 1;
+    }
+
+    generator.setType(Offset);
+    generator.setExposure(0);
+    if (!writeFrames(generator, calibrationDir, "Offsets", "offset",
+                     options.offsets, 0, &frameSeed)) return 1;
+
+    generator.setType(Dark);
+    generator.setExposure(options.exposure);
+    if (!writeFrames(generator, calibrationDir, "Darks", "dark",
+                     options.darks, 0, &frameSeed)) return 1;
+
+    generator.setExposure(options.flatExposure);
+    if (!writeFrames(generator, calibrationDir, "DarkFlats", "darkflat",
+                     options.darkFlats, 0, &frameSeed)) return 1;
+
+    generator.setType(Flat);
+    if (!writeFrames(generator, calibrationDir, "Flats", "flat",
+                     options.flats, 0, &frameSeed)) return 1;
+
+    generator.setType(Light);
+    generator.setExposure(options.exposure);
+    generator.setObject(options.object);
+    QDir lightsDir(options.outputDir);
+    QString lightsPath = "Lights/" + stringToFileName(options.object);
+    if (!writeFrames(generator, lightsDir, lightsPath, "light",
+                     options.lights, options.dither, &frameSeed)) return 1;
+
+    return 0;
+}
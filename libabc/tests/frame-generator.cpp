@@ -0,0 +1,320 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frame-generator.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QVector>
+#include <fitsio.h>
+#include <limits>
+#include <math.h>
+
+using namespace ABC;
+
+namespace {
+
+/* A small xorshift generator: unlike qrand(), it gives the same sequence
+ * on every platform */
+class Random
+{
+public:
+    Random(quint32 seed): state(seed != 0 ? seed : 0x9e3779b9) {}
+
+    quint32 next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    /* In the (0, 1] interval */
+    double uniform() { return (next() + 1.0) / 4294967296.0; }
+
+    /* Box-Muller transform */
+    double gaussian() {
+        return sqrt(-2.0 * log(uniform())) * cos(2 * M_PI * uniform());
+    }
+
+private:
+    quint32 state;
+};
+
+} // namespace
+
+/* Fraction of the illumination lost at the corners */
+#define VIGNETTING          0.3
+/* Range of the hot pixels' signal, in ADU per second */
+#define MIN_HOT_PIXEL_RATE  20.0
+#define MAX_HOT_PIXEL_RATE  500.0
+/* Range of the stars' peak value, in ADU */
+#define MIN_STAR_PEAK       50.0
+#define MAX_STAR_PEAK       40000.0
+/* Standard deviation of the stars' profile, in pixels */
+#define STAR_SIGMA          1.5
+/* Hcompress needs tiles of at least 4 rows; fpack uses 16 */
+#define HCOMPRESS_TILE_ROWS 16
+
+static const char *typeToString(ImageType type)
+{
+    /* The names used by MaxIm DL and most capture programs */
+    switch (type) {
+    case Light: return "Light Frame";
+    case Offset: return "Bias Frame";
+    case Dark: return "Dark Frame";
+    case Flat: return "Flat Field";
+    default: return 0;
+    }
+}
+
+/* cfitsio corrupts the compressed tiles if the pixels are not written in
+ * the type of the image */
+template <typename T>
+static void writePixelsAs(fitsfile *ff, int dataType,
+                          const QVector<double> &pixels, int *status)
+{
+    QVector<T> values(pixels.count());
+    for (int i = 0; i < pixels.count(); i++) {
+        values[i] = std::numeric_limits<T>::is_integer ?
+            T(floor(pixels[i] + 0.5)) : T(pixels[i]);
+    }
+    fits_write_img(ff, dataType, 1, values.count(), values.data(), status);
+}
+
+static int imageTypeFromBitpix(int bitpix, double *minValue, double *maxValue)
+{
+    switch (bitpix) {
+    case 16:
+        *minValue = 0;
+        *maxValue = 65535;
+        return USHORT_IMG;
+    case 32:
+        *minValue = -2147483648.0;
+        *maxValue = 2147483647.0;
+        return LONG_IMG;
+    case -32:
+        *minValue = -HUGE_VAL;
+        *maxValue = HUGE_VAL;
+        return FLOAT_IMG;
+    case -64:
+        *minValue = -HUGE_VAL;
+        *maxValue = HUGE_VAL;
+        return DOUBLE_IMG;
+    default:
+        return 0;
+    }
+}
+
+FrameGenerator::FrameGenerator():
+    m_size(1024, 768),
+    m_bitpix(16),
+    m_compression(0),
+    m_type(UnknownType),
+    m_exposure(-1),
+    m_temperature(INVALID_TEMPERATURE),
+    m_level(1000),
+    m_noise(10),
+    m_darkCurrent(0.5),
+    m_flatLevel(20000),
+    m_skyLevel(300),
+    m_hotPixels(0),
+    m_stars(0),
+    m_seed(1),
+    m_sessionSeed(1)
+{
+}
+
+void FrameGenerator::addSignals(QVector<double> &pixels) const
+{
+    int width = m_size.width();
+    int height = m_size.height();
+    double exposure = qMax(m_exposure, 0.0);
+
+    /* Uniform signals */
+    double uniform = 0;
+    if (m_type == Dark || m_type == Light) {
+        uniform += m_darkCurrent * exposure;
+    }
+    for (int i = 0; i < pixels.count(); i++) {
+        pixels[i] += uniform;
+    }
+
+    /* Vignetted signals */
+    double illumination = 0;
+    if (m_type == Flat) {
+        illumination = m_flatLevel;
+    } else if (m_type == Light) {
+        illumination = m_skyLevel;
+    }
+
+    QVector<double> stars;
+    if (m_type == Light && m_stars > 0) {
+        stars.fill(0, pixels.count());
+        Random random(m_sessionSeed * 2 + 1);
+        int radius = int(ceil(4 * STAR_SIGMA));
+        for (int n = 0; n < m_stars; n++) {
+            double u = random.uniform();
+            /* Faint stars are many more than bright ones */
+            double peak = MIN_STAR_PEAK +
+                (MAX_STAR_PEAK - MIN_STAR_PEAK) * u * u * u * u;
+            double cx = random.uniform() * width + m_offset.x();
+            double cy = random.uniform() * height + m_offset.y();
+            int x0 = qMax(int(cx) - radius, 0);
+            int x1 = qMin(int(cx) + radius, width - 1);
+            int y0 = qMax(int(cy) - radius, 0);
+            int y1 = qMin(int(cy) + radius, height - 1);
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    double dx = x - cx, dy = y - cy;
+                    stars[y * width + x] += peak *
+                        exp(-(dx * dx + dy * dy) /
+                            (2 * STAR_SIGMA * STAR_SIGMA));
+                }
+            }
+        }
+    }
+
+    if (illumination > 0 || !stars.isEmpty()) {
+        double centerX = (width - 1) / 2.0;
+        double centerY = (height - 1) / 2.0;
+        double maxRadius2 = centerX * centerX + centerY * centerY;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                double dx = x - centerX, dy = y - centerY;
+                double v = 1.0 - VIGNETTING * (dx * dx + dy * dy) /
+                    maxRadius2;
+                int i = y * width + x;
+                double signal = illumination;
+                if (!stars.isEmpty()) signal += stars[i];
+                pixels[i] += signal * v;
+            }
+        }
+    }
+
+    /* Hot pixels are a feature of the sensor: they don't move with the
+     * star field */
+    if ((m_type == Dark || m_type == Light) && m_hotPixels > 0) {
+        Random random(m_sessionSeed * 2);
+        for (int n = 0; n < m_hotPixels; n++) {
+            int i = random.next() % pixels.count();
+            double rate = MIN_HOT_PIXEL_RATE +
+                (MAX_HOT_PIXEL_RATE - MIN_HOT_PIXEL_RATE) * random.uniform();
+            pixels[i] += rate * exposure;
+        }
+    }
+}
+
+bool FrameGenerator::writeHeader(fitsfile *ff, int *status) const
+{
+    const char *typeString = typeToString(m_type);
+    if (typeString != 0) {
+        fits_write_key(ff, TSTRING, "IMAGETYP", (void *)typeString,
+                       "Type of image", status);
+    }
+    if (m_exposure >= 0) {
+        double exposure = m_exposure;
+        fits_write_key(ff, TDOUBLE, "EXPTIME", &exposure,
+                       "Exposure time in seconds", status);
+    }
+    if (m_temperature != INVALID_TEMPERATURE) {
+        float temperature = m_temperature;
+        fits_write_key(ff, TFLOAT, "CCD-TEMP", &temperature,
+                       "Sensor temperature in C", status);
+    }
+    if (!m_camera.isEmpty()) {
+        QByteArray camera = m_camera.toLatin1();
+        fits_write_key(ff, TSTRING, "INSTRUME", camera.data(),
+                       "Camera model", status);
+    }
+    if (!m_object.isEmpty()) {
+        QByteArray object = m_object.toLatin1();
+        fits_write_key(ff, TSTRING, "OBJECT", object.data(),
+                       "Object name", status);
+    }
+    if (m_date.isValid()) {
+        QByteArray date =
+            m_date.toUTC().toString("yyyy-MM-ddThh:mm:ss").toLatin1();
+        fits_write_key(ff, TSTRING, "DATE-OBS", date.data(),
+                       "UTC start of the exposure", status);
+    }
+    return *status == 0;
+}
+
+bool FrameGenerator::write(const QString &filePath) const
+{
+    double minValue, maxValue;
+    int imageType = imageTypeFromBitpix(m_bitpix, &minValue, &maxValue);
+    if (Q_UNLIKELY(imageType == 0)) {
+        qWarning() << "Unsupported BITPIX" << m_bitpix;
+        return false;
+    }
+
+    long numPixels = m_size.width() * m_size.height();
+    QVector<double> pixels(numPixels);
+    Random random(m_seed);
+    for (long i = 0; i < numPixels; i++) {
+        pixels[i] = m_level + m_noise * random.gaussian();
+    }
+    addSignals(pixels);
+    for (long i = 0; i < numPixels; i++) {
+        pixels[i] = qBound(minValue, pixels[i], maxValue);
+    }
+
+    /* The leading "!" tells cfitsio to overwrite the file */
+    QByteArray fileName = "!" + QFile::encodeName(filePath);
+    fitsfile *ff = 0;
+    int status = 0;
+    fits_create_file(&ff, fileName.constData(), &status);
+    if (Q_UNLIKELY(status != 0)) {
+        qWarning() << "Cannot create" << filePath << "error" << status;
+        return false;
+    }
+
+    long axes[2];
+    axes[0] = m_size.width();
+    axes[1] = m_size.height();
+    if (m_compression != 0) {
+        long tileSize[2];
+        tileSize[0] = m_size.width();
+        tileSize[1] = m_compression == HCOMPRESS_1 ? HCOMPRESS_TILE_ROWS : 1;
+        fits_set_compression_type(ff, m_compression, &status);
+        fits_set_tile_dim(ff, 2, tileSize, &status);
+    }
+    fits_create_img(ff, imageType, 2, axes, &status);
+    writeHeader(ff, &status);
+    if (m_compression == 0 || m_bitpix == -64) {
+        fits_write_img(ff, TDOUBLE, 1, numPixels, pixels.data(), &status);
+    } else if (m_bitpix == 16) {
+        writePixelsAs<quint16>(ff, TUSHORT, pixels, &status);
+    } else if (m_bitpix == 32) {
+        writePixelsAs<qint32>(ff, TINT, pixels, &status);
+    } else {
+        writePixelsAs<float>(ff, TFLOAT, pixels, &status);
+    }
+    int writeStatus = status;
+    fits_close_file(ff, &status);
+    if (Q_UNLIKELY(writeStatus != 0 || status != 0)) {
+        qWarning() << "Cannot write" << filePath << "error" <<
+            (writeStatus != 0 ? writeStatus : status);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,139 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of libabc.
+ *
+ * libabc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libabc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libabc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ABC_FRAME_GENERATOR_H
+#define ABC_FRAME_GENERATOR_H
+
+#include "image.h"
+
+#include <QDateTime>
+#include <QPoint>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <fitsio.h>
+
+namespace ABC {
+
+/* Writes synthetic FITS frames, so that tests and benchmarks don't depend
+ * on large sample files. The same seed always gives the same frame.
+ *
+ * A frame is the sum of a pedestal level, the dark current and hot pixels
+ * (for darks and lights), a vignetted illumination (flats), a vignetted sky
+ * background and star field (lights), and gaussian noise. */
+class FrameGenerator
+{
+public:
+    FrameGenerator();
+
+    void setSize(const QSize &size) { m_size = size; }
+    QSize size() const { return m_size; }
+
+    /* The FITS BITPIX: 16, 32, -32 or -64 */
+    void setBitpix(int bitpix) { m_bitpix = bitpix; }
+    int bitpix() const { return m_bitpix; }
+
+    /* Written in the IMAGETYP key; UnknownType gives a flat noise frame and
+     * leaves the key out */
+    void setType(ImageType type) { m_type = type; }
+    ImageType type() const { return m_type; }
+
+    /* Header keys; they are not written if left unset */
+    void setExposure(double seconds) { m_exposure = seconds; }
+    double exposure() const { return m_exposure; }
+    void setTemperature(float celsius) { m_temperature = celsius; }
+    float temperature() const { return m_temperature; }
+    void setCamera(const QString &camera) { m_camera = camera; }
+    QString camera() const { return m_camera; }
+    void setObject(const QString &object) { m_object = object; }
+    QString object() const { return m_object; }
+    void setObservationDate(const QDateTime &date) { m_date = date; }
+    QDateTime observationDate() const { return m_date; }
+
+    /* Pedestal level, and standard deviation of the gaussian noise */
+    void setLevel(double level) { m_level = level; }
+    double level() const { return m_level; }
+    void setNoise(double noise) { m_noise = noise; }
+    double noise() const { return m_noise; }
+
+    /* In ADU per second of exposure */
+    void setDarkCurrent(double darkCurrent) { m_darkCurrent = darkCurrent; }
+    double darkCurrent() const { return m_darkCurrent; }
+
+    /* Illumination at the center of flats, and sky background of lights */
+    void setFlatLevel(double level) { m_flatLevel = level; }
+    double flatLevel() const { return m_flatLevel; }
+    void setSkyLevel(double level) { m_skyLevel = level; }
+    double skyLevel() const { return m_skyLevel; }
+
+    void setHotPixels(int count) { m_hotPixels = count; }
+    int hotPixels() const { return m_hotPixels; }
+    void setStars(int count) { m_stars = count; }
+    int stars() const { return m_stars; }
+
+    /* Shift of the star field, to simulate dithering */
+    void setOffset(const QPoint &offset) { m_offset = offset; }
+    QPoint offset() const { return m_offset; }
+
+    /* The noise changes with the seed; the hot pixels and the star field
+     * depend on the session seed, so that all the frames of a session
+     * share them */
+    void setSeed(quint32 seed) { m_seed = seed; }
+    quint32 seed() const { return m_seed; }
+    void setSessionSeed(quint32 seed) { m_sessionSeed = seed; }
+    quint32 sessionSeed() const { return m_sessionSeed; }
+
+    /* The cfitsio tile compression (RICE_1, GZIP_1, HCOMPRESS_1), or 0 for
+     * an uncompressed image; the tiles are rows, as fpack makes them */
+    void setCompression(int compression) { m_compression = compression; }
+    int compression() const { return m_compression; }
+
+    /* Overwrites any existing file */
+    bool write(const QString &filePath) const;
+
+private:
+    void addSignals(QVector<double> &pixels) const;
+    bool writeHeader(fitsfile *ff, int *status) const;
+
+private:
+    QSize m_size;
+    int m_bitpix;
+    int m_compression;
+    ImageType m_type;
+    double m_exposure;
+    float m_temperature;
+    QString m_camera;
+    QString m_object;
+    QDateTime m_date;
+    double m_level;
+    double m_noise;
+    double m_darkCurrent;
+    double m_flatLevel;
+    double m_skyLevel;
+    int m_hotPixels;
+    int m_stars;
+    QPoint m_offset;
+    quint32 m_seed;
+    quint32 m_sessionSeed;
+};
+
+}; // namespace
+
+#endif /* ABC_FRAME_GENERATOR_H */
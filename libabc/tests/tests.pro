@@ -1,3 +1,5 @@
+include(../../common-config.pri)
+
 TARGET = abc-test
 
 QT += \
@@ -7,7 +9,8 @@ QT += \
 SRC = ../src
 
 INCLUDEPATH += \
-    $${SRC}
+    $${SRC} \
+    $${TOP_SRC_DIR}/cfitsio
 
 Debug: OBJECTS_DIR=debug
 Release: OBJECTS_DIR=release
@@ -17,13 +20,16 @@ QMAKE_LIBDIR += \
 QMAKE_RPATHDIR = $${QMAKE_LIBDIR}
 
 LIBS += \
-    -labc
+    -labc \
+    -L$${TOP_BUILD_DIR}/cfitsio -lcfitsio -lpthread
 
 SOURCES += \
-    abc-test.cpp
+    abc-test.cpp \
+    frame-generator.cpp
 
 HEADERS += \
-    abc-test.h
+    abc-test.h \
+    frame-generator.h
 
 check.commands = ./abc-test
 check.depends = abc-test
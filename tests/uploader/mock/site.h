@@ -10,6 +10,7 @@
 #ifndef ABC_SITE_H
 #define ABC_SITE_H
 
+#include <QByteArray>
 #include <QList>
 #include <QObject>
 #include <QString>
@@ -40,7 +41,8 @@ public:
         QObject(parent),
         m_lastError(UnknownError),
         m_isAuthenticated(false),
-        m_isAuthenticating(false)
+        m_isAuthenticating(false),
+        m_canCheckHashes(true)
     {
         m_authTimer.setSingleShot(true);
         m_authTimer.setInterval(10);
@@ -77,9 +79,24 @@ public:
         Q_UNUSED(extraParts);
         return 0;
     }
+    QNetworkReply *registerFile(const QList<QHttpPart> &parts) {
+        Q_UNUSED(parts);
+        return 0;
+    }
+    bool canRegisterFiles() const { return m_canCheckHashes; }
+
+    bool canCheckHashes() const { return m_canCheckHashes; }
+    void checkHashes(const QList<QByteArray> &hashes) {
+        m_checkedHashes = hashes;
+        QTimer::singleShot(0, this, SLOT(finishHashCheck()));
+    }
 
     /* Methods useful for mocking */
     void authenticateAfter(int msec) { m_authTimer.setInterval(msec); }
+    void setKnownHashes(const QList<QByteArray> &hashes) {
+        m_knownHashes = hashes;
+    }
+    void setCanCheckHashes(bool canCheck) { m_canCheckHashes = canCheck; }
 
 private Q_SLOTS:
     void finishAuthentication() {
@@ -88,6 +105,14 @@ private Q_SLOTS:
         Q_EMIT authenticationFinished();
     }
 
+    void finishHashCheck() {
+        QList<QByteArray> knownHashes;
+        foreach (const QByteArray &hash, m_checkedHashes) {
+            if (m_knownHashes.contains(hash)) knownHashes.append(hash);
+        }
+        Q_EMIT hashesChecked(m_checkedHashes, knownHashes);
+    }
+
 public Q_SLOTS:
     void authenticate() {
         if (m_isAuthenticating || m_isAuthenticated) return;
@@ -98,13 +123,18 @@ public Q_SLOTS:
 Q_SIGNALS:
     void authenticationFinished();
     void error(Site::ErrorCode);
+    void hashesChecked(const QList<QByteArray> &hashes,
+                       const QList<QByteArray> &knownHashes);
 
 private:
     QTimer m_authTimer;
+    QList<QByteArray> m_checkedHashes;
+    QList<QByteArray> m_knownHashes;
     ErrorCode m_lastError;
     QString m_lastErrorMessage;
     bool m_isAuthenticated;
     bool m_isAuthenticating;
+    bool m_canCheckHashes;
 };
 
 }; // namespace
@@ -10,13 +10,16 @@
 #ifndef ABC_UPLOAD_ITEM_H
 #define ABC_UPLOAD_ITEM_H
 
+#include "image.h"
 #include "site.h"
 
 #include <QByteArray>
+#include <QCryptographicHash>
 #include <QList>
 #include <QMetaType>
 #include <QObject>
 #include <QString>
+#include <QStringList>
 #include <QTimer>
 
 namespace ABC {
@@ -32,8 +35,20 @@ public:
         QObject(parent),
         m_filePath(filePath),
         m_fileName(fileName),
-        m_progress(0)
+        m_contentKnown(false),
+        m_compressionEnabled(false),
+        m_progress(0),
+        m_bytesSent(0),
+        m_bytesTotal(0),
+        m_imageTypeKnown(false)
     {
+        /* Like the real item does, when the file has no FITS header */
+        if (fileName.contains("light")) m_fileImageType = Light;
+        else if (fileName.contains("dark")) m_fileImageType = Dark;
+        else if (fileName.contains("flat")) m_fileImageType = Flat;
+        else m_fileImageType = UnknownType;
+        m_imageType = m_fileImageType;
+
         m_replyTimer.setSingleShot(true);
         m_replyTimer.setInterval(10);
         connect(&m_replyTimer, SIGNAL(timeout()),
@@ -46,8 +61,34 @@ public:
 
     QString filePath() const { return m_filePath; }
     QString fileName() const { return m_fileName; }
-    QByteArray fileHash() const { return QByteArray(); }
+    QByteArray fileHash() const { return m_fileHash; }
     int progress() const { return m_progress; }
+    qint64 bytesSent() const { return m_bytesSent; }
+    qint64 bytesTotal() const { return m_bytesTotal; }
+    ImageType imageType() const {
+        m_imageTypeKnown = true;
+        return m_imageType;
+    }
+    void setImageType(ImageType type) {
+        m_imageType = type;
+        m_imageTypeKnown = true;
+    }
+    bool isImageTypeKnown() const { return m_imageTypeKnown; }
+    ImageType probeImageType() const { return m_fileImageType; }
+
+    void computeHash() {
+        m_fileHash = QCryptographicHash::hash(m_filePath.toUtf8(),
+                                              QCryptographicHash::Md5).toHex();
+    }
+
+    void setContentKnown(bool known) { m_contentKnown = known; }
+    bool isContentKnown() const { return m_contentKnown; }
+
+    void setCompressionEnabled(bool enabled) {
+        m_compressionEnabled = enabled;
+    }
+    bool compressionEnabled() const { return m_compressionEnabled; }
+    void prepare() {}
 
     Site::ErrorCode lastError() const { return m_errorCode; }
     QString lastErrorMessage() const { return m_errorMessage; }
@@ -68,7 +109,15 @@ public:
         m_errorMessage.clear();
     }
 
+    void sendBytes(qint64 bytesSent, qint64 bytesTotal) {
+        m_bytesSent = bytesSent;
+        m_bytesTotal = bytesTotal;
+        Q_EMIT bytesSentChanged(bytesSent, bytesTotal);
+    }
+
     static QList<UploadItem *> allItems;
+    /* File names, in the order their upload was started */
+    static QStringList startedUploads;
 
 private Q_SLOTS:
     void sendReply() {
@@ -79,6 +128,9 @@ private Q_SLOTS:
 public Q_SLOTS:
     void startUpload(Site *site) {
         Q_UNUSED(site);
+        startedUploads.append(m_fileName);
+        m_bytesSent = 0;
+        m_bytesTotal = 0;
         m_progress = 1;
         Q_EMIT progressChanged(m_progress);
         m_replyTimer.start();
@@ -86,14 +138,23 @@ public Q_SLOTS:
 
 Q_SIGNALS:
     void progressChanged(int progress);
+    void bytesSentChanged(qint64 bytesSent, qint64 bytesTotal);
 
 private:
     QString m_filePath;
     QString m_fileName;
+    QByteArray m_fileHash;
+    bool m_contentKnown;
+    bool m_compressionEnabled;
     Site::ErrorCode m_errorCode;
     QString m_errorMessage;
     bool m_errorIsRecoverable;
     int m_progress;
+    qint64 m_bytesSent;
+    qint64 m_bytesTotal;
+    ImageType m_imageType;
+    ImageType m_fileImageType;
+    mutable bool m_imageTypeKnown;
     QTimer m_replyTimer;
 };
 
@@ -17,17 +17,68 @@
 #include "mock/upload-item.h"
 #include "upload-queue.h"
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QSignalSpy>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <algorithm>
+#include <utime.h>
 
 #define UTF8(s) QString::fromUtf8(s)
 
+/* Like QTRY_COMPARE() (which Qt 4 doesn't have): waits for the expression
+ * to have the expected value, but for at most "timeout" milliseconds */
+#define TRY_COMPARE(expr, expected, timeout) \
+    do { \
+        QElapsedTimer tryTimer; \
+        tryTimer.start(); \
+        while ((expr) != (expected) && tryTimer.elapsed() < (timeout)) { \
+            QTest::qWait(5); \
+        } \
+        QCOMPARE(expr, expected); \
+    } while (0)
+
 using namespace ABC;
 
+/* The benchmarks run on a small data set, unless ABC_FULL_BENCHMARKS is set
+ * in the environment */
+static int benchmarkSize(int size, int fullSize)
+{
+    return qgetenv("ABC_FULL_BENCHMARKS").isEmpty() ? size : fullSize;
+}
+
 /* Handles to mocked objects */
 Site *Site::instance = 0;
 QList<UploadItem *> UploadItem::allItems;
+QStringList UploadItem::startedUploads;
+
+static int succeededItems(const UploadQueue &queue)
+{
+    int succeeded = 0;
+    queue.itemsStatus(&succeeded);
+    return succeeded;
+}
+
+static int inProgressItems(const UploadQueue &queue)
+{
+    int inProgress = 0;
+    queue.itemsStatus(0, &inProgress);
+    return inProgress;
+}
+
+/* The files reported so far by the FileMonitor::filesChanged() signal */
+static QStringList changedFiles(const QSignalSpy &spy)
+{
+    QStringList files;
+    foreach (const QList<QVariant> &args, spy) {
+        files += args.at(0).toStringList();
+    }
+    files.sort();
+    return files;
+}
 
 void UploaderTest::initTestCase()
 {
@@ -53,6 +104,60 @@ QString UploaderTest::createTmpDir()
     return tmpDir.canonicalPath();
 }
 
+/* Qt 4 has no QDir::removeRecursively() */
+bool UploaderTest::removeTree(const QString &path)
+{
+    QDir dir(path);
+    QFileInfoList entries =
+        dir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System |
+                          QDir::NoDotAndDotDot);
+    foreach (const QFileInfo &entry, entries) {
+        bool ok = (entry.isDir() && !entry.isSymLink()) ?
+            removeTree(entry.filePath()) : dir.remove(entry.fileName());
+        if (!ok) return false;
+    }
+    return dir.rmdir(path);
+}
+
+/* Fill "basePath" with "numDirs" directories, each holding "filesPerDir"
+ * FITS files and a text file. Doesn't stop the test on failure, so that
+ * the caller can still remove the tree. */
+bool UploaderTest::createTree(const QString &basePath,
+                              int numDirs, int filesPerDir)
+{
+    QDir tmpDir(basePath);
+    for (int i = 0; i < numDirs; i++) {
+        QString dirName = QString("night%1/set%2").arg(i / 100).arg(i % 100);
+        if (!tmpDir.mkpath(dirName)) return false;
+        QDir dir(tmpDir.filePath(dirName));
+        for (int j = 0; j < filesPerDir; j++) {
+            QFile file(dir.filePath(QString("frame%1.fit").arg(j)));
+            if (!file.open(QIODevice::WriteOnly)) return false;
+            file.write("x");
+        }
+        QFile notes(dir.filePath("notes.txt"));
+        if (!notes.open(QIODevice::WriteOnly)) return false;
+        notes.write("x");
+    }
+    return true;
+}
+
+/* Create a file which looks like it was written long ago, so that the
+ * UploadQueue doesn't need to wait for it to be complete */
+void UploaderTest::createOldFile(const QString &filePath, int size)
+{
+    QFile file(filePath);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(QByteArray(size, 'x'));
+    file.close();
+
+    struct utimbuf times;
+    times.actime = times.modtime =
+        QDateTime::currentDateTime().addSecs(-3600).toTime_t();
+    QCOMPARE(utime(QFile::encodeName(filePath).constData(), &times), 0);
+}
+
+/* Returns the resident set size, in bytes */
 void UploaderTest::fileMonitor()
 {
     FileMonitor monitor;
@@ -122,6 +227,168 @@ void UploaderTest::fileMonitor()
     QCOMPARE(newFiles, expectedNewFiles);
 }
 
+void UploaderTest::fileMonitorIncremental()
+{
+    FileMonitor monitor;
+    QSignalSpy filesChanged(&monitor,
+                            SIGNAL(filesChanged(const QStringList &, bool)));
+
+    QString basePath = createTmpDir();
+    QDir tmpDir(basePath);
+    monitor.setBasePath(basePath);
+    if (!monitor.isIncremental()) {
+        QSKIP("No incremental file monitoring on this system", SkipAll);
+    }
+
+    QSet<QString> extensions;
+    extensions << "fit";
+    monitor.setAcceptedExtensions(extensions);
+
+    QString dummyFile = tmpDir.filePath("dummy.fit");
+    QFile dummy(dummyFile);
+    QVERIFY(dummy.open(QIODevice::WriteOnly));
+    dummy.write("Some content");
+    dummy.close();
+
+    /* Files which are not accepted must not be reported */
+    QFile::copy(dummyFile, tmpDir.filePath("image.jpg"));
+    /* A file created inside a new directory, before the monitor had the
+     * chance to watch it */
+    QDir subDir = tmpDir;
+    subDir.mkdir("subdir");
+    subDir.cd("subdir");
+    QFile::copy(dummyFile, subDir.filePath("image2.fit"));
+
+    QStringList expectedFiles;
+    expectedFiles << dummyFile;
+    expectedFiles << subDir.filePath("image2.fit");
+    expectedFiles.sort();
+    TRY_COMPARE(changedFiles(filesChanged), expectedFiles, 5000);
+
+    QStringList completedFiles;
+    foreach (const QList<QVariant> &args, filesChanged) {
+        if (args.at(1).toBool()) completedFiles += args.at(0).toStringList();
+    }
+    /* We saw the first file being closed after writing */
+    QVERIFY(completedFiles.contains(dummyFile));
+
+    /* Files moved into the tree are reported too */
+    filesChanged.clear();
+    QString outsideFile = createTmpDir() + "/outside.fit";
+    QFile::copy(dummyFile, outsideFile);
+    QVERIFY(QFile::rename(outsideFile, subDir.filePath("moved.fit")));
+
+    TRY_COMPARE(filesChanged.count(), 1, 5000);
+    QCOMPARE(filesChanged.at(0).at(0).toStringList(),
+             QStringList() << subDir.filePath("moved.fit"));
+    QCOMPARE(filesChanged.at(0).at(1).toBool(), true);
+}
+
+void UploaderTest::fileMonitorSnapshot()
+{
+    QString snapshotPath = QDir(createTmpDir()).filePath("snapshot");
+    QString basePath = createTmpDir();
+    QDir tmpDir(basePath);
+    tmpDir.mkdir("subdir");
+
+    createOldFile(tmpDir.filePath("a.fit"), 100);
+    createOldFile(tmpDir.filePath("subdir/b.fit"), 100);
+    createOldFile(tmpDir.filePath("empty.fit"), 0);
+
+    QStringList expectedFiles;
+    expectedFiles << tmpDir.filePath("a.fit");
+    expectedFiles << tmpDir.filePath("subdir/b.fit");
+
+    {
+        FileMonitor monitor;
+        monitor.setSnapshotPath(snapshotPath);
+        monitor.setBasePath(basePath);
+
+        /* Without a snapshot, the modification time is all we have */
+        QDateTime now = QDateTime::currentDateTime();
+        QCOMPARE(monitor.filesChangedSinceSnapshot(now), QStringList());
+        /* Nothing is saved until the client has recorded the files */
+        QVERIFY(!QFile::exists(snapshotPath));
+        monitor.commitSnapshot();
+        QVERIFY(QFile::exists(snapshotPath));
+    }
+
+    {
+        FileMonitor monitor;
+        monitor.setSnapshotPath(snapshotPath);
+        monitor.setBasePath(createTmpDir());
+
+        /* The snapshot of another tree must not be used */
+        QCOMPARE(monitor.filesChangedSinceSnapshot(QDateTime()),
+                 QStringList());
+    }
+    QFile::remove(snapshotPath);
+
+    {
+        FileMonitor monitor;
+        monitor.setSnapshotPath(snapshotPath);
+        monitor.setBasePath(basePath);
+
+        QStringList files = monitor.filesChangedSinceSnapshot(QDateTime());
+        files.sort();
+        QCOMPARE(files, expectedFiles);
+        monitor.commitSnapshot();
+    }
+
+    /* Files which are new or changed are found, even if they look old */
+    createOldFile(tmpDir.filePath("a.fit"), 200);
+    createOldFile(tmpDir.filePath("subdir/c.fit"), 100);
+
+    expectedFiles.clear();
+    expectedFiles << tmpDir.filePath("a.fit");
+    expectedFiles << tmpDir.filePath("subdir/c.fit");
+
+    FileMonitor monitor;
+    monitor.setSnapshotPath(snapshotPath);
+    monitor.setBasePath(basePath);
+    QStringList files =
+        monitor.filesChangedSinceSnapshot(QDateTime::currentDateTime());
+    files.sort();
+    QCOMPARE(files, expectedFiles);
+
+    /* Until committed, the changes are reported again */
+    files = monitor.filesChangedSinceSnapshot(QDateTime::currentDateTime());
+    files.sort();
+    QCOMPARE(files, expectedFiles);
+    monitor.commitSnapshot();
+
+    /* Nothing changed since the last scan */
+    QCOMPARE(monitor.filesChangedSinceSnapshot(QDateTime()), QStringList());
+}
+
+void UploaderTest::fileMonitorBenchmark()
+{
+    const int numDirs = benchmarkSize(50, 5000);
+    const int filesPerDir = 20;
+
+    /* A synthetic tree with up to 100000 accepted files, plus some others */
+    QString basePath = createTmpDir();
+    bool created = createTree(basePath, numDirs, filesPerDir);
+
+    QStringList files;
+    if (created) {
+        FileMonitor monitor;
+        QSet<QString> extensions;
+        extensions << "fit";
+        monitor.setAcceptedExtensions(extensions);
+        monitor.setBasePath(basePath);
+
+        QBENCHMARK {
+            files = monitor.filesChangedSince(QDateTime());
+        }
+    }
+
+    /* Clean up before checking anything */
+    QVERIFY(removeTree(basePath));
+    QVERIFY(created);
+    QCOMPARE(files.count(), numDirs * filesPerDir);
+}
+
 void UploaderTest::fileLog()
 {
     // Remove existing DB
@@ -183,6 +450,214 @@ void UploaderTest::fileLog()
 
     log.addFile("dummy");
     QCOMPARE(log.isLogged("dummy"), true);
+
+    /* A file with the same contents doesn't replace the other one */
+    QVERIFY(QFile::copy(subDir.filePath("image2.jpg"),
+                        tmpDir.filePath("image3.jpg")));
+    log.addFile("image3.jpg");
+    log.flush();
+    QCOMPARE(log.isLogged("image3.jpg"), true);
+    QCOMPARE(log.isLogged("subdir/image2.jpg"), true);
+}
+
+void UploaderTest::fileLogQueue()
+{
+    QFile::remove(Application::instance()->configuration()->logDbPath());
+    QString basePath = createTmpDir();
+    QDir tmpDir(basePath);
+
+    {
+        FileLog log;
+        log.setBasePath(basePath);
+        QCOMPARE(log.queuedFiles(), QStringList());
+
+        log.updateQueuedFile(tmpDir.filePath("a.fit"), 0, 0, Light);
+        log.updateQueuedFile("b.fit", 50);
+        log.updateQueuedFile("c.fit", 0);
+        log.updateQueuedFile("b.fit", -1, 2);
+
+        /* Uploaded files are removed from the queue */
+        log.addFile("c.fit");
+    }
+
+    /* The queue must survive the FileLog */
+    FileLog log;
+    log.setBasePath(basePath);
+
+    QStringList expectedFiles;
+    expectedFiles << tmpDir.filePath("a.fit");
+    expectedFiles << tmpDir.filePath("b.fit");
+    QStringList queuedFiles = log.queuedFiles();
+    queuedFiles.sort();
+    QCOMPARE(queuedFiles, expectedFiles);
+
+    /* Only the known types are kept */
+    QHash<QString, int> expectedTypes;
+    expectedTypes.insert(tmpDir.filePath("a.fit"), Light);
+    QCOMPARE(log.queuedImageTypes(), expectedTypes);
+
+    log.clearQueue();
+    QCOMPARE(log.queuedFiles(), QStringList());
+}
+
+void UploaderTest::fileLogFilter()
+{
+    QFile::remove(Application::instance()->configuration()->logDbPath());
+    FileLog log;
+    QString basePath = createTmpDir();
+    QDir tmpDir(basePath);
+    log.setBasePath(basePath);
+
+    /* Enough files to have them checked all at once */
+    QStringList allFiles;
+    for (int i = 0; i < 150; i++) {
+        QString filePath = tmpDir.filePath(QString("frame%1.fit").arg(i));
+        QFile file(filePath);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(filePath.toUtf8());
+        file.close();
+        allFiles.append(filePath);
+        if (i < 100) log.addFile(filePath);
+    }
+    log.flush();
+
+    /* Same content, different time: still logged */
+    struct utimbuf times;
+    times.actime = times.modtime =
+        QDateTime::currentDateTime().addSecs(-3600).toTime_t();
+    QCOMPARE(utime(QFile::encodeName(allFiles[10]).constData(), &times), 0);
+
+    /* Different content: not logged anymore */
+    createOldFile(allFiles[20], 10);
+
+    /* Logged, but not written to the DB yet */
+    log.addFile(allFiles[120]);
+
+    QStringList expectedFiles;
+    expectedFiles << allFiles[20];
+    for (int i = 100; i < 150; i++) {
+        if (i != 120) expectedFiles << allFiles[i];
+    }
+    QCOMPARE(log.filterOutLogged(allFiles), expectedFiles);
+}
+
+void UploaderTest::fileLogMigration()
+{
+    QString dbPath = Application::instance()->configuration()->logDbPath();
+    QFile::remove(dbPath);
+    QDir().mkpath(QFileInfo(dbPath).absolutePath());
+    QString basePath = createTmpDir();
+    QDir tmpDir(basePath);
+    createOldFile(tmpDir.filePath("a.fit"), 100);
+    createOldFile(tmpDir.filePath("b.fit"), 100);
+    createOldFile(tmpDir.filePath("c.fit"), 50);
+    QDateTime lastModified = QFileInfo(tmpDir.filePath("a.fit")).lastModified();
+    QString modified = lastModified.toString(Qt::ISODate);
+    QString hash =
+        QCryptographicHash::hash(QByteArray(100, 'x'),
+                                 QCryptographicHash::Md5).toHex();
+    QString hashC =
+        QCryptographicHash::hash(QByteArray(50, 'x'),
+                                 QCryptographicHash::Md5).toHex();
+
+    /* Write a log as the versions without file stamps did */
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "old-log");
+        db.setDatabaseName(dbPath);
+        QVERIFY(db.open());
+        db.exec("CREATE TABLE Uploads ("
+                "filePath TEXT UNIQUE NOT NULL,"
+                "hash TEXT PRIMARY KEY NOT NULL ON CONFLICT REPLACE,"
+                "modified TEXT)");
+        db.exec("CREATE TABLE Queue ("
+                "filePath TEXT PRIMARY KEY NOT NULL,"
+                "progress INTEGER, lastError INTEGER)");
+        QSqlQuery q(db);
+        q.prepare("INSERT INTO Uploads (filePath, hash, modified) "
+                  "VALUES (?, ?, ?)");
+        q.addBindValue(QStringList() << "a.fit" << "b.fit" << "c.fit");
+        q.addBindValue(QStringList() << hash << hash.toUpper() << hashC);
+        QFileInfo cInfo(tmpDir.filePath("c.fit"));
+        q.addBindValue(QStringList() << modified << "2000-01-01T00:00:00" <<
+                       cInfo.lastModified().toString(Qt::ISODate));
+        QVERIFY(q.execBatch());
+        db.exec("PRAGMA user_version = 2");
+        db.close();
+    }
+    QSqlDatabase::removeDatabase("old-log");
+
+    {
+        FileLog log;
+        log.setBasePath(basePath);
+        /* Same time */
+        QCOMPARE(log.isLogged("a.fit"), true);
+        /* Different time, but the hash doesn't match */
+        QCOMPARE(log.isLogged("b.fit"), false);
+        /* Same time: the hash is not checked */
+        QCOMPARE(log.isLogged("c.fit"), true);
+
+        log.addFile("b.fit", hash.toLatin1());
+
+        /* Same size and time, different content: a new inode causes the
+         * hash to be checked */
+        QString newPath = tmpDir.filePath("new.fit");
+        QFile file(newPath);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(QByteArray(50, 'y'));
+        file.close();
+        struct utimbuf times;
+        times.actime = times.modtime = lastModified.toTime_t();
+        QCOMPARE(utime(QFile::encodeName(newPath).constData(), &times), 0);
+        QString cPath = tmpDir.filePath("c.fit");
+        QFile::remove(cPath);
+        QFile::rename(newPath, cPath);
+        QCOMPARE(log.isLogged("c.fit"), false);
+    }
+
+    /* The stamps of the checked files have been stored */
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "old-log");
+        db.setDatabaseName(dbPath);
+        QVERIFY(db.open());
+        QSqlQuery q(db);
+        QVERIFY(q.exec("SELECT filePath FROM Uploads "
+                       "WHERE mtime_ns > 0 AND inode > 0 "
+                       "ORDER BY filePath"));
+        QStringList files;
+        while (q.next()) files.append(q.value(0).toString());
+        QCOMPARE(files, QStringList() << "a.fit" << "b.fit" << "c.fit");
+        q = QSqlQuery();
+        db.close();
+    }
+    QSqlDatabase::removeDatabase("old-log");
+}
+
+void UploaderTest::fileLogBenchmark()
+{
+    QFile::remove(Application::instance()->configuration()->logDbPath());
+    FileLog log;
+    log.setBasePath(createTmpDir());
+
+    const int numFiles = 10000;
+    QStringList fileNames;
+    QList<QByteArray> hashes;
+    for (int i = 0; i < numFiles; i++) {
+        QString fileName = QString("frame%1.fit").arg(i);
+        fileNames.append(fileName);
+        QByteArray hash = QCryptographicHash::hash(fileName.toUtf8(),
+                                                   QCryptographicHash::Md5);
+        hashes.append(hash.toHex());
+    }
+
+    QBENCHMARK {
+        for (int i = 0; i < numFiles; i++) {
+            log.addFile(fileNames[i], hashes[i]);
+        }
+        log.flush();
+    }
+
+    QCOMPARE(log.isLogged(fileNames.first()), true);
+    QCOMPARE(log.isLogged(fileNames.last()), true);
 }
 
 void UploaderTest::uploadQueue()
@@ -294,6 +769,321 @@ void UploaderTest::uploadQueueRetry()
     QCOMPARE(retryLater, 0);
 }
 
+void UploaderTest::uploadQueueKnownHashes()
+{
+    UploadQueue queue;
+
+    QVERIFY(Site::instance != 0);
+    Site::instance->authenticateAfter(0);
+
+    queue.requestUpload("file1", "file1");
+    UploadItem *file1 = UploadItem::allItems.last();
+    queue.requestUpload("file2", "file2");
+    UploadItem *file2 = UploadItem::allItems.last();
+
+    /* Pretend that the server already has the second file */
+    file2->computeHash();
+    Site::instance->setKnownHashes(QList<QByteArray>() << file2->fileHash());
+
+    TRY_COMPARE(succeededItems(queue), 2, 5000);
+
+    /* Only the first file needed to be sent in full */
+    QCOMPARE(file1->isContentKnown(), false);
+    QCOMPARE(file2->isContentKnown(), true);
+
+    /* A server which cannot check the hashes gets all the files */
+    UploadQueue otherQueue;
+    Site::instance->authenticateAfter(0);
+    Site::instance->setCanCheckHashes(false);
+    otherQueue.requestUpload("file3", "file3");
+    UploadItem *file3 = UploadItem::allItems.last();
+    file3->computeHash();
+    Site::instance->setKnownHashes(QList<QByteArray>() << file3->fileHash());
+
+    TRY_COMPARE(succeededItems(otherQueue), 1, 5000);
+    QCOMPARE(file3->isContentKnown(), false);
+}
+
+void UploaderTest::uploadQueueSmallFiles()
+{
+    UploadQueue queue;
+
+    QVERIFY(Site::instance != 0);
+    Site::instance->authenticateAfter(0);
+
+    QDir tmpDir(createTmpDir());
+    createOldFile(tmpDir.filePath("large.fit"), 2 * 1024 * 1024);
+    queue.requestUpload(tmpDir.filePath("large.fit"), "large.fit");
+    /* The uploads will be completed by the test */
+    UploadItem::allItems.last()->succeedAfter(60 * 1000);
+    for (int i = 0; i < 6; i++) {
+        QString fileName = QString("small%1.fit").arg(i);
+        createOldFile(tmpDir.filePath(fileName), 1000);
+        queue.requestUpload(tmpDir.filePath(fileName), fileName);
+        UploadItem::allItems.last()->succeedAfter(60 * 1000);
+    }
+
+    /* The small files don't need to wait for each other: all of them are
+     * uploaded together with the large one */
+    TRY_COMPARE(inProgressItems(queue), 7, 5000);
+    QCOMPARE(succeededItems(queue), 0);
+
+    foreach (UploadItem *item, UploadItem::allItems) {
+        QMetaObject::invokeMethod(item, "sendReply");
+    }
+    QCOMPARE(succeededItems(queue), 7);
+    QCOMPARE(inProgressItems(queue), 0);
+}
+
+void UploaderTest::uploadQueueSettle()
+{
+    /* Three files which have just been written */
+    QDir tmpDir(createTmpDir());
+    QStringList fileNames;
+    fileNames << "growing.fit" << "complete.fit" << "closed.fit";
+    foreach (const QString &fileName, fileNames) {
+        QFile file(tmpDir.filePath(fileName));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write("Some content");
+    }
+
+    {
+        UploadQueue queue;
+        QVERIFY(Site::instance != 0);
+        Site::instance->authenticateAfter(0);
+        /* Don't let the files settle by themselves */
+        queue.setSettleInterval(60 * 1000);
+
+        queue.requestUpload(tmpDir.filePath("complete.fit"), "complete.fit",
+                            true);
+        queue.requestUpload(tmpDir.filePath("closed.fit"), "closed.fit");
+
+        /* Only the file known to be complete is uploaded right away */
+        TRY_COMPARE(succeededItems(queue), 1, 5000);
+        QCOMPARE(inProgressItems(queue), 0);
+
+        /* Learning that a file is complete makes it ready for upload */
+        queue.requestUpload(tmpDir.filePath("closed.fit"), "closed.fit",
+                            true);
+        TRY_COMPARE(succeededItems(queue), 2, 5000);
+    }
+
+    {
+        UploadQueue queue;
+        QVERIFY(Site::instance != 0);
+        Site::instance->authenticateAfter(0);
+        queue.setSettleInterval(500);
+
+        queue.requestUpload(tmpDir.filePath("growing.fit"), "growing.fit");
+
+        /* Keep writing into the file, more often than it's checked: it is
+         * not uploaded as long as it grows */
+        QFile growing(tmpDir.filePath("growing.fit"));
+        QVERIFY(growing.open(QIODevice::Append));
+        for (int i = 0; i < 10; i++) {
+            growing.write("More content");
+            growing.flush();
+            QTest::qWait(100);
+        }
+        growing.close();
+        QCOMPARE(succeededItems(queue), 0);
+        QCOMPARE(inProgressItems(queue), 0);
+
+        /* Now it has stopped changing: the checks after the first two
+         * will see that */
+        TRY_COMPARE(succeededItems(queue), 1, 20000);
+    }
+}
+
+void UploaderTest::uploadQueuePriority()
+{
+    QDir tmpDir(createTmpDir());
+    QStringList fileNames;
+    fileNames << "dark1.fit" << "light1.fit" << "dark2.fit" <<
+        "light2.fit" << "other.fit";
+    /* The last file is the most recent one */
+    QDateTime now = QDateTime::currentDateTime();
+    for (int i = 0; i < fileNames.count(); i++) {
+        QString filePath = tmpDir.filePath(fileNames[i]);
+        createOldFile(filePath, 100 * (fileNames.count() - i));
+        struct utimbuf times;
+        times.actime = times.modtime = now.addSecs(-600 + i * 60).toTime_t();
+        QCOMPARE(utime(QFile::encodeName(filePath).constData(), &times), 0);
+    }
+
+    {
+        UploadQueue queue;
+        QCOMPARE(queue.priorityRules(), QList<UploadQueue::PriorityRule>() <<
+                 UploadQueue::LightsFirst << UploadQueue::NewestFirst);
+
+        /* Hold the queue, so that all the files are queued before the
+         * first upload starts */
+        QVERIFY(Site::instance != 0);
+        Site::instance->authenticateAfter(50);
+        UploadItem::startedUploads.clear();
+        foreach (const QString &fileName, fileNames) {
+            queue.requestUpload(tmpDir.filePath(fileName), fileName);
+        }
+
+        TRY_COMPARE(UploadItem::startedUploads.count(), fileNames.count(),
+                    5000);
+        QStringList expectedOrder;
+        expectedOrder << "light2.fit" << "light1.fit" << "other.fit" <<
+            "dark2.fit" << "dark1.fit";
+        QCOMPARE(UploadItem::startedUploads, expectedOrder);
+    }
+
+    {
+        UploadQueue queue;
+        QVERIFY(Site::instance != 0);
+        Site::instance->authenticateAfter(50);
+        UploadItem::startedUploads.clear();
+        foreach (const QString &fileName, fileNames) {
+            queue.requestUpload(tmpDir.filePath(fileName), fileName);
+        }
+
+        /* Changing the rules reorders the items already queued */
+        queue.setPriorityRules(QList<UploadQueue::PriorityRule>() <<
+                               UploadQueue::SmallestFirst);
+        TRY_COMPARE(UploadItem::startedUploads.count(), fileNames.count(),
+                    5000);
+        QStringList expectedOrder = fileNames;
+        std::reverse(expectedOrder.begin(), expectedOrder.end());
+        QCOMPARE(UploadItem::startedUploads, expectedOrder);
+    }
+}
+
+void UploaderTest::uploadQueueStatistics()
+{
+    UploadQueue queue;
+
+    QVERIFY(Site::instance != 0);
+    Site::instance->authenticateAfter(0);
+
+    const qint64 fileSize = 10 * 1024 * 1024;
+    QDir tmpDir(createTmpDir());
+    createOldFile(tmpDir.filePath("big.fit"), fileSize);
+    queue.requestUpload(tmpDir.filePath("big.fit"), "big.fit");
+    UploadItem *item = UploadItem::allItems.last();
+    /* The upload will be completed by the test */
+    item->succeedAfter(60 * 1000);
+
+    UploadQueue::Statistics statistics = queue.statistics();
+    QCOMPARE(statistics.bytesRemaining, fileSize);
+    QCOMPARE(statistics.eta, -1);
+
+    QTest::qWait(20);
+    QModelIndex index = queue.index(0, 0);
+    QCOMPARE(queue.data(index, UploadQueue::ProgressRole).toInt(), 1);
+
+    /* Send half of the file in one second, in many small steps: they must
+     * not be notified one by one */
+    QSignalSpy dataChanged(&queue,
+                           SIGNAL(dataChanged(const QModelIndex&,
+                                              const QModelIndex&)));
+    QSignalSpy statisticsChanged(&queue, SIGNAL(statisticsChanged()));
+    for (int i = 1; i <= 50; i++) {
+        item->sendBytes(i * fileSize / 100, fileSize);
+        QTest::qWait(20);
+    }
+    QTest::qWait(1100);
+    QVERIFY(dataChanged.count() >= 1);
+    QVERIFY(dataChanged.count() <= 4);
+    QCOMPARE(statisticsChanged.count(), dataChanged.count());
+
+    statistics = queue.statistics();
+    QCOMPARE(statistics.bytesSent, fileSize / 2);
+    QCOMPARE(statistics.bytesRemaining, fileSize / 2);
+    QVERIFY(statistics.throughput > fileSize / 100);
+    QVERIFY(statistics.eta > 0);
+
+    QCOMPARE(queue.data(index, UploadQueue::BytesSentRole).toLongLong(),
+             fileSize / 2);
+    QCOMPARE(queue.data(index, UploadQueue::BytesTotalRole).toLongLong(),
+             fileSize);
+    QVERIFY(queue.data(index, UploadQueue::ThroughputRole).toDouble() > 0);
+    QVERIFY(queue.data(index, UploadQueue::EtaRole).toInt() > 0);
+
+    qRegisterMetaType<UploadItem*>();
+    QSignalSpy itemUploaded(&queue, SIGNAL(itemUploaded(UploadItem*)));
+    QMetaObject::invokeMethod(item, "sendReply");
+    QCOMPARE(itemUploaded.count(), 1);
+    QCOMPARE(itemUploaded.at(0).at(0).value<UploadItem*>(), item);
+    statistics = queue.statistics();
+    QCOMPARE(statistics.bytesRemaining, Q_INT64_C(0));
+    QCOMPARE(statistics.eta, 0);
+    QCOMPARE(queue.data(index, UploadQueue::EtaRole).toInt(), -1);
+}
+
+void UploaderTest::uploadQueueBenchmark()
+{
+    UploadQueue queue;
+
+    /* Don't let the queue start while we fill it */
+    QVERIFY(Site::instance != 0);
+    Site::instance->authenticateAfter(1000 * 1000);
+
+    const int numItems = benchmarkSize(1000, 100000);
+    for (int i = 0; i < numItems; i++) {
+        QString fileName = QString("file%1.fit").arg(i);
+        queue.requestUpload(fileName, fileName);
+    }
+    QCOMPARE(queue.rowCount(), numItems);
+
+    /* The last item is the worst case for a linear lookup */
+    UploadItem *item = UploadItem::allItems.last();
+    int completed = 0;
+    int inProgress = 0;
+    QBENCHMARK {
+        item->startUpload(queue.site());
+        QMetaObject::invokeMethod(item, "sendReply");
+        queue.itemsStatus(&completed, &inProgress);
+    }
+    QCOMPARE(completed, 1);
+    QCOMPARE(inProgress, 0);
+}
+
+void UploaderTest::uploadQueueSoak()
+{
+    UploadQueue queue;
+
+    QVERIFY(Site::instance != 0);
+    Site::instance->authenticateAfter(0);
+
+    /* Push the items through the queue in batches, as a long running
+     * session would */
+    const int numItems = 5000;
+    const int batchSize = 500;
+    int completed = 0;
+    for (int i = 0; i < numItems; i += batchSize) {
+        for (int j = i; j < i + batchSize; j++) {
+            QString fileName = QString("soak/file%1.fit").arg(j);
+            queue.requestUpload(fileName, fileName, true);
+            UploadItem::allItems.last()->succeedAfter(0);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        do {
+            QTest::qWait(1);
+            queue.itemsStatus(&completed);
+        } while (completed < i + batchSize && timer.elapsed() < 10000);
+        QCOMPARE(completed, i + batchSize);
+    }
+
+    QCOMPARE(queue.itemCount(), numItems);
+    QVERIFY(queue.rowCount() < batchSize);
+    QVERIFY(UploadItem::allItems.count() < batchSize);
+
+    /* All the retired items are counted in the summary row */
+    int rowItems = 0;
+    for (int row = 0; row < queue.rowCount(); row++) {
+        QModelIndex index = queue.index(row);
+        rowItems += queue.data(index, UploadQueue::ItemCountRole).toInt();
+    }
+    QCOMPARE(rowItems, numItems);
+}
+
 int main(int argc, char **argv)
 {
     Application app(argc, argv);
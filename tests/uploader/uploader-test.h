@@ -25,11 +25,28 @@ private Q_SLOTS:
 
     void uploadQueue();
     void uploadQueueRetry();
+    void uploadQueueKnownHashes();
+    void uploadQueueSmallFiles();
+    void uploadQueueSettle();
+    void uploadQueuePriority();
+    void uploadQueueStatistics();
+    void uploadQueueBenchmark();
+    void uploadQueueSoak();
     void fileMonitor();
+    void fileMonitorIncremental();
+    void fileMonitorSnapshot();
+    void fileMonitorBenchmark();
     void fileLog();
+    void fileLogQueue();
+    void fileLogFilter();
+    void fileLogMigration();
+    void fileLogBenchmark();
 
 private:
     QString createTmpDir();
+    bool removeTree(const QString &path);
+    bool createTree(const QString &basePath, int numDirs, int filesPerDir);
+    void createOldFile(const QString &filePath, int size);
 };
 
 }; // namespace
@@ -26,8 +26,10 @@ DEPENDPATH += \
 DEFINES += PROJECT_VERSION=\\\"1.0\\\"
 
 SOURCES += \
+    $${LIBABC}/src/file-hash.cpp \
     $${SRC}/application.cpp \
     $${SRC}/configuration.cpp \
+    $${SRC}/directory-scanner.cpp \
     $${SRC}/file-log.cpp \
     $${SRC}/file-monitor.cpp \
     $${SRC}/updater.cpp \
@@ -35,8 +37,10 @@ SOURCES += \
     uploader-test.cpp
 
 HEADERS += \
+    $${LIBABC}/src/file-hash.h \
     $${SRC}/application.h \
     $${SRC}/configuration.h \
+    $${SRC}/directory-scanner.h \
     $${SRC}/file-log.h \
     $${SRC}/file-monitor.h \
     $${SRC}/updater.h \
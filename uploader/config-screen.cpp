@@ -69,6 +69,14 @@ ConfigScreen::ConfigScreen(QWidget *parent):
     wAutoStart->setChecked(configuration->autoStart());
     uploadForm->addWidget(wAutoStart);
 
+    QCheckBox *wCompressFits = new QCheckBox(tr("Compress FITS files"));
+    QObject::connect(wCompressFits, SIGNAL(toggled(bool)),
+                     configuration, SLOT(setCompressFits(bool)));
+    wCompressFits->setToolTip(tr("Losslessly compress FITS images before "
+                                 "uploading them, to save bandwidth"));
+    wCompressFits->setChecked(configuration->compressFits());
+    uploadForm->addWidget(wCompressFits);
+
     QGroupBox *uploadGroup = new QGroupBox(tr("Upload configuration"));
     uploadGroup->setLayout(uploadForm);
 
@@ -13,15 +13,19 @@
 #include <QDateTime>
 #include <QDesktopServices>
 #include <QDir>
+#include <QStringList>
 
 using namespace ABC;
 
 static const QLatin1String keyAutoStart("AutoStart");
+static const QLatin1String keyCompressFits("CompressFits");
 static const QLatin1String keyLastUploadTime("LastUploadTime");
 static const QLatin1String keyUploadPath("UploadPath");
 static const QLatin1String keyUserName("UserName");
 static const QLatin1String keyPassword("Password");
 static const QLatin1String keyLogDbPath("LogDbPath");
+static const QLatin1String keySnapshotPath("SnapshotPath");
+static const QLatin1String keyUploadPriority("UploadPriority");
 
 namespace ABC {
 
@@ -117,6 +121,19 @@ bool Configuration::autoStart() const
     return value(keyAutoStart, true).toBool();
 }
 
+void Configuration::setCompressFits(bool compress)
+{
+    if (compress == this->compressFits()) return;
+
+    setValue(keyCompressFits, compress);
+    Q_EMIT compressFitsChanged(compress);
+}
+
+bool Configuration::compressFits() const
+{
+    return value(keyCompressFits, false).toBool();
+}
+
 QString Configuration::logDbPath() const
 {
     QString path = value(keyLogDbPath).toString();
@@ -128,3 +145,22 @@ QString Configuration::logDbPath() const
 
     return path;
 }
+
+QString Configuration::snapshotPath() const
+{
+    QString path = value(keySnapshotPath).toString();
+    if (path.isEmpty()) {
+        QString directory =
+            QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+        path = directory + QDir::separator() + "abc-uploader.snapshot";
+    }
+
+    return path;
+}
+
+QStringList Configuration::uploadPriority() const
+{
+    QStringList defaultRules;
+    defaultRules << "lights" << "newest";
+    return value(keyUploadPriority, defaultRules).toStringList();
+}
@@ -11,6 +11,7 @@
 #define ABC_CONFIGURATION_H
 
 #include <QSettings>
+#include <QStringList>
 
 class QDateTime;
 
@@ -39,16 +40,25 @@ public:
 
     bool autoStart() const;
 
+    bool compressFits() const;
+
     QString logDbPath() const;
+    QString snapshotPath() const;
+
+    /* The rules deciding the upload order ("lights", "newest" and
+     * "smallest"), most important first */
+    QStringList uploadPriority() const;
 
 public Q_SLOTS:
     void setAutoStart(bool autoStart);
+    void setCompressFits(bool compress);
 
 Q_SIGNALS:
     void userNameChanged();
     void passwordChanged();
     void uploadPathChanged();
     void autoStartChanged(bool autoStart);
+    void compressFitsChanged(bool compress);
 
 private:
     ConfigurationPrivate *d_ptr;
@@ -17,10 +17,12 @@
 #include "upload-queue.h"
 
 #include <ABC/Site>
+#include <ABC/Trace>
 #include <QDateTime>
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
+#include <QTimer>
 #include <QUrl>
 
 using namespace ABC;
@@ -46,6 +48,8 @@ static const char *acceptedExtensions[] = {
 };
 #define ACCEPTED_EXTENSIONS_COUNT (sizeof(acceptedExtensions) / sizeof(char *))
 
+#define METRICS_INTERVAL    (10 * 60) // seconds
+
 namespace ABC {
 
 class ControllerPrivate: public QObject
@@ -54,20 +58,35 @@ class ControllerPrivate: public QObject
     Q_DECLARE_PUBLIC(Controller)
 
     ControllerPrivate(Controller *q);
+    ~ControllerPrivate();
 
 private Q_SLOTS:
     void doLogin();
     void onLoginDataChanged();
     void onUploadPathChanged();
+    void onMonitorChanged();
     void onDirectoryChanged();
+    void onFilesChanged(const QStringList &filePaths, bool complete);
+    void onRowsInserted(const QModelIndex &parent, int first, int last);
     void onDataChanged(const QModelIndex &first, const QModelIndex &last);
+    void onItemUploaded(UploadItem *item);
     void onAutoStartChanged(bool autoStart);
+    void logMetrics();
+
+private:
+    void scanTree();
+    static int knownImageType(const UploadItem *item);
+    void requestUploads(const QStringList &filePaths,
+                        const QDateTime &updateTime,
+                        bool complete = false);
 
 private:
     QDateTime lastUpdateTime;
     FileMonitor watcher;
     FileLog fileLog;
     bool loginScheduled;
+    QTimer metricsTimer;
+    QByteArray traceFile;
     mutable Controller *q_ptr;
 };
 
@@ -86,6 +105,7 @@ ControllerPrivate::ControllerPrivate(Controller *q):
 
     Configuration *configuration =
        Application::instance()->configuration();
+    watcher.setSnapshotPath(configuration->snapshotPath());
     QObject::connect(configuration, SIGNAL(uploadPathChanged()),
                      this, SLOT(onUploadPathChanged()));
     QObject::connect(configuration, SIGNAL(userNameChanged()),
@@ -99,7 +119,11 @@ ControllerPrivate::ControllerPrivate(Controller *q):
     onAutoStartChanged(configuration->autoStart());
 
     QObject::connect(&watcher, SIGNAL(changed()),
-                     this, SLOT(onDirectoryChanged()));
+                     this, SLOT(onMonitorChanged()));
+    QObject::connect(&watcher,
+                     SIGNAL(filesChanged(const QStringList &, bool)),
+                     this,
+                     SLOT(onFilesChanged(const QStringList &, bool)));
     QString basePath = configuration->uploadPath();
     if (!basePath.isEmpty()) {
         watcher.setBasePath(basePath);
@@ -110,14 +134,63 @@ ControllerPrivate::ControllerPrivate(Controller *q):
     UploadQueue *uploadQueue = Application::instance()->uploadQueue();
     uploadQueue->site()->setLoginData(configuration->userName(),
                                       configuration->password());
+    uploadQueue->setCompressionEnabled(configuration->compressFits());
+    QList<UploadQueue::PriorityRule> rules;
+    foreach (const QString &rule, configuration->uploadPriority()) {
+        if (rule == "lights") rules.append(UploadQueue::LightsFirst);
+        else if (rule == "newest") rules.append(UploadQueue::NewestFirst);
+        else if (rule == "smallest") rules.append(UploadQueue::SmallestFirst);
+        else qWarning() << "Unknown upload priority rule:" << rule;
+    }
+    uploadQueue->setPriorityRules(rules);
+    QObject::connect(configuration, SIGNAL(compressFitsChanged(bool)),
+                     uploadQueue, SLOT(setCompressionEnabled(bool)));
     connect(uploadQueue,
             SIGNAL(dataChanged(const QModelIndex &, const QModelIndex &)),
             this,
             SLOT(onDataChanged(const QModelIndex &, const QModelIndex &)));
+    connect(uploadQueue, SIGNAL(itemUploaded(UploadItem *)),
+            this, SLOT(onItemUploaded(UploadItem *)));
+    /* Keep the state of the queue in the DB, so that it can be restored
+     * on the next run */
+    connect(uploadQueue,
+            SIGNAL(rowsInserted(const QModelIndex &, int, int)),
+            this,
+            SLOT(onRowsInserted(const QModelIndex &, int, int)));
 
-    /* Force a refresh */
     if (!basePath.isEmpty()) {
-        onDirectoryChanged();
+        /* Restore the uploads which were pending when we last quit: then we
+         * only need to look for files changed since the last run. */
+        QDir baseDir(basePath);
+        QHash<QString, int> imageTypes = fileLog.queuedImageTypes();
+        foreach (const QString &fileName, fileLog.queuedFiles()) {
+            uploadQueue->requestUpload(fileName,
+                                       baseDir.relativeFilePath(fileName),
+                                       false,
+                                       ImageType(imageTypes.value(fileName)));
+        }
+        lastUpdateTime = configuration->lastUploadTime();
+
+        scanTree();
+    }
+
+#ifdef ABC_TRACING
+    /* Set ABC_TRACE_FILE to get a Chrome trace of the whole run */
+    traceFile = qgetenv("ABC_TRACE_FILE");
+    if (!traceFile.isEmpty()) Trace::setRecording(true);
+
+    metricsTimer.setInterval(METRICS_INTERVAL * 1000);
+    QObject::connect(&metricsTimer, SIGNAL(timeout()),
+                     this, SLOT(logMetrics()));
+    metricsTimer.start();
+#endif
+}
+
+ControllerPrivate::~ControllerPrivate()
+{
+    if (!traceFile.isEmpty()) {
+        logMetrics();
+        Trace::writeChromeTrace(QFile::decodeName(traceFile));
     }
 }
 
@@ -152,8 +225,18 @@ void ControllerPrivate::onUploadPathChanged()
     /* The last upload time needs to be reset, since this is a new
      * directory and we'd better check every file in it. */
     lastUpdateTime = QDateTime();
+    configuration->setLastUploadTime(lastUpdateTime);
+    fileLog.clearQueue();
+
+    scanTree();
+}
+
+void ControllerPrivate::onMonitorChanged()
+{
+    /* If the monitor tells us exactly which files changed, there's no need
+     * to walk the whole tree */
+    if (watcher.isIncremental()) return;
 
-    /* Force a refresh */
     onDirectoryChanged();
 }
 
@@ -166,19 +249,76 @@ void ControllerPrivate::onDirectoryChanged()
      * needed when the object is first instantiated: since lastUpdateTime
      * is invalid we get the list of all monitored files, so we check
      * them against our upload log. */
-    QStringList changedFiles = fileLog.filterOutLogged(allFiles);
-    if (changedFiles.isEmpty()) return;
+    requestUploads(fileLog.filterOutLogged(allFiles), newLastUpdateTime);
+}
 
-    UploadQueue *uploadQueue = Application::instance()->uploadQueue();
-    QDir baseDir(watcher.basePath());
+void ControllerPrivate::scanTree()
+{
+    QDateTime newLastUpdateTime = QDateTime::currentDateTime();
+
+    /* Only the files which changed since the last run (or, if we don't
+     * have a snapshot of the tree, since lastUpdateTime) need to be
+     * checked against the upload log */
+    QStringList allFiles = watcher.filesChangedSinceSnapshot(lastUpdateTime);
+    requestUploads(fileLog.filterOutLogged(allFiles), newLastUpdateTime);
+}
+
+void ControllerPrivate::onFilesChanged(const QStringList &filePaths,
+                                       bool complete)
+{
+    QDateTime newLastUpdateTime = QDateTime::currentDateTime();
+    requestUploads(fileLog.filterOutLogged(filePaths), newLastUpdateTime,
+                   complete);
+}
 
-    foreach (const QString &fileName, changedFiles) {
-        DEBUG() << "File:" << fileName;
-        uploadQueue->requestUpload(fileName,
-                                   baseDir.relativeFilePath(fileName));
+void ControllerPrivate::requestUploads(const QStringList &filePaths,
+                                       const QDateTime &updateTime,
+                                       bool complete)
+{
+    if (!filePaths.isEmpty()) {
+        UploadQueue *uploadQueue = Application::instance()->uploadQueue();
+        QDir baseDir(watcher.basePath());
+
+        foreach (const QString &fileName, filePaths) {
+            DEBUG() << "File:" << fileName;
+            uploadQueue->requestUpload(fileName,
+                                       baseDir.relativeFilePath(fileName),
+                                       complete);
+        }
+
+        /* Make sure that the new files are in the DB before recording that
+         * we don't need to look at them again */
+        fileLog.flush();
+        lastUpdateTime = updateTime;
+        Application::instance()->configuration()->
+            setLastUploadTime(lastUpdateTime);
     }
 
-    lastUpdateTime = newLastUpdateTime;
+    /* The files are either logged or queued, now */
+    watcher.commitSnapshot();
+}
+
+/* Without probing the file, which is done by the queue */
+int ControllerPrivate::knownImageType(const UploadItem *item)
+{
+    return item->isImageTypeKnown() ? item->imageType() : UnknownType;
+}
+
+void ControllerPrivate::onRowsInserted(const QModelIndex &parent,
+                                       int first, int last)
+{
+    Q_UNUSED(parent);
+    UploadQueue *uploadQueue = Application::instance()->uploadQueue();
+
+    for (int i = first; i <= last; i++) {
+        QModelIndex index = uploadQueue->index(i);
+        QVariant data = uploadQueue->data(index, UploadQueue::UploadItemRole);
+        UploadItem *item = data.value<UploadItem *>();
+        if (Q_UNLIKELY(!item)) continue;
+
+        fileLog.updateQueuedFile(item->filePath(), item->progress(), 0,
+                                 knownImageType(item));
+    }
 }
 
 void ControllerPrivate::onDataChanged(const QModelIndex &first,
@@ -192,10 +332,37 @@ void ControllerPrivate::onDataChanged(const QModelIndex &first,
         UploadItem *item = data.value<UploadItem *>();
         if (Q_UNLIKELY(!item)) continue;
 
-        if (item->progress() < 100) continue;
+        /* Completed uploads are logged by onItemUploaded(); the progress
+         * of the running ones is not worth saving */
+        int progress = item->progress();
+        if (progress > 0) continue;
 
-        DEBUG() << "Upload completed:" << item->fileName();
-        fileLog.addFile(item->fileName());
+        fileLog.updateQueuedFile(item->filePath(), progress,
+                                 item->lastError(), knownImageType(item));
+    }
+}
+
+void ControllerPrivate::onItemUploaded(UploadItem *item)
+{
+    DEBUG() << "Upload completed:" << item->fileName();
+    /* The log hashes the file itself: the hash sent to the server is a
+     * slower one, and possibly of the compressed file */
+    fileLog.addFile(item->fileName());
+}
+
+void ControllerPrivate::logMetrics()
+{
+    QVariantMap metrics = Trace::metrics();
+    QVariantMap::const_iterator i;
+    for (i = metrics.constBegin(); i != metrics.constEnd(); i++) {
+        if (i.value().type() == QVariant::Map) {
+            QVariantMap timer = i.value().toMap();
+            DEBUG() << i.key() << timer["count"].toLongLong() << "calls," <<
+                timer["total"].toLongLong() / 1000 << "ms total," <<
+                timer["max"].toLongLong() / 1000 << "ms max";
+        } else {
+            DEBUG() << i.key() << i.value().toLongLong();
+        }
     }
 }
 
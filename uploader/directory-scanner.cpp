@@ -0,0 +1,275 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of ABC (AstroBin Companion).
+ *
+ * All rights reserved.
+ */
+
+#include "directory-scanner.h"
+
+#include <ABC/Trace>
+#include <QAtomicPointer>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QPair>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+
+#ifdef Q_OS_UNIX
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+/* Directory reads are mostly waiting for the disk, so we can afford more
+ * threads than CPU cores */
+#define MIN_SCANNER_THREADS 4
+#define NSECS_PER_SEC       Q_INT64_C(1000000000)
+
+#if defined Q_OS_LINUX
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#elif defined Q_OS_MAC
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) 0
+#endif
+
+using namespace ABC;
+
+namespace ABC {
+
+/* The files found in one directory */
+struct ScanResult
+{
+    QVector<QPair<QString, FileStamp> > files;
+    ScanResult *next;
+};
+
+class DirectoryScannerPrivate
+{
+    Q_DECLARE_PUBLIC(DirectoryScanner)
+
+    DirectoryScannerPrivate(DirectoryScanner *q);
+
+    void scanDirectory(const QString &path);
+    void addResult(ScanResult *result);
+    FileSnapshot takeResults();
+
+private:
+    QSet<QString> acceptedExtensions;
+    QThreadPool threadPool;
+    /* The tasks push their results onto this list, without locking */
+    QAtomicPointer<ScanResult> results;
+    mutable DirectoryScanner *q_ptr;
+};
+
+class ScanTask: public QRunnable
+{
+public:
+    ScanTask(DirectoryScannerPrivate *scanner, const QString &path):
+        scanner(scanner),
+        path(path)
+    {
+    }
+
+    void run() { scanner->scanDirectory(path); }
+
+private:
+    DirectoryScannerPrivate *scanner;
+    QString path;
+};
+
+} // namespace
+
+#ifdef Q_OS_UNIX
+static FileStamp stampFromStat(const struct stat &st)
+{
+    FileStamp stamp;
+    stamp.size = st.st_size;
+    stamp.mtime = st.st_mtime * NSECS_PER_SEC + STAT_MTIME_NSEC(st);
+    stamp.inode = st.st_ino;
+    stamp.device = st.st_dev;
+    return stamp;
+}
+#endif
+
+QDataStream &ABC::operator<<(QDataStream &stream, const FileStamp &stamp)
+{
+    stream << stamp.size << stamp.mtime << stamp.inode << stamp.device;
+    return stream;
+}
+
+QDataStream &ABC::operator>>(QDataStream &stream, FileStamp &stamp)
+{
+    stream >> stamp.size >> stamp.mtime >> stamp.inode >> stamp.device;
+    return stream;
+}
+
+DirectoryScannerPrivate::DirectoryScannerPrivate(DirectoryScanner *q):
+    results(0),
+    q_ptr(q)
+{
+    threadPool.setMaxThreadCount(qMax(QThread::idealThreadCount(),
+                                      MIN_SCANNER_THREADS));
+}
+
+void DirectoryScannerPrivate::addResult(ScanResult *result)
+{
+    ScanResult *head;
+    do {
+        head = results;
+        result->next = head;
+    } while (!results.testAndSetOrdered(head, result));
+}
+
+FileSnapshot DirectoryScannerPrivate::takeResults()
+{
+    ScanResult *head = results.fetchAndStoreOrdered(0);
+
+    int count = 0;
+    for (ScanResult *result = head; result != 0; result = result->next) {
+        count += result->files.count();
+    }
+
+    FileSnapshot snapshot;
+    snapshot.reserve(count);
+    while (head != 0) {
+        ScanResult *result = head;
+        for (int i = 0; i < result->files.count(); i++) {
+            snapshot.insert(result->files[i].first, result->files[i].second);
+        }
+        head = result->next;
+        delete result;
+    }
+    return snapshot;
+}
+
+void DirectoryScannerPrivate::scanDirectory(const QString &path)
+{
+    Q_Q(DirectoryScanner);
+
+    QVector<QPair<QString, FileStamp> > found;
+
+#ifdef Q_OS_UNIX
+    DIR *dir = opendir(QFile::encodeName(path).constData());
+    if (Q_UNLIKELY(dir == 0)) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != 0) {
+        /* Skip hidden files, like QDir does by default */
+        if (entry->d_name[0] == '.') continue;
+
+        QString filePath = path + '/' + QFile::decodeName(entry->d_name);
+#ifdef DT_DIR
+        if (entry->d_type == DT_DIR) {
+            threadPool.start(new ScanTask(this, filePath));
+            continue;
+        }
+        /* Look at the name first: it's much cheaper than a stat() */
+        if (entry->d_type == DT_REG && !q->isAccepted(filePath)) continue;
+#endif
+
+        /* Some file systems don't tell the file type, so the stat() might
+         * be needed for that too (this follows symbolic links) */
+        struct stat st;
+        if (::stat(QFile::encodeName(filePath).constData(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            threadPool.start(new ScanTask(this, filePath));
+        } else if (S_ISREG(st.st_mode) && q->isAccepted(filePath)) {
+            found.append(qMakePair(filePath, stampFromStat(st)));
+        }
+    }
+    closedir(dir);
+#else
+    QDir dir(path);
+    QFileInfoList allFiles = dir.entryInfoList(QDir::Files | QDir::Dirs |
+                                               QDir::NoDotAndDotDot |
+                                               QDir::Readable);
+    foreach (const QFileInfo &info, allFiles) {
+        QString filePath = info.absoluteFilePath();
+        if (info.isDir()) {
+            threadPool.start(new ScanTask(this, filePath));
+        } else if (q->isAccepted(filePath)) {
+            FileStamp stamp = DirectoryScanner::stamp(filePath);
+            if (stamp.isValid()) found.append(qMakePair(filePath, stamp));
+        }
+    }
+#endif
+
+    if (found.isEmpty()) return;
+
+    ScanResult *result = new ScanResult;
+    result->files = found;
+    addResult(result);
+}
+
+DirectoryScanner::DirectoryScanner():
+    d_ptr(new DirectoryScannerPrivate(this))
+{
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+    delete d_ptr;
+    d_ptr = 0;
+}
+
+void DirectoryScanner::setAcceptedExtensions(const QSet<QString> &extensions)
+{
+    Q_D(DirectoryScanner);
+    d->acceptedExtensions = extensions;
+}
+
+bool DirectoryScanner::isAccepted(const QString &filePath) const
+{
+    Q_D(const DirectoryScanner);
+
+    if (d->acceptedExtensions.isEmpty()) return true;
+
+    int dot = filePath.lastIndexOf('.');
+    if (dot < 0 || dot < filePath.lastIndexOf('/')) return false;
+    return d->acceptedExtensions.contains(filePath.mid(dot + 1).toLower());
+}
+
+FileSnapshot DirectoryScanner::scan(const QString &path)
+{
+    Q_D(DirectoryScanner);
+
+    if (path.isEmpty()) return FileSnapshot();
+
+    ABC_TRACE_SCOPE("DirectoryScanner::scan");
+    d->threadPool.start(new ScanTask(d, path));
+    /* The tasks queue the subdirectories before completing, so this
+     * returns only when the whole tree has been scanned */
+    d->threadPool.waitForDone();
+
+    return d->takeResults();
+}
+
+FileStamp DirectoryScanner::stamp(const QString &filePath)
+{
+#ifdef Q_OS_UNIX
+    struct stat st;
+    if (::stat(QFile::encodeName(filePath).constData(), &st) != 0) {
+        return FileStamp();
+    }
+    return stampFromStat(st);
+#else
+    FileStamp stamp;
+    QFileInfo info(filePath);
+    if (!info.exists()) return stamp;
+
+    stamp.size = info.size();
+    stamp.mtime = info.lastModified().toMSecsSinceEpoch() * 1000000;
+    return stamp;
+#endif
+}
@@ -0,0 +1,72 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/*
+ * Copyright (C) 2013 Alberto Mardegan <info@mardy.it>
+ *
+ * This file is part of ABC (AstroBin Companion).
+ *
+ * All rights reserved.
+ */
+
+#ifndef ABC_DIRECTORY_SCANNER_H
+#define ABC_DIRECTORY_SCANNER_H
+
+#include <QHash>
+#include <QSet>
+#include <QString>
+
+class QDataStream;
+
+namespace ABC {
+
+/* What we know about a file without reading it */
+struct FileStamp
+{
+    FileStamp(): size(-1), mtime(0), inode(0), device(0) {}
+
+    bool isValid() const { return size >= 0; }
+
+    bool operator==(const FileStamp &other) const {
+        return size == other.size && mtime == other.mtime &&
+            inode == other.inode && device == other.device;
+    }
+    bool operator!=(const FileStamp &other) const {
+        return !(*this == other);
+    }
+
+    qint64 size;
+    qint64 mtime; // nanoseconds since the epoch
+    quint64 inode;
+    quint64 device;
+};
+
+/* File stamps, indexed by the absolute file path */
+typedef QHash<QString, FileStamp> FileSnapshot;
+
+QDataStream &operator<<(QDataStream &stream, const FileStamp &stamp);
+QDataStream &operator>>(QDataStream &stream, FileStamp &stamp);
+
+class DirectoryScannerPrivate;
+class DirectoryScanner
+{
+public:
+    DirectoryScanner();
+    ~DirectoryScanner();
+
+    void setAcceptedExtensions(const QSet<QString> &extensions);
+    bool isAccepted(const QString &filePath) const;
+
+    /* Walks the tree under "path", reading several directories in
+     * parallel, and returns the stamps of the accepted files. */
+    FileSnapshot scan(const QString &path);
+
+    static FileStamp stamp(const QString &filePath);
+
+private:
+    Q_DISABLE_COPY(DirectoryScanner)
+    DirectoryScannerPrivate *d_ptr;
+    Q_DECLARE_PRIVATE(DirectoryScanner)
+};
+
+}; // namespace
+
+#endif /* ABC_DIRECTORY_SCANNER_H */
@@ -10,49 +10,139 @@
 #include "application.h"
 #include "configuration.h"
 #include "debug.h"
+#include "directory-scanner.h"
 #include "file-log.h"
 
-#include <QCryptographicHash>
+#include <ABC/FileHash>
+#include <ABC/Trace>
 #include <QDateTime>
 #include <QDir>
 #include <QFileInfo>
+#include <QFutureWatcher>
+#include <QHash>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QTimer>
+#include <QVector>
+#include <QtConcurrentMap>
+
+/* Changes are written to the DB in batches, at most this late */
+#define FLUSH_DELAY         1000 // milliseconds
+#define MAX_PENDING_UPLOADS 1000
+/* Above this many files, reading the whole log is faster than looking up
+ * each file */
+#define BULK_LOOKUP_THRESHOLD   100
+#define MD5_HEX_LENGTH          32
+#define HASH_ALGORITHM_COUNT    (FileHash::XxHash64 + 1)
 
 using namespace ABC;
 
-static const int dbVersion = 1;
+static const int dbVersion = 5;
 
 namespace ABC {
 
-class FileLogPrivate
+struct QueuedFile {
+    QueuedFile(): progress(0), lastError(0), imageType(0), removed(false) {}
+    int progress;
+    int lastError;
+    int imageType; // 0 if unknown
+    bool removed;
+};
+
+struct LoggedFile {
+    QString hash;
+    /* Only used by logs written before the file stamp was stored */
+    QString modified;
+    FileStamp stamp;
+};
+
+class FileLogPrivate: public QObject
 {
+    Q_OBJECT
     Q_DECLARE_PUBLIC(FileLog)
 
     FileLogPrivate(FileLog *q);
-    ~FileLogPrivate() {}
+    ~FileLogPrivate();
+
+    enum StampCheck {
+        Unchanged,
+        Changed,
+        MaybeChanged // the hash must be checked
+    };
 
     bool isLogged(const QString &filePath) const;
     QStringList filterOutLogged(const QStringList &allFiles) const;
     void addFile(const QString &filePath, const QByteArray &fileHash);
+    void finishHashing();
+    void updateStamp(const QString &relativePath, LoggedFile loggedFile,
+                     const FileStamp &stamp);
+
+    void updateQueuedFile(const QString &filePath,
+                          const QueuedFile &queuedFile);
+    QStringList queuedFiles() const;
+    QHash<QString, int> queuedImageTypes() const;
+
+private Q_SLOTS:
+    void flush();
+    void hashUploads();
+    void onUploadsHashed();
 
 private:
     bool initDb();
     bool updateDb(int oldVersion);
-    QString computeHash(const QString &filePath) const;
+    void prepareQueries();
+    void execQuery(QSqlQuery &query) const;
+    void scheduleFlush();
+    void logUpload(const QString &relativePath, const LoggedFile &loggedFile);
+    bool isBeingHashed(const QString &relativePath,
+                       const FileStamp &stamp) const;
+    static QByteArray hashUpload(const QString &filePath);
+    static LoggedFile loggedFileFromQuery(const QSqlQuery &query,
+                                          int firstColumn);
+    QHash<QString, LoggedFile> loggedFiles() const;
+    static QString modifiedString(const FileStamp &stamp);
+    static StampCheck checkStamp(const LoggedFile &loggedFile,
+                                 const FileStamp &stamp);
+    static FileHash::Algorithm hashAlgorithm(const QString &hash);
+    static QString computeHash(const QString &filePath,
+                               FileHash::Algorithm algorithm);
 
 private:
     QSqlDatabase db;
     QDir baseDir;
+    /* Uploads and changes to the Queue table not yet written to the DB */
+    QHash<QString, LoggedFile> pendingUploads;
+    QHash<QString, QueuedFile> pendingQueueChanges;
+    QTimer flushTimer;
+    /* Uploaded files whose hash is not ready yet, with the stamp they had
+     * when they were uploaded; some of them wait for the current batch to
+     * be hashed. */
+    QHash<QString, LoggedFile> hashingUploads;
+    QStringList unhashedPaths;
+    QStringList hashingPaths;
+    QFutureWatcher<QByteArray> hashWatcher;
+    /* Prepared once, and reused for every file */
+    mutable QSqlQuery selectUploadQuery;
+    QSqlQuery insertUploadQuery;
+    QSqlQuery insertQueueQuery;
+    QSqlQuery removeQueueQuery;
     mutable FileLog *q_ptr;
 };
 
 } // namespace
 
 FileLogPrivate::FileLogPrivate(FileLog *q):
+    QObject(q),
     q_ptr(q)
 {
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(FLUSH_DELAY);
+    QObject::connect(&flushTimer, SIGNAL(timeout()),
+                     this, SLOT(flush()));
+    QObject::connect(&hashWatcher, SIGNAL(finished()),
+                     this, SLOT(onUploadsHashed()));
+
     Configuration *conf = Application::instance()->configuration();
     QString dbPath = conf->logDbPath();
 
@@ -68,15 +158,37 @@ FileLogPrivate::FileLogPrivate(FileLog *q):
     if (!initDb()) {
         qWarning() << "Cannot open DB";
     }
+    prepareQueries();
+}
+
+FileLogPrivate::~FileLogPrivate()
+{
+    finishHashing();
+    flush();
+
+    /* Closing the DB merges the write-ahead log into it */
+    selectUploadQuery = QSqlQuery();
+    insertUploadQuery = QSqlQuery();
+    insertQueueQuery = QSqlQuery();
+    removeQueueQuery = QSqlQuery();
+    db.close();
 }
 
 bool FileLogPrivate::initDb()
 {
     if (!db.open()) return false;
 
+    /* With the write-ahead log, a commit costs a single append to the log
+     * file; "NORMAL" still keeps the DB consistent after a crash, though
+     * the last transactions might be lost. */
+    db.exec("PRAGMA journal_mode = WAL");
+    db.exec("PRAGMA synchronous = NORMAL");
+
     // check the DB version
     QSqlQuery q = db.exec("PRAGMA user_version");
     int version = q.first() ? q.value(0).toInt() : 0;
+    /* A statement still active would keep the tables locked */
+    q.finish();
     return version >= dbVersion ? true : updateDb(version);
 }
 
@@ -84,6 +196,9 @@ bool FileLogPrivate::updateDb(int oldVersion)
 {
     DEBUG() << "Database version:" << oldVersion;
 
+    /* All or nothing: an interrupted update is run again from the start */
+    db.transaction();
+
     if (oldVersion < 1) {
         // create DB
         QString command =
@@ -95,21 +210,166 @@ bool FileLogPrivate::updateDb(int oldVersion)
         db.exec(command);
     }
 
-    if (db.lastError().isValid()) return false;
+    if (oldVersion < 2) {
+        /* Uploads which haven't been completed yet */
+        QString command =
+            "CREATE TABLE Queue ("
+            "filePath TEXT PRIMARY KEY NOT NULL,"
+            "progress INTEGER,"
+            "lastError INTEGER"
+            ")";
+        db.exec(command);
+    }
+
+    if (oldVersion < 3) {
+        /* Integer file stamps: unlike the "modified" text, they don't
+         * depend on the time zone and have sub-second precision. The
+         * stamps of the existing rows are filled when their files are
+         * next checked. Lookups are done by filePath, which is already
+         * indexed by its UNIQUE constraint. */
+        db.exec("ALTER TABLE Uploads ADD COLUMN size INTEGER");
+        db.exec("ALTER TABLE Uploads ADD COLUMN mtime_ns INTEGER");
+        db.exec("ALTER TABLE Uploads ADD COLUMN inode INTEGER");
+        db.exec("ALTER TABLE Uploads ADD COLUMN device INTEGER");
+    }
+
+    if (oldVersion < 4) {
+        /* So that the queued files don't need to be probed again on the
+         * next run; NULL if unknown */
+        db.exec("ALTER TABLE Queue ADD COLUMN imageType INTEGER");
+    }
+
+    if (oldVersion < 5) {
+        /* Rows were keyed by hash, so logging a file with the same contents
+         * as another one removed the other one's row. SQLite cannot change
+         * the constraints of a table, so it's rebuilt. */
+        QString command =
+            "CREATE TABLE NewUploads ("
+            "filePath TEXT PRIMARY KEY NOT NULL,"
+            "hash TEXT NOT NULL,"
+            "modified TEXT,"
+            "size INTEGER,"
+            "mtime_ns INTEGER,"
+            "inode INTEGER,"
+            "device INTEGER"
+            ")";
+        db.exec(command);
+        db.exec("INSERT INTO NewUploads SELECT filePath, hash, modified, "
+                "size, mtime_ns, inode, device FROM Uploads");
+        db.exec("DROP TABLE Uploads");
+        db.exec("ALTER TABLE NewUploads RENAME TO Uploads");
+        db.exec("CREATE INDEX UploadsByHash ON Uploads (hash)");
+    }
+
+    if (db.lastError().isValid()) {
+        db.rollback();
+        return false;
+    }
 
     // Update version number
     db.exec(QString("PRAGMA user_version = %1").arg(dbVersion));
 
-    return true;
+    return db.commit();
+}
+
+void FileLogPrivate::prepareQueries()
+{
+    selectUploadQuery = QSqlQuery(db);
+    selectUploadQuery.prepare("SELECT hash, modified, size, mtime_ns, "
+                              "inode, device FROM Uploads "
+                              "WHERE filePath = :filePath");
+    insertUploadQuery = QSqlQuery(db);
+    insertUploadQuery.prepare("INSERT OR REPLACE INTO Uploads "
+                              "(filePath, hash, modified, "
+                              "size, mtime_ns, inode, device) "
+                              "VALUES (:filePath, :hash, :modified, "
+                              ":size, :mtimeNs, :inode, :device)");
+    insertQueueQuery = QSqlQuery(db);
+    insertQueueQuery.prepare("INSERT OR REPLACE INTO Queue "
+                             "(filePath, progress, lastError, imageType) "
+                             "VALUES (:filePath, :progress, :lastError, "
+                             ":imageType)");
+    removeQueueQuery = QSqlQuery(db);
+    removeQueueQuery.prepare("DELETE FROM Queue WHERE filePath = :filePath");
+}
+
+void FileLogPrivate::execQuery(QSqlQuery &query) const
+{
+    if (!query.exec()) {
+        qWarning() << "Error executing query:" << query.lastError();
+    }
+}
+
+void FileLogPrivate::scheduleFlush()
+{
+    if (pendingUploads.count() >= MAX_PENDING_UPLOADS) {
+        flush();
+    } else if (!flushTimer.isActive()) {
+        flushTimer.start();
+    }
+}
+
+/* Reads the hash, modified, size, mtime_ns, inode and device columns */
+LoggedFile FileLogPrivate::loggedFileFromQuery(const QSqlQuery &query,
+                                               int firstColumn)
+{
+    LoggedFile loggedFile;
+    loggedFile.hash = query.value(firstColumn).toString();
+    loggedFile.modified = query.value(firstColumn + 1).toString();
+    /* The stamp columns are NULL in the rows written by older versions */
+    if (!query.value(firstColumn + 2).isNull()) {
+        FileStamp &stamp = loggedFile.stamp;
+        stamp.size = query.value(firstColumn + 2).toLongLong();
+        stamp.mtime = query.value(firstColumn + 3).toLongLong();
+        stamp.inode = query.value(firstColumn + 4).toULongLong();
+        stamp.device = query.value(firstColumn + 5).toULongLong();
+    }
+    return loggedFile;
+}
+
+/* The modification time, as older versions stored it */
+QString FileLogPrivate::modifiedString(const FileStamp &stamp)
+{
+    if (!stamp.isValid()) return QString();
+    QDateTime modified =
+        QDateTime::fromMSecsSinceEpoch(stamp.mtime / 1000000);
+    return modified.toString(Qt::ISODate);
+}
+
+/* Tells whether the file is still the one which was logged, looking only
+ * at its stamp */
+FileLogPrivate::StampCheck
+FileLogPrivate::checkStamp(const LoggedFile &loggedFile,
+                           const FileStamp &stamp)
+{
+    const FileStamp &logged = loggedFile.stamp;
+    if (!logged.isValid()) {
+        return loggedFile.modified == modifiedString(stamp) ?
+            Unchanged : MaybeChanged;
+    }
+
+    if (!stamp.isValid() || stamp.size != logged.size) return Changed;
+
+    /* A copy of the file has a different inode, even if the modification
+     * time has been preserved */
+    if (stamp.mtime == logged.mtime && stamp.inode == logged.inode &&
+        stamp.device == logged.device) return Unchanged;
+
+    return MaybeChanged;
+}
+
+/* The log is only used to tell whether a file has changed, so we don't
+ * need a cryptographic hash; older logs have MD5 hashes, though. */
+FileHash::Algorithm FileLogPrivate::hashAlgorithm(const QString &hash)
+{
+    return hash.length() == MD5_HEX_LENGTH ?
+        FileHash::Md5 : FileHash::XxHash64;
 }
 
-QString FileLogPrivate::computeHash(const QString &filePath) const
+QString FileLogPrivate::computeHash(const QString &filePath,
+                                    FileHash::Algorithm algorithm)
 {
-    QCryptographicHash hash(QCryptographicHash::Md5);
-    QFile file(filePath);
-    file.open(QIODevice::ReadOnly);
-    hash.addData(file.readAll());
-    return QString(hash.result().toHex());
+    return QString::fromLatin1(FileHash::hash(filePath, algorithm));
 }
 
 void FileLogPrivate::addFile(const QString &filePath,
@@ -117,56 +377,378 @@ void FileLogPrivate::addFile(const QString &filePath,
 {
     QString absolutePath = baseDir.absoluteFilePath(filePath);
     QString relativePath = baseDir.relativeFilePath(filePath);
-    QFileInfo info(absolutePath);
+
+    /* The file stamp must be taken now, while we know it refers to the
+     * uploaded file */
+    LoggedFile loggedFile;
+    loggedFile.stamp = DirectoryScanner::stamp(absolutePath);
+    loggedFile.modified = modifiedString(loggedFile.stamp);
+
+    if (!fileHash.isEmpty()) {
+        hashingUploads.remove(relativePath);
+        unhashedPaths.removeAll(relativePath);
+        loggedFile.hash = QString::fromLatin1(fileHash);
+        logUpload(relativePath, loggedFile);
+        return;
+    }
+
+    /* Hashing a large file would block the GUI: it's done in the thread
+     * pool, and the file is logged once its hash is ready */
+    hashingUploads.insert(relativePath, loggedFile);
+    if (!unhashedPaths.contains(relativePath)) {
+        unhashedPaths.append(relativePath);
+    }
+    hashUploads();
+}
+
+void FileLogPrivate::logUpload(const QString &relativePath,
+                               const LoggedFile &loggedFile)
+{
+    pendingUploads.insert(relativePath, loggedFile);
+
+    /* The file is not in the upload queue anymore */
+    QueuedFile uploaded;
+    uploaded.removed = true;
+    updateQueuedFile(relativePath, uploaded);
+}
+
+void FileLogPrivate::hashUploads()
+{
+    if (!hashingPaths.isEmpty() || unhashedPaths.isEmpty()) return;
+
+    hashingPaths = unhashedPaths;
+    unhashedPaths.clear();
+
+    QStringList absolutePaths;
+    foreach (const QString &relativePath, hashingPaths) {
+        absolutePaths.append(baseDir.absoluteFilePath(relativePath));
+    }
+    hashWatcher.setFuture(QtConcurrent::mapped(absolutePaths, hashUpload));
+}
+
+/* Runs in the thread pool */
+QByteArray FileLogPrivate::hashUpload(const QString &filePath)
+{
+    return FileHash::hash(filePath, FileHash::XxHash64);
+}
+
+void FileLogPrivate::onUploadsHashed()
+{
+    /* The batch might have been already handled by finishHashing() */
+    if (hashingPaths.isEmpty() || hashWatcher.isRunning()) return;
+
+    QFuture<QByteArray> future = hashWatcher.future();
+    for (int i = 0; i < hashingPaths.count(); i++) {
+        const QString &relativePath = hashingPaths[i];
+        /* Files uploaded again meanwhile wait for the next batch */
+        if (unhashedPaths.contains(relativePath)) continue;
+
+        QHash<QString, LoggedFile>::iterator j =
+            hashingUploads.find(relativePath);
+        if (j == hashingUploads.end()) continue;
+
+        LoggedFile loggedFile = j.value();
+        loggedFile.hash = QString::fromLatin1(future.resultAt(i));
+        hashingUploads.erase(j);
+        logUpload(relativePath, loggedFile);
+    }
+    hashingPaths.clear();
+
+    hashUploads();
+}
+
+/* Blocks until all the uploaded files have been hashed and logged */
+void FileLogPrivate::finishHashing()
+{
+    while (!hashingPaths.isEmpty()) {
+        hashWatcher.waitForFinished();
+        onUploadsHashed();
+    }
+}
+
+/* Tells whether the file is one just uploaded and still being hashed; if
+ * it has been touched since, it waits for its hash, since only that can
+ * tell whether it has changed */
+bool FileLogPrivate::isBeingHashed(const QString &relativePath,
+                                   const FileStamp &stamp) const
+{
+    QHash<QString, LoggedFile>::const_iterator i =
+        hashingUploads.constFind(relativePath);
+    if (i == hashingUploads.constEnd()) return false;
+
+    if (checkStamp(i.value(), stamp) == Unchanged) return true;
+
+    const_cast<FileLogPrivate *>(this)->finishHashing();
+    return false;
+}
+
+void FileLogPrivate::updateQueuedFile(const QString &filePath,
+                                      const QueuedFile &queuedFile)
+{
+    pendingQueueChanges.insert(baseDir.relativeFilePath(filePath),
+                               queuedFile);
+    scheduleFlush();
+}
+
+/* Called when a logged file has been found to be unchanged, but its stamp
+ * differs from the logged one: storing the new stamp saves hashing the
+ * file again next time. */
+void FileLogPrivate::updateStamp(const QString &relativePath,
+                                 LoggedFile loggedFile,
+                                 const FileStamp &stamp)
+{
+    loggedFile.stamp = stamp;
+    loggedFile.modified = modifiedString(stamp);
+    pendingUploads.insert(relativePath, loggedFile);
+    scheduleFlush();
+}
+
+QStringList FileLogPrivate::queuedFiles() const
+{
+    const_cast<FileLogPrivate *>(this)->flush();
+
+    QStringList files;
     QSqlQuery q(db);
-    q.prepare("INSERT OR REPLACE INTO Uploads (filePath, hash, modified) "
-              "VALUES (:filePath, :hash, :modified)");
-    q.bindValue(":filePath", relativePath);
-    QString hash = fileHash.isEmpty() ? computeHash(absolutePath) : fileHash;
-    q.bindValue(":hash", hash);
-    q.bindValue(":modified", info.lastModified().toString(Qt::ISODate));
-    if (!q.exec()) {
+    if (!q.exec("SELECT filePath FROM Queue")) {
         qWarning() << "Error executing query:" << q.lastError();
+        return files;
     }
+
+    while (q.next()) {
+        files.append(baseDir.absoluteFilePath(q.value(0).toString()));
+    }
+    return files;
+}
+
+QHash<QString, int> FileLogPrivate::queuedImageTypes() const
+{
+    const_cast<FileLogPrivate *>(this)->flush();
+
+    QHash<QString, int> imageTypes;
+    QSqlQuery q(db);
+    if (!q.exec("SELECT filePath, imageType FROM Queue "
+                "WHERE imageType IS NOT NULL")) {
+        qWarning() << "Error executing query:" << q.lastError();
+        return imageTypes;
+    }
+
+    while (q.next()) {
+        imageTypes.insert(baseDir.absoluteFilePath(q.value(0).toString()),
+                          q.value(1).toInt());
+    }
+    return imageTypes;
+}
+
+/* Write all the pending changes in a single transaction. */
+void FileLogPrivate::flush()
+{
+    ABC_TRACE_SCOPE("FileLog::flush");
+    flushTimer.stop();
+    if (pendingUploads.isEmpty() && pendingQueueChanges.isEmpty()) return;
+
+    db.transaction();
+
+    QHash<QString, LoggedFile>::const_iterator u;
+    for (u = pendingUploads.constBegin(); u != pendingUploads.constEnd(); u++) {
+        insertUploadQuery.bindValue(":filePath", u.key());
+        insertUploadQuery.bindValue(":hash", u.value().hash);
+        insertUploadQuery.bindValue(":modified", u.value().modified);
+        const FileStamp &stamp = u.value().stamp;
+        if (stamp.isValid()) {
+            insertUploadQuery.bindValue(":size", stamp.size);
+            insertUploadQuery.bindValue(":mtimeNs", stamp.mtime);
+            insertUploadQuery.bindValue(":inode", qint64(stamp.inode));
+            insertUploadQuery.bindValue(":device", qint64(stamp.device));
+        } else {
+            insertUploadQuery.bindValue(":size", QVariant());
+            insertUploadQuery.bindValue(":mtimeNs", QVariant());
+            insertUploadQuery.bindValue(":inode", QVariant());
+            insertUploadQuery.bindValue(":device", QVariant());
+        }
+        execQuery(insertUploadQuery);
+    }
+
+    QHash<QString, QueuedFile>::const_iterator i;
+    for (i = pendingQueueChanges.constBegin();
+         i != pendingQueueChanges.constEnd();
+         i++) {
+        QSqlQuery &q = i.value().removed ? removeQueueQuery : insertQueueQuery;
+        q.bindValue(":filePath", i.key());
+        if (!i.value().removed) {
+            q.bindValue(":progress", i.value().progress);
+            q.bindValue(":lastError", i.value().lastError);
+            q.bindValue(":imageType", i.value().imageType != 0 ?
+                        QVariant(i.value().imageType) : QVariant());
+        }
+        execQuery(q);
+    }
+
+    if (!db.commit()) {
+        qWarning() << "Error committing the log:" << db.lastError();
+    }
+    pendingUploads.clear();
+    pendingQueueChanges.clear();
 }
 
 bool FileLogPrivate::isLogged(const QString &filePath) const
 {
+    ABC_TRACE_SCOPE("FileLog::isLogged");
+
     QString absolutePath = baseDir.absoluteFilePath(filePath);
     QString relativePath = baseDir.relativeFilePath(filePath);
 
-    QSqlQuery q(db);
-    q.prepare("SELECT hash, modified FROM Uploads "
-              "WHERE filePath = :filePath");
-    q.bindValue(":filePath", relativePath);
-    if (!q.exec()) {
-        qWarning() << "Error executing query:" << q.lastError();
-        return false;
+    if (isBeingHashed(relativePath, DirectoryScanner::stamp(absolutePath))) {
+        return true;
+    }
+
+    LoggedFile loggedFile;
+    QHash<QString, LoggedFile>::const_iterator i =
+        pendingUploads.constFind(relativePath);
+    if (i != pendingUploads.constEnd()) {
+        loggedFile = i.value();
+    } else {
+        QSqlQuery &q = selectUploadQuery;
+        q.bindValue(":filePath", relativePath);
+        if (!q.exec()) {
+            qWarning() << "Error executing query:" << q.lastError();
+            return false;
+        }
+
+        bool found = q.next();
+        if (found) {
+            loggedFile = loggedFileFromQuery(q, 0);
+        }
+        q.finish();
+        if (!found) return false;
     }
 
-    if (!q.next()) return false;
+    /* If the size, modification time and inode are the same as the logged
+     * file, we trust that it's the same file and we don't check the hash */
+    FileStamp stamp = DirectoryScanner::stamp(absolutePath);
+    StampCheck check = checkStamp(loggedFile, stamp);
+    if (check != MaybeChanged) {
+        if (check == Unchanged && !loggedFile.stamp.isValid() &&
+            stamp.isValid()) {
+            const_cast<FileLogPrivate *>(this)->updateStamp(relativePath,
+                                                            loggedFile,
+                                                            stamp);
+        }
+        return check == Unchanged;
+    }
 
-    /* If the last modification time is the same as the logged file, we trust
-     * that it's the same file and we don't check the hash */
-    QFileInfo info(absolutePath);
-    QString lastModified = info.lastModified().toString(Qt::ISODate);
-    if (q.value(1).toString() == lastModified) return true;
+    /* If the stamps differ, it might still be the same file; let's check
+     * the hash */
+    FileHash::Algorithm algorithm = hashAlgorithm(loggedFile.hash);
+    if (loggedFile.hash != computeHash(absolutePath, algorithm)) return false;
 
-    /* If the times differ, it might still be the same file; let's check the
-     * hash */
-    if (q.value(0).toString() == computeHash(absolutePath)) return true;
+    const_cast<FileLogPrivate *>(this)->updateStamp(relativePath, loggedFile,
+                                                    stamp);
+    return true;
+}
 
-    return false;
+/* Returns all the logged files, indexed by their relative path */
+QHash<QString, LoggedFile> FileLogPrivate::loggedFiles() const
+{
+    QHash<QString, LoggedFile> files;
+
+    QSqlQuery q(db);
+    if (!q.exec("SELECT filePath, hash, modified, size, mtime_ns, "
+                "inode, device FROM Uploads")) {
+        qWarning() << "Error executing query:" << q.lastError();
+        return files;
+    }
+
+    while (q.next()) {
+        files.insert(q.value(0).toString(), loggedFileFromQuery(q, 1));
+    }
+
+    QHash<QString, LoggedFile>::const_iterator i;
+    for (i = pendingUploads.constBegin(); i != pendingUploads.constEnd(); i++) {
+        files.insert(i.key(), i.value());
+    }
+    /* Without a hash: filterOutLogged() makes sure they are unchanged */
+    for (i = hashingUploads.constBegin(); i != hashingUploads.constEnd();
+         i++) {
+        files.insert(i.key(), i.value());
+    }
+    return files;
 }
 
 QStringList FileLogPrivate::filterOutLogged(const QStringList &allFiles) const
 {
-    QStringList loggedFiles;
+    ABC_TRACE_SCOPE("FileLog::filterOutLogged");
+
+    QStringList notLoggedFiles;
 
-    foreach (const QString &file, allFiles) {
-        if (!isLogged(file)) loggedFiles.append(file);
+    if (allFiles.count() < BULK_LOOKUP_THRESHOLD) {
+        foreach (const QString &file, allFiles) {
+            if (!isLogged(file)) notLoggedFiles.append(file);
+        }
+        return notLoggedFiles;
     }
-    return loggedFiles;
+
+    /* The uploaded files touched since need their hash to be checked */
+    QHash<QString, LoggedFile>::const_iterator h;
+    for (h = hashingUploads.constBegin(); h != hashingUploads.constEnd();
+         h++) {
+        FileStamp stamp =
+            DirectoryScanner::stamp(baseDir.absoluteFilePath(h.key()));
+        if (checkStamp(h.value(), stamp) != Unchanged) {
+            const_cast<FileLogPrivate *>(this)->finishHashing();
+            break;
+        }
+    }
+
+    QHash<QString, LoggedFile> logged = loggedFiles();
+
+    /* Files are only hashed if their stamp differs from the logged one */
+    FileLogPrivate *self = const_cast<FileLogPrivate *>(this);
+    QVector<bool> isLogged(allFiles.count(), false);
+    QVector<FileStamp> stamps(allFiles.count());
+    QList<int> hashIndexes[HASH_ALGORITHM_COUNT];
+    QStringList hashPaths[HASH_ALGORITHM_COUNT];
+    for (int i = 0; i < allFiles.count(); i++) {
+        QString absolutePath = baseDir.absoluteFilePath(allFiles[i]);
+        QString relativePath = baseDir.relativeFilePath(allFiles[i]);
+        QHash<QString, LoggedFile>::const_iterator j =
+            logged.constFind(relativePath);
+        if (j == logged.constEnd()) continue;
+
+        stamps[i] = DirectoryScanner::stamp(absolutePath);
+        StampCheck check = checkStamp(j.value(), stamps[i]);
+        if (check == Unchanged) {
+            isLogged[i] = true;
+            if (!j.value().stamp.isValid() && stamps[i].isValid()) {
+                self->updateStamp(relativePath, j.value(), stamps[i]);
+            }
+        } else if (check == MaybeChanged) {
+            int a = hashAlgorithm(j.value().hash);
+            hashIndexes[a].append(i);
+            hashPaths[a].append(absolutePath);
+        }
+    }
+
+    for (int a = 0; a < HASH_ALGORITHM_COUNT; a++) {
+        if (hashPaths[a].isEmpty()) continue;
+
+        DEBUG() << "Hashing" << hashPaths[a].count() << "files";
+        QList<QByteArray> hashes =
+            FileHash::hashFiles(hashPaths[a], FileHash::Algorithm(a));
+        for (int k = 0; k < hashes.count(); k++) {
+            int i = hashIndexes[a][k];
+            QString relativePath = baseDir.relativeFilePath(allFiles[i]);
+            const LoggedFile &loggedFile = logged[relativePath];
+            if (QString::fromLatin1(hashes[k]) == loggedFile.hash) {
+                isLogged[i] = true;
+                self->updateStamp(relativePath, loggedFile, stamps[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < allFiles.count(); i++) {
+        if (!isLogged[i]) notLoggedFiles.append(allFiles[i]);
+    }
+    return notLoggedFiles;
 }
 
 FileLog::FileLog(QObject *parent):
@@ -184,12 +766,38 @@ FileLog::~FileLog()
 void FileLog::clear()
 {
     Q_D(FileLog);
+    d->finishHashing();
+    d->pendingUploads.clear();
     QSqlQuery q(d->db);
     if (!q.exec("DELETE FROM Uploads")) {
         qWarning() << "Error executing query:" << q.lastError();
     }
 }
 
+/* Return the absolute paths of the files which were in the upload queue
+ * and haven't been uploaded yet. */
+QStringList FileLog::queuedFiles() const
+{
+    Q_D(const FileLog);
+    return d->queuedFiles();
+}
+
+QHash<QString, int> FileLog::queuedImageTypes() const
+{
+    Q_D(const FileLog);
+    return d->queuedImageTypes();
+}
+
+void FileLog::clearQueue()
+{
+    Q_D(FileLog);
+    d->pendingQueueChanges.clear();
+    QSqlQuery q(d->db);
+    if (!q.exec("DELETE FROM Queue")) {
+        qWarning() << "Error executing query:" << q.lastError();
+    }
+}
+
 void FileLog::setBasePath(const QString &path)
 {
     Q_D(FileLog);
@@ -202,6 +810,25 @@ void FileLog::addFile(const QString &filePath, const QByteArray &fileHash)
     return d->addFile(filePath, fileHash);
 }
 
+void FileLog::updateQueuedFile(const QString &filePath,
+                               int progress, int lastError, int imageType)
+{
+    Q_D(FileLog);
+    QueuedFile queuedFile;
+    queuedFile.progress = progress;
+    queuedFile.lastError = lastError;
+    queuedFile.imageType = imageType;
+    d->updateQueuedFile(filePath, queuedFile);
+}
+
+/* Write any pending change to the disk; the uploaded files still being
+ * hashed are written once their hash is ready. */
+void FileLog::flush()
+{
+    Q_D(FileLog);
+    d->flush();
+}
+
 bool FileLog::isLogged(const QString &filePath) const
 {
     Q_D(const FileLog);
@@ -213,3 +840,5 @@ QStringList FileLog::filterOutLogged(const QStringList &allFiles) const
     Q_D(const FileLog);
     return d->filterOutLogged(allFiles);
 }
+
+#include "file-log.moc"
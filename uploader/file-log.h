@@ -10,6 +10,7 @@
 #ifndef ABC_FILE_LOG_H
 #define ABC_FILE_LOG_H
 
+#include <QHash>
 #include <QObject>
 #include <QStringList>
 
@@ -32,9 +33,20 @@ public:
     bool isLogged(const QString &filePath) const;
     QStringList filterOutLogged(const QStringList &allFiles) const;
 
+    QStringList queuedFiles() const;
+    /* Of the queued files whose image type is known */
+    QHash<QString, int> queuedImageTypes() const;
+    void clearQueue();
+
 public Q_SLOTS:
+    /* Unless given, the hash is computed in the thread pool; the file is
+     * removed from the queue once it's logged */
     void addFile(const QString &filePath,
                  const QByteArray &fileHash = QByteArray());
+    void updateQueuedFile(const QString &filePath,
+                          int progress, int lastError = 0,
+                          int imageType = 0);
+    void flush();
 
 private:
     FileLogPrivate *d_ptr;
@@ -8,14 +8,36 @@
  */
 
 #include "debug.h"
+#include "directory-scanner.h"
 #include "file-monitor.h"
 
+#include <ABC/Trace>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDir>
+#include <QFile>
 #include <QFileSystemWatcher>
+#include <QHash>
 #include <QTimer>
 
+#ifdef Q_OS_LINUX
+#include <QSocketNotifier>
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 #define MIN_SIGNAL_INTERVAL 5 // seconds
+/* Files written in a burst are reported together */
+#define FILES_CHANGED_DELAY 200 // milliseconds
+#define INOTIFY_BUFFER_SIZE 16384
+#define SNAPSHOT_SAVE_INTERVAL  300 // seconds
+#define SNAPSHOT_MAGIC      0x41424353 // "ABCS"
+#define SNAPSHOT_VERSION    1
+#define INOTIFY_EVENTS \
+    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | \
+     IN_ONLYDIR)
 
 using namespace ABC;
 
@@ -27,25 +49,71 @@ class FileMonitorPrivate: public QObject
     Q_DECLARE_PUBLIC(FileMonitor)
 
     FileMonitorPrivate(FileMonitor *q);
+    ~FileMonitorPrivate();
 
     void setBasePath(const QString &path);
+    bool isIncremental() const;
     QStringList filesChangedSince(const QDateTime &since,
                                   const QString &path) const;
+    bool loadSnapshot();
+    QStringList filesChangedSinceSnapshot(const QDateTime &since);
+    void commitSnapshot();
+
+public Q_SLOTS:
+    void saveSnapshot();
 
 private Q_SLOTS:
     void onDirectoryChanged(const QString &path);
     void emitChanged();
+    void emitFilesChanged();
+#ifdef Q_OS_LINUX
+    void onInotifyActivated();
+#endif
 
 private:
+    void stopWatching();
     void scheduleNotification();
+    void addChangedFile(const QString &filePath, bool complete);
+    void forgetPath(const QString &path, bool isDir);
     void recurseAddPath(const QString &path);
+    void addWatch(const QString &path);
+#ifdef Q_OS_LINUX
+    bool startInotify();
+    void handleInotifyEvent(const struct inotify_event *event);
+    void removeWatches(const QString &path);
+#endif
 
 private:
     QFileSystemWatcher *watcher;
+    QSet<QString> watchedPaths;
+#ifdef Q_OS_LINUX
+    int inotifyFd;
+    QSocketNotifier *inotifyNotifier;
+    /* Watch descriptors and the directories they refer to */
+    QHash<int, QString> inotifyPaths;
+    QHash<QString, int> inotifyWatches;
+#endif
     QDateTime lastSignalTime;
     QTimer signalTimer;
+    QSet<QString> changedFiles;
+    /* Files which we know have been completely written */
+    QSet<QString> completedFiles;
+    QDateTime lastFilesChangedTime;
+    QTimer filesChangedTimer;
     QString basePath;
-    QSet<QString> acceptedExtensions;
+    mutable DirectoryScanner scanner;
+    /* The state of the accepted files, as of the last full scan plus the
+     * changes reported since; only the parts committed by the client */
+    FileSnapshot snapshot;
+    /* Waiting for commitSnapshot(): the result of the last full scan, and
+     * the files reported by filesChanged() */
+    FileSnapshot scannedSnapshot;
+    bool hasScannedSnapshot;
+    FileSnapshot reportedStamps;
+    QString snapshotPath;
+    bool hasSnapshot;
+    bool snapshotLoaded;
+    QTimer snapshotTimer;
     mutable FileMonitor *q_ptr;
 };
 
@@ -54,26 +122,96 @@ private:
 FileMonitorPrivate::FileMonitorPrivate(FileMonitor *q):
     QObject(q),
     watcher(0),
+#ifdef Q_OS_LINUX
+    inotifyFd(-1),
+    inotifyNotifier(0),
+#endif
+    hasSnapshot(false),
+    snapshotLoaded(false),
+    hasScannedSnapshot(false),
     q_ptr(q)
 {
     signalTimer.setSingleShot(true);
     signalTimer.setInterval(1000 * MIN_SIGNAL_INTERVAL);
     QObject::connect(&signalTimer, SIGNAL(timeout()),
                      this, SLOT(emitChanged()));
+
+    filesChangedTimer.setSingleShot(true);
+    filesChangedTimer.setInterval(FILES_CHANGED_DELAY);
+    QObject::connect(&filesChangedTimer, SIGNAL(timeout()),
+                     this, SLOT(emitFilesChanged()));
+
+    snapshotTimer.setSingleShot(true);
+    snapshotTimer.setInterval(1000 * SNAPSHOT_SAVE_INTERVAL);
+    QObject::connect(&snapshotTimer, SIGNAL(timeout()),
+                     this, SLOT(saveSnapshot()));
 }
 
-void FileMonitorPrivate::setBasePath(const QString &path)
+FileMonitorPrivate::~FileMonitorPrivate()
+{
+    if (snapshotTimer.isActive()) saveSnapshot();
+    stopWatching();
+}
+
+void FileMonitorPrivate::stopWatching()
 {
     delete watcher;
-    watcher = new QFileSystemWatcher(this);
-    QObject::connect(watcher, SIGNAL(directoryChanged(const QString &)),
-                     this, SLOT(onDirectoryChanged(const QString &)));
+    watcher = 0;
+    watchedPaths.clear();
+
+#ifdef Q_OS_LINUX
+    delete inotifyNotifier;
+    inotifyNotifier = 0;
+    if (inotifyFd >= 0) {
+        ::close(inotifyFd);
+        inotifyFd = -1;
+    }
+    inotifyPaths.clear();
+    inotifyWatches.clear();
+#endif
+
+    changedFiles.clear();
+    completedFiles.clear();
+    filesChangedTimer.stop();
+}
+
+void FileMonitorPrivate::setBasePath(const QString &path)
+{
+    if (snapshotTimer.isActive()) saveSnapshot();
+    snapshot.clear();
+    hasSnapshot = false;
+    snapshotLoaded = false;
+    scannedSnapshot.clear();
+    hasScannedSnapshot = false;
+    reportedStamps.clear();
+
+    stopWatching();
     basePath = path;
+    lastFilesChangedTime = QDateTime::currentDateTime();
+
+#ifdef Q_OS_LINUX
+    if (!startInotify())
+#endif
+    {
+        watcher = new QFileSystemWatcher(this);
+        QObject::connect(watcher,
+                         SIGNAL(directoryChanged(const QString &)),
+                         this, SLOT(onDirectoryChanged(const QString &)));
+    }
 
     /* Recursively find directories to be monitored */
     recurseAddPath(path);
 }
 
+bool FileMonitorPrivate::isIncremental() const
+{
+#ifdef Q_OS_LINUX
+    return inotifyFd >= 0;
+#else
+    return false;
+#endif
+}
+
 void FileMonitorPrivate::onDirectoryChanged(const QString &path)
 {
     /* Recursively find new directories to be monitored. */
@@ -90,6 +228,29 @@ void FileMonitorPrivate::emitChanged()
     Q_EMIT q->changed();
 }
 
+void FileMonitorPrivate::emitFilesChanged()
+{
+    Q_Q(FileMonitor);
+
+    lastFilesChangedTime = QDateTime::currentDateTime();
+    changedFiles.subtract(completedFiles);
+    QStringList files = changedFiles.toList();
+    QStringList completed = completedFiles.toList();
+    changedFiles.clear();
+    completedFiles.clear();
+
+    /* They'll be recorded in the snapshot once the client commits it */
+    if (hasSnapshot) {
+        foreach (const QString &filePath, files + completed) {
+            reportedStamps.insert(filePath,
+                                  DirectoryScanner::stamp(filePath));
+        }
+    }
+
+    if (!completed.isEmpty()) Q_EMIT q->filesChanged(completed, true);
+    if (!files.isEmpty()) Q_EMIT q->filesChanged(files, false);
+}
+
 void FileMonitorPrivate::scheduleNotification()
 {
     if (signalTimer.isActive()) return;
@@ -104,14 +265,28 @@ void FileMonitorPrivate::scheduleNotification()
     }
 }
 
+void FileMonitorPrivate::addChangedFile(const QString &filePath,
+                                        bool complete)
+{
+    if (!scanner.isAccepted(filePath)) return;
+
+    FileStamp stamp = DirectoryScanner::stamp(filePath);
+    if (stamp.size <= 0) return;
+
+    if (complete) {
+        completedFiles.insert(filePath);
+    } else {
+        changedFiles.insert(filePath);
+    }
+    if (!filesChangedTimer.isActive()) filesChangedTimer.start();
+    scheduleNotification();
+}
+
 void FileMonitorPrivate::recurseAddPath(const QString &path)
 {
     if (path.isEmpty()) return;
 
-    if (!watcher->directories().contains(path)) {
-        DEBUG() << "watching" << path;
-        watcher->addPath(path);
-    }
+    addWatch(path);
 
     QDir dir(path);
     QStringList allDirs = dir.entryList(QDir::Dirs |
@@ -121,32 +296,319 @@ void FileMonitorPrivate::recurseAddPath(const QString &path)
     }
 }
 
+void FileMonitorPrivate::addWatch(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    if (inotifyFd >= 0) {
+        if (inotifyWatches.contains(path)) return;
+
+        int wd = inotify_add_watch(inotifyFd,
+                                   QFile::encodeName(path).constData(),
+                                   INOTIFY_EVENTS);
+        if (Q_UNLIKELY(wd < 0)) {
+            qWarning() << "Cannot watch" << path << strerror(errno);
+            return;
+        }
+        DEBUG() << "watching" << path;
+        inotifyPaths.insert(wd, path);
+        inotifyWatches.insert(path, wd);
+        return;
+    }
+#endif
+
+    if (!watchedPaths.contains(path)) {
+        DEBUG() << "watching" << path;
+        watcher->addPath(path);
+        watchedPaths.insert(path);
+    }
+}
+
+#ifdef Q_OS_LINUX
+bool FileMonitorPrivate::startInotify()
+{
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Q_UNLIKELY(inotifyFd < 0)) {
+        qWarning() << "inotify not available:" << strerror(errno);
+        return false;
+    }
+
+    inotifyNotifier = new QSocketNotifier(inotifyFd, QSocketNotifier::Read,
+                                          this);
+    QObject::connect(inotifyNotifier, SIGNAL(activated(int)),
+                     this, SLOT(onInotifyActivated()));
+    return true;
+}
+
+void FileMonitorPrivate::onInotifyActivated()
+{
+    char buffer[INOTIFY_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (inotifyFd >= 0) {
+        ssize_t length = ::read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) break;
+
+        const char *ptr = buffer;
+        while (ptr < buffer + length) {
+            const struct inotify_event *event =
+                reinterpret_cast<const struct inotify_event *>(ptr);
+            handleInotifyEvent(event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void FileMonitorPrivate::handleInotifyEvent(const struct inotify_event *event)
+{
+    if (Q_UNLIKELY(event->mask & IN_Q_OVERFLOW)) {
+        /* Some events were lost: find out what we missed the slow way */
+        qWarning() << "inotify queue overflow; rescanning" << basePath;
+        recurseAddPath(basePath);
+        foreach (const QString &filePath,
+                 filesChangedSince(lastFilesChangedTime, basePath)) {
+            addChangedFile(filePath, false);
+        }
+        return;
+    }
+
+    QHash<int, QString>::const_iterator i = inotifyPaths.find(event->wd);
+    if (i == inotifyPaths.end()) return;
+    QString dirPath = i.value();
+
+    if (event->mask & IN_IGNORED) {
+        /* The directory was deleted or moved away */
+        inotifyPaths.remove(event->wd);
+        if (inotifyWatches.value(dirPath, -1) == event->wd) {
+            inotifyWatches.remove(dirPath);
+        }
+        return;
+    }
+
+    if (event->len == 0) return;
+    QString path = dirPath + QDir::separator() +
+        QFile::decodeName(event->name);
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            /* Files might have been written into the new directory before
+             * we started watching it */
+            recurseAddPath(path);
+            foreach (const QString &filePath,
+                     filesChangedSince(QDateTime(), path)) {
+                addChangedFile(filePath, false);
+            }
+        } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+            removeWatches(path);
+            forgetPath(path, true);
+        }
+    } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+        forgetPath(path, false);
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        /* The writer is done with the file */
+        addChangedFile(path, true);
+    }
+}
+
+void FileMonitorPrivate::removeWatches(const QString &path)
+{
+    QString prefix = path + QDir::separator();
+    QMutableHashIterator<QString, int> i(inotifyWatches);
+    while (i.hasNext()) {
+        i.next();
+        if (i.key() != path && !i.key().startsWith(prefix)) continue;
+
+        inotify_rm_watch(inotifyFd, i.value());
+        inotifyPaths.remove(i.value());
+        i.remove();
+    }
+}
+#endif
+
+/* Files which are gone must not linger in the snapshot; forgetting a file
+ * is always safe, since at worst it will be checked again at the next
+ * run */
+void FileMonitorPrivate::forgetPath(const QString &path, bool isDir)
+{
+    if (!hasSnapshot) return;
+
+    int removed = snapshot.remove(path) + reportedStamps.remove(path);
+    if (isDir) {
+        QString prefix = path + QDir::separator();
+        QMutableHashIterator<QString, FileStamp> i(snapshot);
+        while (i.hasNext()) {
+            if (!i.next().key().startsWith(prefix)) continue;
+            i.remove();
+            removed++;
+        }
+    }
+
+    if (removed > 0 && !snapshotTimer.isActive()) snapshotTimer.start();
+}
+
 QStringList
 FileMonitorPrivate::filesChangedSince(const QDateTime &since,
                                       const QString &path) const
 {
+    ABC_TRACE_SCOPE("FileMonitor::filesChangedSince");
+
+    FileSnapshot allFiles = scanner.scan(path);
+
+    qint64 sinceTime = since.isValid() ?
+        since.toMSecsSinceEpoch() * 1000000 : 0;
     QStringList list;
+    list.reserve(allFiles.count());
+    FileSnapshot::const_iterator i;
+    for (i = allFiles.constBegin(); i != allFiles.constEnd(); i++) {
+        const FileStamp &stamp = i.value();
+        if (stamp.size == 0) continue;
 
-    QDir dir(path);
-    QFileInfoList allFiles = dir.entryInfoList(QDir::Files | QDir::Dirs |
-                                               QDir::NoDotAndDotDot |
-                                               QDir::Readable);
-    foreach (const QFileInfo &info, allFiles) {
-        if (info.isDir()) {
-            list += filesChangedSince(since, info.absoluteFilePath());
-        } else {
-            if (info.size() == 0) continue;
+        if (stamp.mtime > sinceTime) list.append(i.key());
+    }
+    return list;
+}
 
-            if ((acceptedExtensions.isEmpty() ||
-                    acceptedExtensions.contains(info.suffix().toLower())) &&
-                   info.lastModified() > since) {
-                list.append(info.absoluteFilePath());
-            }
+bool FileMonitorPrivate::loadSnapshot()
+{
+    snapshotLoaded = true;
+    if (snapshotPath.isEmpty() || basePath.isEmpty()) return false;
+
+    QFile file(snapshotPath);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_4_7);
+
+    quint32 magic, version;
+    QString snapshotBasePath;
+    in >> magic >> version >> snapshotBasePath;
+    if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) {
+        qWarning() << "Ignoring invalid snapshot" << snapshotPath;
+        return false;
+    }
+    /* The snapshot is of no use if the monitored tree has changed */
+    if (snapshotBasePath != basePath) return false;
+
+    quint32 count;
+    in >> count;
+    QString prefix = basePath + '/';
+    FileSnapshot loaded;
+    loaded.reserve(count);
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        QString relativePath;
+        FileStamp stamp;
+        in >> relativePath >> stamp;
+        loaded.insert(prefix + relativePath, stamp);
+    }
+
+    if (Q_UNLIKELY(in.status() != QDataStream::Ok)) {
+        qWarning() << "Snapshot" << snapshotPath << "is truncated";
+        return false;
+    }
+
+    DEBUG() << "Loaded snapshot of" << loaded.count() << "files";
+    snapshot = loaded;
+    hasSnapshot = true;
+    return true;
+}
+
+void FileMonitorPrivate::saveSnapshot()
+{
+    snapshotTimer.stop();
+    if (!hasSnapshot || snapshotPath.isEmpty()) return;
+
+    /* Write a new file, and replace the old one only when done */
+    QString tmpPath = snapshotPath + ".tmp";
+    QFile file(tmpPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Cannot write snapshot" << tmpPath;
+        return;
+    }
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_4_7);
+    out << quint32(SNAPSHOT_MAGIC) << quint32(SNAPSHOT_VERSION) << basePath;
+
+    /* Paths are stored relative to the base path, to save space */
+    int prefixLength = basePath.length() + 1;
+    out << quint32(snapshot.count());
+    FileSnapshot::const_iterator i;
+    for (i = snapshot.constBegin(); i != snapshot.constEnd(); i++) {
+        out << i.key().mid(prefixLength) << i.value();
+    }
+    file.close();
+
+    if (Q_UNLIKELY(out.status() != QDataStream::Ok ||
+                   file.error() != QFile::NoError)) {
+        qWarning() << "Error writing snapshot" << tmpPath;
+        QFile::remove(tmpPath);
+        return;
+    }
+
+    QFile::remove(snapshotPath);
+    if (!QFile::rename(tmpPath, snapshotPath)) {
+        qWarning() << "Cannot replace snapshot" << snapshotPath;
+    }
+}
+
+QStringList
+FileMonitorPrivate::filesChangedSinceSnapshot(const QDateTime &since)
+{
+    ABC_TRACE_SCOPE("FileMonitor::filesChangedSinceSnapshot");
+
+    if (!snapshotLoaded) loadSnapshot();
+
+    FileSnapshot current = scanner.scan(basePath);
+
+    qint64 sinceTime = since.isValid() ?
+        since.toMSecsSinceEpoch() * 1000000 : 0;
+    QStringList list;
+    FileSnapshot::const_iterator i;
+    for (i = current.constBegin(); i != current.constEnd(); i++) {
+        const FileStamp &stamp = i.value();
+        if (stamp.size == 0) continue;
+
+        if (hasSnapshot) {
+            FileSnapshot::const_iterator old = snapshot.constFind(i.key());
+            if (old != snapshot.constEnd() && old.value() == stamp) continue;
+        } else if (stamp.mtime <= sinceTime) {
+            continue;
         }
+        list.append(i.key());
     }
+
+    DEBUG() << list.count() << "of" << current.count() << "files changed";
+    /* Replacing the snapshot also drops the files which are gone */
+    scannedSnapshot = current;
+    hasScannedSnapshot = true;
+    reportedStamps.clear();
     return list;
 }
 
+void FileMonitorPrivate::commitSnapshot()
+{
+    if (hasScannedSnapshot) {
+        snapshot = scannedSnapshot;
+        scannedSnapshot.clear();
+        hasScannedSnapshot = false;
+        hasSnapshot = true;
+        saveSnapshot();
+    }
+
+    if (reportedStamps.isEmpty()) return;
+
+    FileSnapshot::const_iterator i;
+    for (i = reportedStamps.constBegin(); i != reportedStamps.constEnd();
+         i++) {
+        if (i.value().isValid()) {
+            snapshot.insert(i.key(), i.value());
+        } else {
+            snapshot.remove(i.key());
+        }
+    }
+    reportedStamps.clear();
+    if (!snapshotTimer.isActive()) snapshotTimer.start();
+}
+
 FileMonitor::FileMonitor(QObject *parent):
     QObject(parent),
     d_ptr(new FileMonitorPrivate(this))
@@ -171,10 +633,41 @@ QString FileMonitor::basePath() const
     return d->basePath;
 }
 
+bool FileMonitor::isIncremental() const
+{
+    Q_D(const FileMonitor);
+    return d->isIncremental();
+}
+
 void FileMonitor::setAcceptedExtensions(const QSet<QString> &extensions)
 {
     Q_D(FileMonitor);
-    d->acceptedExtensions = extensions;
+    d->scanner.setAcceptedExtensions(extensions);
+}
+
+void FileMonitor::setSnapshotPath(const QString &path)
+{
+    Q_D(FileMonitor);
+    d->snapshotPath = path;
+    d->snapshotLoaded = false;
+}
+
+QString FileMonitor::snapshotPath() const
+{
+    Q_D(const FileMonitor);
+    return d->snapshotPath;
+}
+
+QStringList FileMonitor::filesChangedSinceSnapshot(const QDateTime &since)
+{
+    Q_D(FileMonitor);
+    return d->filesChangedSinceSnapshot(since);
+}
+
+void FileMonitor::commitSnapshot()
+{
+    Q_D(FileMonitor);
+    d->commitSnapshot();
 }
 
 QStringList FileMonitor::filesChangedSince(const QDateTime &since) const
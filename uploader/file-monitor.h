@@ -30,12 +30,35 @@ public:
     void setBasePath(const QString &path);
     QString basePath() const;
 
+    /* Whether the filesChanged() signal reports all the changes; if not,
+     * clients must call filesChangedSince() when changed() is emitted. */
+    bool isIncremental() const;
+
     void setAcceptedExtensions(const QSet<QString> &extensions);
 
     QStringList filesChangedSince(const QDateTime &since) const;
 
+    /* The snapshot records the state of the monitored files, so that at
+     * the next run we can tell which of them have changed in the
+     * meantime. */
+    void setSnapshotPath(const QString &path);
+    QString snapshotPath() const;
+
+    /* Scans the tree and returns the files which differ from the snapshot;
+     * if there is no snapshot, returns the files modified after "since".
+     * The current state of the tree replaces the snapshot once committed. */
+    QStringList filesChangedSinceSnapshot(const QDateTime &since);
+    /* To be called once the files reported so far, by the method above or
+     * by filesChanged(), have been safely recorded: saving them in the
+     * snapshot earlier would make them look already seen at the next run,
+     * if we crashed before recording them. */
+    void commitSnapshot();
+
 Q_SIGNALS:
     void changed();
+    /* "complete" tells whether the files are known to have been
+     * completely written. */
+    void filesChanged(const QStringList &filePaths, bool complete);
 
 private:
     FileMonitorPrivate *d_ptr;
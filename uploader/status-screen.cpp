@@ -44,6 +44,24 @@ static QString errorMessageFromCode(Site::ErrorCode code)
     }
 }
 
+static QString throughputString(double bytesPerSecond)
+{
+    if (bytesPerSecond >= 1024 * 1024) {
+        return QObject::tr("%1 MB/s").
+            arg(bytesPerSecond / (1024 * 1024), 0, 'f', 1);
+    }
+    return QObject::tr("%1 KB/s").arg(int(bytesPerSecond / 1024));
+}
+
+static QString etaString(int seconds)
+{
+    if (seconds < 60) return QObject::tr("less than a minute left");
+    if (seconds < 3600) {
+        return QObject::tr("about %n minute(s) left", 0, seconds / 60);
+    }
+    return QObject::tr("about %n hour(s) left", 0, seconds / 3600);
+}
+
 StatusScreen::StatusScreen(QWidget *parent):
     QDialog(parent)
 {
@@ -99,6 +117,8 @@ StatusScreen::StatusScreen(QWidget *parent):
     QObject::connect(uploadQueue,
                      SIGNAL(statusChanged(UploadQueue::Status)),
                      this, SLOT(updateProgress()));
+    QObject::connect(uploadQueue, SIGNAL(statisticsChanged()),
+                     this, SLOT(updateProgress()));
     QObject::connect(uploadQueue,
                      SIGNAL(rowsInserted(const QModelIndex &, int, int)),
                      this, SLOT(updateProgress()));
@@ -133,7 +153,7 @@ void StatusScreen::setUpdate(const QString &version, const QUrl &fileUrl)
 void StatusScreen::updateProgress()
 {
     UploadQueue *uploadQueue = Application::instance()->uploadQueue();
-    int total = uploadQueue->rowCount();
+    int total = uploadQueue->itemCount();
     int completed;
     int inProgress;
     int failed;
@@ -145,8 +165,16 @@ void StatusScreen::updateProgress()
         progressBar->hide();
         errorLabel->hide();
     } else {
-        progressLabel->setText(tr("Uploaded %1 out of %2 files").
-                               arg(completed).arg(total));
+        QString text = tr("Uploaded %1 out of %2 files").
+            arg(completed).arg(total);
+        UploadQueue::Statistics statistics = uploadQueue->statistics();
+        if (inProgress > 0 && statistics.throughput > 0) {
+            text += "\n" + throughputString(statistics.throughput);
+            if (statistics.eta >= 0) {
+                text += ", " + etaString(statistics.eta);
+            }
+        }
+        progressLabel->setText(text);
         progressBar->setMaximum(total - failed);
         progressBar->setMinimum(0);
         progressBar->setValue(completed);
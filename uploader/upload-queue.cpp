@@ -16,76 +16,745 @@
 #include <ABC/UploadItem>
 #include <QDateTime>
 #include <QFileInfo>
+#include <QFutureWatcher>
 #include <QHash>
-#include <QQueue>
 #include <QSet>
 #include <QTimer>
+#include <QVector>
+#include <QtConcurrentMap>
+#include <algorithm>
+#include <limits>
+#include <math.h>
 
 #define MAX_UPLOADS 2
+/* Small files are grouped so that several of them share a single upload
+ * slot: their uploads then go out in parallel, reusing the persistent
+ * connections to the server instead of waiting for each other. */
+#define SMALL_FILE_SIZE     (1024 * 1024) // bytes
+#define SMALL_FILES_PER_UPLOAD  8
+#define MAX_UPLOAD_SLOTS    (MAX_UPLOADS * SMALL_FILES_PER_UPLOAD)
+/* Files not modified for this long are assumed to be complete */
 #define SAFE_UPLOAD_DELAY   10 // seconds
+/* Otherwise, a file is complete once its size and modification time stop
+ * changing; we check them at growing intervals */
+#define INITIAL_SETTLE_INTERVAL 1000 // milliseconds
+#define MAX_SETTLE_INTERVAL     16000 // milliseconds
 #define INITIAL_RETRY_TIME  2 // seconds
 #define MAX_RETRY_TIME      300 // seconds
+#define MAX_CHECKED_HASHES  100
+/* Checking the hash of a file compresses it, if compression is enabled:
+ * at most these many compressed copies wait to be uploaded */
+#define MAX_COMPRESSED_AHEAD    16
+#define MAX_PREPARED_ITEMS  MAX_UPLOADS
+/* Completed items are deleted, and only counted in the summary row. They
+ * are retired in batches, since retiring costs a pass over all the items;
+ * a batch is at least as large as the rest of the queue, so that the cost
+ * per item stays constant. */
+#define RETIRE_BATCH_SIZE   100
+#define RETIRE_DELAY        30 // seconds
+/* The throughput is an exponentially weighted moving average, with this
+ * time constant; the transfer statistics are sampled, and notified, at
+ * this interval. */
+#define THROUGHPUT_TIME_CONSTANT    10 // seconds
+#define STATISTICS_INTERVAL 1000 // milliseconds
+/* On fast connections, files which can be sent in this time count as
+ * small, even if larger than SMALL_FILE_SIZE */
+#define SMALL_FILE_UPLOAD_TIME  2 // seconds
 
 using namespace ABC;
 
 namespace ABC {
 
+/* What decides the upload order of an item; the first three fields are
+ * read from the file when the item first enters the queue (the type in the
+ * thread pool, since it might need opening the file). */
+struct PriorityKey {
+    PriorityKey(): typeRank(-1), lastModified(0), size(0), sequence(0) {}
+    bool isValid() const { return typeRank >= 0; }
+
+    int typeRank;
+    qint64 lastModified;
+    qint64 size;
+    quint64 sequence;
+};
+
+struct QueueEntry {
+    PriorityKey key;
+    UploadItem *item;
+};
+
+/* Orders the entries for std::push_heap() and std::pop_heap(), which
+ * keep the greatest element on top: an entry is "less" than another if it
+ * must be uploaded after it. */
+class ComesAfter
+{
+public:
+    ComesAfter(const QList<UploadQueue::PriorityRule> &rules): rules(rules) {}
+
+    bool operator()(const QueueEntry &a, const QueueEntry &b) const;
+
+private:
+    const QList<UploadQueue::PriorityRule> &rules;
+};
+
+/* A binary heap, whose top is the item to be uploaded first */
+class PriorityQueue
+{
+public:
+    PriorityQueue(const QList<UploadQueue::PriorityRule> &rules):
+        comesAfter(rules) {}
+
+    bool isEmpty() const { return entries.isEmpty(); }
+    void push(const QueueEntry &entry);
+    QueueEntry takeFirst();
+    /* Must be called when the rules change */
+    void reorder();
+
+private:
+    QVector<QueueEntry> entries;
+    ComesAfter comesAfter;
+};
+
 class UploadQueuePrivate: public QObject
 {
     Q_OBJECT
     Q_DECLARE_PUBLIC(UploadQueue)
 
+    enum ItemState {
+        Queued = 0,
+        InProgress,
+        Succeeded,
+        Failed,
+        RetryLater,
+        ItemStateCount
+    };
+
+    struct ItemInfo {
+        int row; // in "items", which follows the summary row
+        ItemState state;
+        PriorityKey key;
+        /* Of the current upload; until that starts, the total is the file
+         * size (if known) */
+        qint64 bytesSent;
+        qint64 bytesTotal;
+        double throughput; // negative if unknown
+        qint64 lastSampleTime;
+        qint64 lastSampleBytes;
+    };
+
+    /* Tracks a file which might still be being written */
+    struct SettleState {
+        SettleState(): size(-1), lastModified(0), interval(0), nextCheck(0) {}
+        qint64 size;
+        qint64 lastModified;
+        int interval;
+        qint64 nextCheck;
+    };
+
     UploadQueuePrivate(UploadQueue *q);
+    ~UploadQueuePrivate();
 
 public Q_SLOTS:
     void authenticate();
     void onAuthenticationStarted();
     void onAuthenticationFinished();
     void runQueue();
+    void checkSettlingItems();
     void retryFailed();
+    void retireSucceeded();
     void onProgressChanged(int progress);
+    void onBytesSentChanged(qint64 bytesSent, qint64 bytesTotal);
+    void updateStatistics();
+    void probeImageTypes();
+    void onImageTypesProbed();
+    void onHashesComputed();
+    void onHashesChecked(const QList<QByteArray> &hashes,
+                         const QList<QByteArray> &knownHashes);
 
 private:
+    void addItem(UploadItem *item);
+    static ItemState itemState(const UploadItem *item);
+    void updateItemState(ItemInfo &info, const UploadItem *item);
+    int firstItemRow() const { return retiredCount > 0 ? 1 : 0; }
+    void scheduleRetire();
+    static qint64 remainingBytes(const ItemInfo &info);
+    void setItemBytes(ItemInfo &info, qint64 bytesSent, qint64 bytesTotal);
+    static void addThroughputSample(double &throughput, qint64 bytes,
+                                    qint64 msecs);
+    static int eta(qint64 bytes, double throughput);
+    int itemEta(UploadItem *item) const;
+    void startStatistics();
+    static void readFileStamp(PriorityKey &key, const UploadItem *item);
+    static int typeRank(ImageType type);
+    static ImageType probeImageType(UploadItem *item);
+    void enqueue(UploadItem *item);
+    void waitForSettle(UploadItem *item, bool fileIsComplete);
+    void setFileComplete(UploadItem *item);
+    static bool fileIsSettled(const QString &filePath, SettleState &state,
+                              qint64 now);
+    void scheduleSettleCheck(qint64 nextCheck);
+    int uploadSlots(const QFileInfo &info) const;
+    void checkHashes();
+    static void computeHash(UploadItem *item);
+    void prepareNextItems();
     void setStatus(UploadQueue::Status status);
 
 private:
     UploadQueue::Status status;
-    /* "items" and "fileMap" must always be kept in sync */
+    /* "items", "fileMap" and "itemInfo" must always be kept in sync */
     QList<UploadItem *> items;
     QHash<QString, UploadItem *> fileMap;
-    QQueue<UploadItem *> queue;
-    QSet<UploadItem *> activeUploads;
+    QHash<UploadItem *, ItemInfo> itemInfo;
+    /* Number of items in each state, updated as their progress changes */
+    int itemCounts[ItemStateCount];
+    /* Completed items which have been deleted */
+    int retiredCount;
+    QTimer retireTimer;
+    /* Transfer statistics of the whole queue */
+    qint64 bytesRemaining;
+    qint64 bytesSent;
+    double throughput; // negative if unknown
+    qint64 lastSampleTime;
+    qint64 lastSampleBytes;
+    QTimer statisticsTimer;
+    QList<UploadQueue::PriorityRule> priorityRules;
+    /* The queued items waiting for their image type to be probed, and
+     * those being probed */
+    QList<UploadItem *> untypedItems;
+    QList<UploadItem *> typingItems;
+    QFutureWatcher<ImageType> typeWatcher;
+    QTimer typeTimer;
+    /* The queued items whose hash has not been checked against the server
+     * yet, and those which are ready to be uploaded */
+    PriorityQueue uncheckedQueue;
+    PriorityQueue readyQueue;
+    quint64 nextSequence;
+    /* Maps the active uploads to the number of slots they take */
+    QHash<UploadItem *, int> activeUploads;
+    int usedSlots;
     QSet<UploadItem *> retryItems;
-    QTimer runTimer;
+    /* Items which are not in the queue because their file might still be
+     * being written */
+    QHash<UploadItem *, SettleState> settlingItems;
+    QTimer settleTimer;
+    int settleInterval;
+    /* Items whose hash has been (or is being) checked against the server;
+     * the checked ones go to "readyQueue". One batch at a time is hashed
+     * (in the thread pool) and then checked. */
+    QSet<UploadItem *> checkedItems;
+    QList<UploadItem *> checkingItems;
+    QFutureWatcher<void> hashWatcher;
+    QList<QByteArray> requestedHashes;
     QTimer retryTimer;
     Site *site;
     Site::ErrorCode lastUploadError;
+    bool compressionEnabled;
     mutable UploadQueue *q_ptr;
 };
 
 } // namespace
 
+bool ComesAfter::operator()(const QueueEntry &a, const QueueEntry &b) const
+{
+    const PriorityKey &ka = a.key;
+    const PriorityKey &kb = b.key;
+
+    for (int i = 0; i < rules.count(); i++) {
+        switch (rules[i]) {
+        case UploadQueue::LightsFirst:
+            if (ka.typeRank != kb.typeRank) return ka.typeRank > kb.typeRank;
+            break;
+        case UploadQueue::NewestFirst:
+            if (ka.lastModified != kb.lastModified) {
+                return ka.lastModified < kb.lastModified;
+            }
+            break;
+        case UploadQueue::SmallestFirst:
+            if (ka.size != kb.size) return ka.size > kb.size;
+            break;
+        }
+    }
+
+    return ka.sequence > kb.sequence;
+}
+
+void PriorityQueue::push(const QueueEntry &entry)
+{
+    entries.append(entry);
+    std::push_heap(entries.begin(), entries.end(), comesAfter);
+}
+
+QueueEntry PriorityQueue::takeFirst()
+{
+    std::pop_heap(entries.begin(), entries.end(), comesAfter);
+    QueueEntry entry = entries.last();
+    entries.removeLast();
+    return entry;
+}
+
+void PriorityQueue::reorder()
+{
+    std::make_heap(entries.begin(), entries.end(), comesAfter);
+}
+
 UploadQueuePrivate::UploadQueuePrivate(UploadQueue *q):
     QObject(q),
     status(UploadQueue::Idle),
+    retiredCount(0),
+    bytesRemaining(0),
+    bytesSent(0),
+    throughput(-1),
+    lastSampleTime(0),
+    lastSampleBytes(0),
+    uncheckedQueue(priorityRules),
+    readyQueue(priorityRules),
+    nextSequence(0),
+    usedSlots(0),
+    settleInterval(INITIAL_SETTLE_INTERVAL),
     site(new Site(this)),
     lastUploadError(Site::NoError),
+    compressionEnabled(false),
     q_ptr(q)
 {
-    runTimer.setSingleShot(true);
-    runTimer.setInterval(SAFE_UPLOAD_DELAY * 1000);
-    QObject::connect(&runTimer, SIGNAL(timeout()),
-                     this, SLOT(runQueue()));
+    for (int i = 0; i < ItemStateCount; i++) {
+        itemCounts[i] = 0;
+    }
+
+    priorityRules << UploadQueue::LightsFirst << UploadQueue::NewestFirst;
+
+    settleTimer.setSingleShot(true);
+    QObject::connect(&settleTimer, SIGNAL(timeout()),
+                     this, SLOT(checkSettlingItems()));
+
+    retireTimer.setSingleShot(true);
+    retireTimer.setInterval(RETIRE_DELAY * 1000);
+    QObject::connect(&retireTimer, SIGNAL(timeout()),
+                     this, SLOT(retireSucceeded()));
+
+    statisticsTimer.setInterval(STATISTICS_INTERVAL);
+    QObject::connect(&statisticsTimer, SIGNAL(timeout()),
+                     this, SLOT(updateStatistics()));
 
     retryTimer.setSingleShot(true);
     retryTimer.setInterval(INITIAL_RETRY_TIME * 1000);
     QObject::connect(&retryTimer, SIGNAL(timeout()),
                      this, SLOT(retryFailed()));
 
+    /* Requests coming in a burst are probed together */
+    typeTimer.setSingleShot(true);
+    typeTimer.setInterval(0);
+    QObject::connect(&typeTimer, SIGNAL(timeout()),
+                     this, SLOT(probeImageTypes()));
+    QObject::connect(&typeWatcher, SIGNAL(finished()),
+                     this, SLOT(onImageTypesProbed()));
+
+    QObject::connect(&hashWatcher, SIGNAL(finished()),
+                     this, SLOT(onHashesComputed()));
+
     QObject::connect(site, SIGNAL(authenticationStarted()),
                      this, SLOT(onAuthenticationStarted()));
     QObject::connect(site, SIGNAL(authenticationFinished()),
                      this, SLOT(onAuthenticationFinished()));
+    QObject::connect(site,
+                     SIGNAL(hashesChecked(const QList<QByteArray> &,
+                                          const QList<QByteArray> &)),
+                     this,
+                     SLOT(onHashesChecked(const QList<QByteArray> &,
+                                          const QList<QByteArray> &)));
+}
+
+UploadQueuePrivate::~UploadQueuePrivate()
+{
+    /* The items being probed or hashed are still in use by the thread
+     * pool */
+    typeWatcher.waitForFinished();
+    hashWatcher.waitForFinished();
+}
+
+void UploadQueuePrivate::addItem(UploadItem *item)
+{
+    ItemInfo info;
+    info.row = items.count();
+    info.state = itemState(item);
+    info.key.sequence = nextSequence++;
+    info.bytesSent = 0;
+    info.bytesTotal = 0;
+    info.throughput = -1;
+    info.lastSampleTime = 0;
+    info.lastSampleBytes = 0;
+
+    items.append(item);
+    fileMap.insert(item->filePath(), item);
+    itemInfo.insert(item, info);
+    itemCounts[info.state]++;
+}
+
+UploadQueuePrivate::ItemState
+UploadQueuePrivate::itemState(const UploadItem *item)
+{
+    int progress = item->progress();
+    if (progress >= 100) return Succeeded;
+    if (progress > 0) return InProgress;
+    if (progress < 0) {
+        return item->errorIsRecoverable() ? RetryLater : Failed;
+    }
+    return Queued;
+}
+
+void UploadQueuePrivate::updateItemState(ItemInfo &info,
+                                         const UploadItem *item)
+{
+    ItemState state = itemState(item);
+    if (state == info.state) return;
+
+    itemCounts[info.state]--;
+    itemCounts[state]++;
+    bytesRemaining -= remainingBytes(info);
+    info.state = state;
+    bytesRemaining += remainingBytes(info);
+}
+
+/* The bytes which still need to be sent for the item */
+qint64 UploadQueuePrivate::remainingBytes(const ItemInfo &info)
+{
+    if (info.state == Succeeded || info.state == Failed) return 0;
+    return qMax(info.bytesTotal - info.bytesSent, Q_INT64_C(0));
+}
+
+void UploadQueuePrivate::setItemBytes(ItemInfo &info,
+                                      qint64 bytesSent, qint64 bytesTotal)
+{
+    if (bytesSent > info.bytesSent) {
+        this->bytesSent += bytesSent - info.bytesSent;
+    }
+
+    bytesRemaining -= remainingBytes(info);
+    info.bytesSent = bytesSent;
+    info.bytesTotal = bytesTotal;
+    bytesRemaining += remainingBytes(info);
+}
+
+void UploadQueuePrivate::addThroughputSample(double &throughput,
+                                             qint64 bytes, qint64 msecs)
+{
+    if (msecs <= 0) return;
+
+    double rate = qMax(bytes, Q_INT64_C(0)) * 1000.0 / msecs;
+    if (throughput < 0) {
+        throughput = rate;
+    } else {
+        /* Weigh the sample by the time it covers */
+        double alpha = 1.0 - exp(-msecs / (THROUGHPUT_TIME_CONSTANT * 1000.0));
+        throughput += alpha * (rate - throughput);
+    }
+}
+
+int UploadQueuePrivate::eta(qint64 bytes, double throughput)
+{
+    if (bytes <= 0) return 0;
+    if (throughput <= 0) return -1;
+    return int(qMin(ceil(bytes / throughput),
+                    double(std::numeric_limits<int>::max())));
+}
+
+int UploadQueuePrivate::itemEta(UploadItem *item) const
+{
+    if (!activeUploads.contains(item)) return -1;
+
+    ItemInfo info = itemInfo.value(item);
+    return eta(remainingBytes(info), info.throughput);
+}
+
+void UploadQueuePrivate::startStatistics()
+{
+    if (statisticsTimer.isActive()) return;
+
+    lastSampleTime = QDateTime::currentMSecsSinceEpoch();
+    lastSampleBytes = bytesSent;
+    statisticsTimer.start();
+}
+
+/* Sample the throughput, and notify the changes of the running uploads */
+void UploadQueuePrivate::updateStatistics()
+{
+    Q_Q(UploadQueue);
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QHash<UploadItem *, int>::const_iterator u;
+    for (u = activeUploads.constBegin(); u != activeUploads.constEnd(); u++) {
+        QHash<UploadItem *, ItemInfo>::iterator i = itemInfo.find(u.key());
+        if (Q_UNLIKELY(i == itemInfo.end())) continue;
+
+        ItemInfo &info = i.value();
+        addThroughputSample(info.throughput,
+                            info.bytesSent - info.lastSampleBytes,
+                            now - info.lastSampleTime);
+        info.lastSampleTime = now;
+        info.lastSampleBytes = info.bytesSent;
+
+        /* One row at a time: the rows in between are not changing */
+        QModelIndex index = q->index(firstItemRow() + info.row, 0);
+        Q_EMIT q->dataChanged(index, index);
+    }
+
+    addThroughputSample(throughput, bytesSent - lastSampleBytes,
+                        now - lastSampleTime);
+    lastSampleTime = now;
+    lastSampleBytes = bytesSent;
+
+    Q_EMIT q->statisticsChanged();
+
+    if (activeUploads.isEmpty()) statisticsTimer.stop();
+}
+
+int UploadQueuePrivate::typeRank(ImageType type)
+{
+    switch (type) {
+    case Light: return 0;
+    case UnknownType: return 1;
+    default: return 2; // calibration frames
+    }
+}
+
+void UploadQueuePrivate::readFileStamp(PriorityKey &key,
+                                       const UploadItem *item)
+{
+    QFileInfo info(item->filePath());
+    if (info.exists()) {
+        key.lastModified = info.lastModified().toMSecsSinceEpoch();
+        key.size = info.size();
+    } else {
+        /* Like uploadSlots(), assume that the file is large */
+        key.lastModified = 0;
+        key.size = std::numeric_limits<qint64>::max();
+    }
+}
+
+void UploadQueuePrivate::enqueue(UploadItem *item)
+{
+    QHash<UploadItem *, ItemInfo>::iterator i = itemInfo.find(item);
+    Q_ASSERT(i != itemInfo.end());
+
+    ItemInfo &info = i.value();
+    if (!info.key.isValid()) {
+        readFileStamp(info.key, item);
+        if (info.key.size != std::numeric_limits<qint64>::max()) {
+            setItemBytes(info, 0, info.key.size);
+        }
+
+        if (!item->isImageTypeKnown()) {
+            untypedItems.append(item);
+            if (typingItems.isEmpty()) typeTimer.start();
+            return;
+        }
+        info.key.typeRank = typeRank(item->imageType());
+    }
+
+    QueueEntry entry;
+    entry.key = info.key;
+    entry.item = item;
+
+    if (checkedItems.contains(item)) {
+        readyQueue.push(entry);
+    } else {
+        uncheckedQueue.push(entry);
+    }
+}
+
+void UploadQueuePrivate::probeImageTypes()
+{
+    if (!typingItems.isEmpty() || untypedItems.isEmpty()) return;
+
+    typingItems = untypedItems;
+    untypedItems.clear();
+    typeWatcher.setFuture(QtConcurrent::mapped(typingItems, probeImageType));
+}
+
+/* Runs in the thread pool: the item is not modified there, the type is
+ * set on the main thread when the batch is done */
+ImageType UploadQueuePrivate::probeImageType(UploadItem *item)
+{
+    return item->probeImageType();
+}
+
+void UploadQueuePrivate::onImageTypesProbed()
+{
+    Q_Q(UploadQueue);
+
+    /* A stale notification, for a batch already handled */
+    if (typingItems.isEmpty() || typeWatcher.isRunning()) return;
+
+    for (int k = 0; k < typingItems.count(); k++) {
+        UploadItem *item = typingItems[k];
+        QHash<UploadItem *, ItemInfo>::iterator i = itemInfo.find(item);
+        if (Q_UNLIKELY(i == itemInfo.end())) continue;
+
+        ImageType type = typeWatcher.resultAt(k);
+        item->setImageType(type);
+        i.value().key.typeRank = typeRank(type);
+        enqueue(item);
+
+        /* The type can now be saved together with the queued item */
+        QModelIndex index = q->index(firstItemRow() + i.value().row, 0);
+        Q_EMIT q->dataChanged(index, index);
+    }
+    typingItems.clear();
+
+    probeImageTypes();
+    if (site->isAuthenticated()) runQueue();
+}
+
+void UploadQueuePrivate::scheduleRetire()
+{
+    int succeeded = itemCounts[Succeeded];
+    if (succeeded >= RETIRE_BATCH_SIZE &&
+        succeeded >= items.count() - succeeded) {
+        retireSucceeded();
+    } else if (!retireTimer.isActive()) {
+        retireTimer.start();
+    }
+}
+
+/* Delete the completed items, and add them to the summary row */
+void UploadQueuePrivate::retireSucceeded()
+{
+    Q_Q(UploadQueue);
+
+    retireTimer.stop();
+    if (itemCounts[Succeeded] == 0) return;
+
+    if (retiredCount == 0) {
+        q->beginInsertRows(QModelIndex(), 0, 0);
+        retiredCount = itemCounts[Succeeded];
+        q->endInsertRows();
+    } else {
+        retiredCount += itemCounts[Succeeded];
+        QModelIndex summaryIndex = q->index(0, 0);
+        Q_EMIT q->dataChanged(summaryIndex, summaryIndex);
+    }
+    itemCounts[Succeeded] = 0;
+
+    /* Remove the rows in contiguous blocks, starting from the last one */
+    int last = items.count() - 1;
+    while (last >= 0) {
+        if (itemInfo.value(items[last]).state != Succeeded) {
+            last--;
+            continue;
+        }
+
+        int first = last;
+        while (first > 0 &&
+               itemInfo.value(items[first - 1]).state == Succeeded) {
+            first--;
+        }
+
+        q->beginRemoveRows(QModelIndex(),
+                           firstItemRow() + first, firstItemRow() + last);
+        for (int i = first; i <= last; i++) {
+            UploadItem *item = items[i];
+            fileMap.remove(item->filePath());
+            itemInfo.remove(item);
+            checkedItems.remove(item);
+            item->disconnect(this);
+            item->deleteLater();
+        }
+        items.erase(items.begin() + first, items.begin() + last + 1);
+        q->endRemoveRows();
+
+        last = first - 1;
+    }
+
+    for (int i = 0; i < items.count(); i++) {
+        itemInfo[items[i]].row = i;
+    }
+}
+
+void UploadQueuePrivate::waitForSettle(UploadItem *item, bool fileIsComplete)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    SettleState state;
+    if (fileIsComplete || fileIsSettled(item->filePath(), state, now)) {
+        enqueue(item);
+        return;
+    }
+
+    state.interval = settleInterval;
+    state.nextCheck = now + state.interval;
+    settlingItems.insert(item, state);
+    scheduleSettleCheck(state.nextCheck);
+}
+
+void UploadQueuePrivate::setFileComplete(UploadItem *item)
+{
+    if (settlingItems.remove(item) == 0) return;
+
+    enqueue(item);
+    authenticate();
+}
+
+/* Returns true if the file looks complete; otherwise, stores its current
+ * size and modification time into "state" */
+bool UploadQueuePrivate::fileIsSettled(const QString &filePath,
+                                       SettleState &state, qint64 now)
+{
+    QFileInfo info(filePath);
+    /* There's nothing to wait for: the upload will report the error */
+    if (!info.exists()) return true;
+
+    qint64 lastModified = info.lastModified().toMSecsSinceEpoch();
+    if (lastModified < now - SAFE_UPLOAD_DELAY * 1000) return true;
+
+    if (info.size() == state.size && lastModified == state.lastModified) {
+        return true;
+    }
+
+    state.size = info.size();
+    state.lastModified = lastModified;
+    return false;
+}
+
+void UploadQueuePrivate::scheduleSettleCheck(qint64 nextCheck)
+{
+    qint64 delay = nextCheck - QDateTime::currentMSecsSinceEpoch();
+    if (delay < 0) delay = 0;
+
+    if (settleTimer.isActive() && settleTimer.interval() <= delay) return;
+    settleTimer.start(delay);
+}
+
+void UploadQueuePrivate::checkSettlingItems()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 nextCheck = 0;
+    bool settled = false;
+
+    QMutableHashIterator<UploadItem *, SettleState> i(settlingItems);
+    while (i.hasNext()) {
+        i.next();
+        SettleState &state = i.value();
+        if (state.nextCheck <= now) {
+            if (fileIsSettled(i.key()->filePath(), state, now)) {
+                DEBUG() << "File complete:" << i.key()->fileName();
+                enqueue(i.key());
+                i.remove();
+                settled = true;
+                continue;
+            }
+
+            /* Back off, for files which take long to be written */
+            state.interval = qMin(state.interval * 2,
+                                  qMax(settleInterval, MAX_SETTLE_INTERVAL));
+            state.nextCheck = now + state.interval;
+        }
+
+        if (nextCheck == 0 || state.nextCheck < nextCheck) {
+            nextCheck = state.nextCheck;
+        }
+    }
+
+    if (nextCheck != 0) scheduleSettleCheck(nextCheck);
+    if (settled) authenticate();
 }
 
 void UploadQueuePrivate::authenticate()
@@ -115,45 +784,162 @@ void UploadQueuePrivate::onAuthenticationFinished()
     runQueue();
 }
 
+int UploadQueuePrivate::uploadSlots(const QFileInfo &info) const
+{
+    qint64 smallFileSize = qMax(qint64(SMALL_FILE_SIZE),
+                                qint64(throughput * SMALL_FILE_UPLOAD_TIME));
+    /* If we cannot tell the size, assume that the file is large */
+    return (info.exists() && info.size() <= smallFileSize) ?
+        1 : SMALL_FILES_PER_UPLOAD;
+}
+
 void UploadQueuePrivate::runQueue()
 {
-    if (activeUploads.count() >= MAX_UPLOADS) return;
-    if (queue.isEmpty()) {
-        setStatus(UploadQueue::Idle);
+    /* The next files are checked while the ready ones are uploaded */
+    checkHashes();
+
+    if (usedSlots >= MAX_UPLOAD_SLOTS) return;
+    if (readyQueue.isEmpty()) {
+        setStatus(checkingItems.isEmpty() ?
+                  UploadQueue::Idle : UploadQueue::Uploading);
         return;
     }
 
-    QDateTime safeUploadTime =
-        QDateTime::currentDateTimeUtc().addSecs(-SAFE_UPLOAD_DELAY);
-    int rescheduled = 0;
-    int numItems = queue.count();
     do {
         setStatus(UploadQueue::Uploading);
-        UploadItem *item = queue.dequeue();
-        /* Check that the file hasn't been modified in the last few seconds
-         * (because otherwise it might not be complete) */
-        QFileInfo info(item->filePath());
-        if (info.lastModified() > safeUploadTime) {
-            // push the item at the end of the queue
-            queue.enqueue(item);
-            rescheduled++;
+        QueueEntry entry = readyQueue.takeFirst();
+        UploadItem *item = entry.item;
+        int slots = uploadSlots(QFileInfo(item->filePath()));
+        if (usedSlots + slots > MAX_UPLOAD_SLOTS) {
+            /* Wait for the running uploads to free enough slots */
+            readyQueue.push(entry);
+            break;
         } else {
-            activeUploads.insert(item);
+            activeUploads.insert(item, slots);
+            usedSlots += slots;
+
+            ItemInfo &info = itemInfo[item];
+            setItemBytes(info, 0, info.bytesTotal);
+            info.throughput = -1;
+            info.lastSampleTime = QDateTime::currentMSecsSinceEpoch();
+            info.lastSampleBytes = 0;
+            startStatistics();
+
             item->startUpload(site);
         }
-    } while (activeUploads.count() < MAX_UPLOADS &&
-             rescheduled < numItems &&
-             !queue.isEmpty());
+    } while (usedSlots < MAX_UPLOAD_SLOTS && !readyQueue.isEmpty());
 
     if (activeUploads.isEmpty()) {
         setStatus(UploadQueue::Idle);
     }
 
-    /* If all items were rescheduled, it means that no files can be
-     * safely uploaded at the moment; in that case, let's try again after
-     * some time. */
-    if (rescheduled >= numItems && !runTimer.isActive()) {
-        runTimer.start();
+    prepareNextItems();
+}
+
+/* Start hashing a batch of the queued files which haven't been checked
+ * yet, in order to ask the server whether it already has them. If the
+ * server cannot tell, the files are just uploaded (and hashed by the items
+ * themselves, ahead of their upload). */
+void UploadQueuePrivate::checkHashes()
+{
+    if (!checkingItems.isEmpty() || uncheckedQueue.isEmpty()) return;
+
+    if (!site->canCheckHashes()) {
+        while (!uncheckedQueue.isEmpty()) {
+            QueueEntry entry = uncheckedQueue.takeFirst();
+            checkedItems.insert(entry.item);
+            readyQueue.push(entry);
+        }
+        return;
+    }
+
+    int maxItems = compressionEnabled ?
+        MAX_COMPRESSED_AHEAD - readyQueue.count() : MAX_CHECKED_HASHES;
+    while (!uncheckedQueue.isEmpty() && checkingItems.count() < maxItems) {
+        UploadItem *item = uncheckedQueue.takeFirst().item;
+        checkingItems.append(item);
+        checkedItems.insert(item);
+    }
+
+    if (checkingItems.isEmpty()) return;
+
+    setStatus(UploadQueue::Uploading);
+    hashWatcher.setFuture(QtConcurrent::map(checkingItems, computeHash));
+}
+
+/* Runs in the thread pool */
+void UploadQueuePrivate::computeHash(UploadItem *item)
+{
+    item->computeHash();
+}
+
+void UploadQueuePrivate::onHashesComputed()
+{
+    requestedHashes.clear();
+    QList<UploadItem *> unreadable;
+    foreach (UploadItem *item, checkingItems) {
+        if (item->fileHash().isEmpty()) {
+            /* The upload will report the error */
+            unreadable.append(item);
+        } else {
+            requestedHashes.append(item->fileHash());
+        }
+    }
+
+    foreach (UploadItem *item, unreadable) {
+        checkingItems.removeOne(item);
+        enqueue(item);
+    }
+
+    if (!checkingItems.isEmpty()) {
+        DEBUG() << "Checking" << requestedHashes.count() << "hashes";
+        site->checkHashes(requestedHashes);
+    }
+
+    runQueue();
+}
+
+void UploadQueuePrivate::onHashesChecked(const QList<QByteArray> &hashes,
+                                         const QList<QByteArray> &knownHashes)
+{
+    /* Not the reply to the request in progress */
+    if (hashWatcher.isRunning() || checkingItems.isEmpty() ||
+        hashes != requestedHashes) {
+        DEBUG() << "Ignoring unexpected hash check reply";
+        return;
+    }
+
+    QSet<QByteArray> known = knownHashes.toSet();
+
+    /* Put the items back into the queue: their priority is unchanged */
+    foreach (UploadItem *item, checkingItems) {
+        if (known.contains(item->fileHash())) {
+            DEBUG() << "Server already has" << item->fileName();
+            item->setContentKnown(true);
+            /* Only the file path will be sent */
+            setItemBytes(itemInfo[item], 0, 0);
+        }
+        enqueue(item);
+    }
+    checkingItems.clear();
+    requestedHashes.clear();
+
+    runQueue();
+}
+
+/* Let the items which will be uploaded next prepare their files (that is,
+ * compress and hash them) while the current uploads are running. */
+void UploadQueuePrivate::prepareNextItems()
+{
+    QList<QueueEntry> nextEntries;
+    while (nextEntries.count() < MAX_PREPARED_ITEMS &&
+           !readyQueue.isEmpty()) {
+        nextEntries.append(readyQueue.takeFirst());
+    }
+
+    foreach (const QueueEntry &entry, nextEntries) {
+        entry.item->prepare();
+        readyQueue.push(entry);
     }
 }
 
@@ -162,7 +948,7 @@ void UploadQueuePrivate::retryFailed()
     /* Put all failed items back into the queue, if the error is
      * recoverable */
     foreach (UploadItem *item, retryItems) {
-        queue.enqueue(item);
+        enqueue(item);
     }
 
     /* Increase the retry interval; note that this doesn't start the
@@ -178,19 +964,23 @@ void UploadQueuePrivate::onProgressChanged(int progress)
 {
     Q_Q(UploadQueue);
 
+    UploadItem *item = qobject_cast<UploadItem *>(sender());
+    if (item == 0) return;
+
+    QHash<UploadItem *, ItemInfo>::iterator i = itemInfo.find(item);
+    if (i == itemInfo.end()) return;
+
+    updateItemState(i.value(), item);
+
     if (progress > 0 && progress < 100) {
         /* At the moment, we are not interested in the download progress
          * of a single file. */
         return;
     }
 
-    UploadItem *item = qobject_cast<UploadItem *>(sender());
-    if (item == 0) return;
+    int index = i.value().row;
 
-    int index = items.indexOf(item);
-    if (index < 0) return;
-
-    activeUploads.remove(item);
+    usedSlots -= activeUploads.take(item);
 
     if (item->progress() < 0) {
         lastUploadError = item->lastError();
@@ -207,10 +997,26 @@ void UploadQueuePrivate::onProgressChanged(int progress)
         }
     }
 
-    QModelIndex modelIndex = q->index(index, 0);
+    QModelIndex modelIndex = q->index(firstItemRow() + index, 0);
     Q_EMIT q->dataChanged(modelIndex, modelIndex);
+    if (item->progress() >= 100) Q_EMIT q->itemUploaded(item);
 
     runQueue();
+
+    if (item->progress() >= 100) scheduleRetire();
+}
+
+void UploadQueuePrivate::onBytesSentChanged(qint64 bytesSent,
+                                            qint64 bytesTotal)
+{
+    UploadItem *item = qobject_cast<UploadItem *>(sender());
+    if (item == 0) return;
+
+    QHash<UploadItem *, ItemInfo>::iterator i = itemInfo.find(item);
+    if (i == itemInfo.end()) return;
+
+    /* The changes are notified by updateStatistics() */
+    setItemBytes(i.value(), bytesSent, bytesTotal);
 }
 
 void UploadQueuePrivate::setStatus(UploadQueue::Status status)
@@ -242,31 +1048,85 @@ Site *UploadQueue::site() const
 }
 
 void UploadQueue::requestUpload(const QString &filePath,
-                                const QString &fileName)
+                                const QString &fileName,
+                                bool fileIsComplete,
+                                ImageType imageType)
 {
     Q_D(UploadQueue);
 
-    if (d->fileMap.contains(filePath)) {
+    QHash<QString, UploadItem *>::const_iterator i =
+        d->fileMap.constFind(filePath);
+    if (i != d->fileMap.constEnd()) {
         /* TODO: if the upload is in progress, check the file's last
          * modification time and, if needed, re-start the download. */
+        if (fileIsComplete) d->setFileComplete(i.value());
         return;
     }
 
     UploadItem *item = new UploadItem(filePath, fileName, this);
+    if (imageType != UnknownType) item->setImageType(imageType);
+    item->setCompressionEnabled(d->compressionEnabled);
     QObject::connect(item, SIGNAL(progressChanged(int)),
                      d, SLOT(onProgressChanged(int)));
+    QObject::connect(item, SIGNAL(bytesSentChanged(qint64, qint64)),
+                     d, SLOT(onBytesSentChanged(qint64, qint64)));
 
     QModelIndex root;
     int index = rowCount(root);
     beginInsertRows(root, index, index);
-    d->items.append(item);
-    d->fileMap.insert(filePath, item);
-    d->queue.enqueue(item);
+    d->addItem(item);
+    d->waitForSettle(item, fileIsComplete);
     endInsertRows();
 
     d->authenticate();
 }
 
+void UploadQueue::setCompressionEnabled(bool enabled)
+{
+    Q_D(UploadQueue);
+
+    if (enabled == d->compressionEnabled) return;
+    d->compressionEnabled = enabled;
+
+    foreach (UploadItem *item, d->items) {
+        item->setCompressionEnabled(enabled);
+    }
+}
+
+bool UploadQueue::compressionEnabled() const
+{
+    Q_D(const UploadQueue);
+    return d->compressionEnabled;
+}
+
+void UploadQueue::setSettleInterval(int msecs)
+{
+    Q_D(UploadQueue);
+    d->settleInterval = msecs;
+}
+
+int UploadQueue::settleInterval() const
+{
+    Q_D(const UploadQueue);
+    return d->settleInterval;
+}
+
+void UploadQueue::setPriorityRules(const QList<PriorityRule> &rules)
+{
+    Q_D(UploadQueue);
+
+    if (rules == d->priorityRules) return;
+    d->priorityRules = rules;
+    d->uncheckedQueue.reorder();
+    d->readyQueue.reorder();
+}
+
+QList<UploadQueue::PriorityRule> UploadQueue::priorityRules() const
+{
+    Q_D(const UploadQueue);
+    return d->priorityRules;
+}
+
 UploadQueue::Status UploadQueue::status() const
 {
     Q_D(const UploadQueue);
@@ -279,33 +1139,40 @@ Site::ErrorCode UploadQueue::lastUploadError() const
     return d->lastUploadError;
 }
 
+int UploadQueue::itemCount() const
+{
+    Q_D(const UploadQueue);
+    return d->items.count() + d->retiredCount;
+}
+
 void UploadQueue::itemsStatus(int *succeeded, int *inProgress,
                               int *failed, int *retryLater) const
 {
     Q_D(const UploadQueue);
 
-    int l_succeeded = 0;
-    int l_inProgress = 0;
-    int l_failed = 0;
-    int l_retryLater = 0;
-
-    foreach (const UploadItem *item, d->items) {
-        int progress = item->progress();
-        if (progress >= 100) l_succeeded++;
-        else if (progress > 0) l_inProgress++;
-        else if (progress < 0) {
-            if (item->errorIsRecoverable()) {
-                l_retryLater++;
-            } else {
-                l_failed++;
-            }
-        }
+    if (succeeded) {
+        *succeeded = d->itemCounts[UploadQueuePrivate::Succeeded] +
+            d->retiredCount;
     }
+    if (inProgress) {
+        *inProgress = d->itemCounts[UploadQueuePrivate::InProgress];
+    }
+    if (failed) *failed = d->itemCounts[UploadQueuePrivate::Failed];
+    if (retryLater) {
+        *retryLater = d->itemCounts[UploadQueuePrivate::RetryLater];
+    }
+}
 
-    if (succeeded) *succeeded = l_succeeded;
-    if (inProgress) *inProgress = l_inProgress;
-    if (failed) *failed = l_failed;
-    if (retryLater) *retryLater = l_retryLater;
+UploadQueue::Statistics UploadQueue::statistics() const
+{
+    Q_D(const UploadQueue);
+
+    Statistics statistics;
+    statistics.throughput = qMax(d->throughput, 0.0);
+    statistics.bytesSent = d->bytesSent;
+    statistics.bytesRemaining = d->bytesRemaining;
+    statistics.eta = UploadQueuePrivate::eta(d->bytesRemaining, d->throughput);
+    return statistics;
 }
 
 QVariant UploadQueue::data(const QModelIndex &index, int role) const
@@ -314,7 +1181,21 @@ QVariant UploadQueue::data(const QModelIndex &index, int role) const
 
     if (!index.isValid()) return QVariant();
 
-    UploadItem *item = d->items[index.row()];
+    if (index.row() < d->firstItemRow()) {
+        /* The summary of the completed uploads */
+        switch (role) {
+        case Qt::DisplayRole:
+            return tr("%n files uploaded", 0, d->retiredCount);
+        case ProgressRole:
+            return 100;
+        case ItemCountRole:
+            return d->retiredCount;
+        default:
+            return QVariant();
+        }
+    }
+
+    UploadItem *item = d->items[index.row() - d->firstItemRow()];
 
     switch (role) {
     case Qt::DisplayRole:
@@ -324,6 +1205,17 @@ QVariant UploadQueue::data(const QModelIndex &index, int role) const
         return item->progress();
     case UploadItemRole:
         return QVariant::fromValue(item);
+    case ItemCountRole:
+        return 1;
+    case BytesSentRole:
+        return d->itemInfo.value(item).bytesSent;
+    case BytesTotalRole:
+        return d->itemInfo.value(item).bytesTotal;
+    case ThroughputRole:
+        if (!d->activeUploads.contains(item)) return 0.0;
+        return qMax(d->itemInfo.value(item).throughput, 0.0);
+    case EtaRole:
+        return d->itemEta(item);
     default:
         break;
     }
@@ -335,7 +1227,7 @@ int UploadQueue::rowCount(const QModelIndex &parent) const
 {
     Q_D(const UploadQueue);
     Q_UNUSED(parent);
-    return d->items.count();
+    return d->firstItemRow() + d->items.count();
 }
 
 #include "upload-queue.moc"
@@ -10,11 +10,13 @@
 #ifndef ABC_UPLOAD_QUEUE_H
 #define ABC_UPLOAD_QUEUE_H
 
+#include <ABC/Image>
 #include <ABC/Site>
 #include <QAbstractListModel>
 
 namespace ABC {
 
+class UploadItem;
 class UploadQueuePrivate;
 class UploadQueue: public QAbstractListModel
 {
@@ -24,6 +26,17 @@ public:
     enum Roles {
         ProgressRole = Qt::UserRole,
         UploadItemRole,
+        /* Number of uploads represented by the row: once completed, items
+         * are removed from the model and counted in a summary row, which
+         * comes first and has no UploadItemRole. */
+        ItemCountRole,
+        /* Of the current upload */
+        BytesSentRole,
+        BytesTotalRole,
+        /* Bytes per second, while the item is being uploaded */
+        ThroughputRole,
+        /* Seconds, or -1 if unknown */
+        EtaRole,
     };
 
     enum Status {
@@ -32,25 +45,74 @@ public:
         Warning,
     };
 
+    /* The upload order is decided by applying the rules in sequence; items
+     * which are equal for all the rules are uploaded in the order they
+     * were requested. */
+    enum PriorityRule {
+        LightsFirst = 0, // then unknown types, then calibration frames
+        NewestFirst,
+        SmallestFirst,
+    };
+
+    struct Statistics {
+        Statistics(): throughput(0), bytesSent(0), bytesRemaining(0),
+            eta(-1) {}
+        /* Bytes per second, averaged over the last several seconds */
+        double throughput;
+        /* Since the queue was created */
+        qint64 bytesSent;
+        /* Of the files which are queued or being uploaded */
+        qint64 bytesRemaining;
+        /* Seconds, or -1 if unknown */
+        int eta;
+    };
+
     UploadQueue(QObject *parent = 0);
     virtual ~UploadQueue();
 
     Site *site() const;
 
-    void requestUpload(const QString &filePath, const QString &fileName);
+    /* Unless the file is known to be complete, it will be uploaded once it
+     * stops changing. If the image type is known (for example, saved by a
+     * previous run), the file doesn't need to be probed for it. */
+    void requestUpload(const QString &filePath, const QString &fileName,
+                       bool fileIsComplete = false,
+                       ImageType imageType = UnknownType);
+
+    bool compressionEnabled() const;
+
+    /* How long to wait before checking whether a file which was being
+     * written is complete; the following checks back off from this. It
+     * applies to the uploads requested afterwards. */
+    void setSettleInterval(int msecs);
+    int settleInterval() const;
+
+    void setPriorityRules(const QList<PriorityRule> &rules);
+    QList<PriorityRule> priorityRules() const;
 
     Status status() const;
     Site::ErrorCode lastUploadError() const;
+    /* Number of uploads, including the completed ones */
+    int itemCount() const;
     void itemsStatus(int *succeeded, int *inProgress = 0,
                      int *failed = 0, int *retryLater = 0) const;
+    Statistics statistics() const;
 
     // reimplemented virtual methods:
     QVariant data(const QModelIndex &index,
                   int role = Qt::DisplayRole) const;
     int rowCount(const QModelIndex &parent = QModelIndex()) const;
 
+public Q_SLOTS:
+    void setCompressionEnabled(bool enabled);
+
 Q_SIGNALS:
     void statusChanged(UploadQueue::Status status);
+    /* Emitted once for each completed upload */
+    void itemUploaded(UploadItem *item);
+    /* Emitted at most once per second, together with the dataChanged()
+     * signal for the items being uploaded */
+    void statisticsChanged();
 
 private:
     UploadQueuePrivate *d_ptr;
@@ -36,6 +36,7 @@ SOURCES += \
     config-screen.cpp \
     configuration.cpp \
     controller.cpp \
+    directory-scanner.cpp \
     file-log.cpp \
     file-monitor.cpp \
     main.cpp \
@@ -51,6 +52,7 @@ HEADERS += \
     configuration.h \
     controller.h \
     debug.h \
+    directory-scanner.h \
     file-log.h \
     file-monitor.h \
     status-screen.h \